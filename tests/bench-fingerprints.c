@@ -0,0 +1,281 @@
+/*
+ * bench-fingerprints: Measures the throughput of the fingerprint automaton against a per-signature search
+ *
+ * Copyright (C) 2017 Fernando Gont <fgont@si6networks.com>
+ *
+ * Programmed by Fernando Gont for SI6 Networks <https://www.si6networks.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build and run with: make bench
+ *
+ * Databases of increasing numbers of signatures (masked byte patterns, anywhere in the payload) are
+ * matched against a corpus of datagrams of typical response lengths, a fourth of which contain one of
+ * the signatures. match_fingerprint() classifies each datagram in a single pass, while the baseline
+ * searches the payload for each signature in turn with memmem(), as one comparison per signature did
+ * before. Both must classify every datagram the same way.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <pcap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libiot.h"
+
+#define BENCH_NSEC		500000000	/* Each measurement lasts at least this long */
+#define CORPUS_SIZE		4096		/* Datagrams of the corpus */
+#define MIN_DATAGRAM	64
+#define MAX_DATAGRAM	1472
+#define MIN_PATTERN		8
+#define MAX_PATTERN		24
+
+struct corpus{
+	unsigned char	*data[CORPUS_SIZE];
+	size_t			len[CORPUS_SIZE];
+	size_t			nbytes;
+};
+
+void				build_db(struct fpdb *, unsigned int);
+void				build_corpus(struct corpus *, struct fpdb *);
+struct fingerprint	*search_fingerprint(struct fpdb *, unsigned char *, size_t);
+void				bench(const char *, struct fpdb *, struct corpus *, unsigned int);
+void				destroy_db(struct fpdb *);
+void				destroy_corpus(struct corpus *);
+
+/* Keeps the compiler from discarding the results */
+volatile unsigned int	sink;
+
+
+int main(int argc, char **argv){
+	struct fpdb		db;
+	struct corpus	corpus;
+	unsigned int	sizes[]= {2, 16, 64, 256}, s, i;
+
+	srandom(1);
+
+	for(s=0; s < sizeof(sizes)/sizeof(unsigned int); s++){
+		build_db(&db, sizes[s]);
+		build_corpus(&corpus, &db);
+
+		/* Both must classify every datagram the same way */
+		for(i=0; i < CORPUS_SIZE; i++){
+			if(match_fingerprint(&db, corpus.data[i], corpus.len[i], FP_ANY_FAMILY) != search_fingerprint(&db, corpus.data[i], corpus.len[i])){
+				printf("Datagram %u is classified differently\n", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		printf("%u signatures (%u automaton states), %u datagrams (%lu bytes):\n", db.nfps, db.nstates, CORPUS_SIZE, \
+				(unsigned long) corpus.nbytes);
+		bench("memmem() for each signature", &db, &corpus, FALSE);
+		bench("match_fingerprint()", &db, &corpus, TRUE);
+		destroy_corpus(&corpus);
+		destroy_db(&db);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Function: build_db()
+ *
+ * Builds a database of random signatures. Two bytes of each pattern (e.g. a length field) are not significant
+ */
+
+void build_db(struct fpdb *db, unsigned int nfps){
+	struct fingerprint	fp;
+	unsigned int		i;
+	size_t				j;
+
+	init_fpdb(db);
+
+	for(i=0; i < nfps; i++){
+		memset(&fp, 0, sizeof(fp));
+		fp.family= i % 4;
+		fp.desc= "Synthetic signature";
+		fp.npattern= MIN_PATTERN + random() % (MAX_PATTERN - MIN_PATTERN + 1);
+		fp.offset= FP_ANY_OFFSET;
+		fp.minlen= 0;
+		fp.maxlen= FP_ANY_LENGTH;
+
+		if( (fp.pattern=malloc(fp.npattern)) == NULL || (fp.mask=malloc(fp.npattern)) == NULL){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
+		}
+
+		for(j=0; j < fp.npattern; j++){
+			fp.pattern[j]= random();
+			fp.mask[j]= (j == 4 || j == 5)?0x00:0xff;
+		}
+
+		if(add_fingerprint(db, &fp) == FAILURE){
+			puts("Error adding fingerprint");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(compile_fpdb(db) == FAILURE){
+		puts("Error compiling the fingerprints");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Function: build_corpus()
+ *
+ * Builds a corpus of random datagrams, a fourth of which contain one of the signatures
+ */
+
+void build_corpus(struct corpus *corpus, struct fpdb *db){
+	struct fingerprint	*fp;
+	unsigned int		i;
+	size_t				j, off;
+
+	corpus->nbytes= 0;
+
+	for(i=0; i < CORPUS_SIZE; i++){
+		corpus->len[i]= MIN_DATAGRAM + random() % (MAX_DATAGRAM - MIN_DATAGRAM + 1);
+		corpus->nbytes+= corpus->len[i];
+
+		if( (corpus->data[i]=malloc(corpus->len[i])) == NULL){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
+		}
+
+		for(j=0; j < corpus->len[i]; j++)
+			corpus->data[i][j]= random();
+
+		if((i % 4) == 0){
+			fp= &(db->fps[random() % db->nfps]);
+			off= random() % (corpus->len[i] - fp->npattern + 1);
+
+			for(j=0; j < fp->npattern; j++)
+				corpus->data[i][off + j]= fp->pattern[j];
+		}
+	}
+}
+
+
+/*
+ * Function: search_fingerprint()
+ *
+ * Classifies a payload by searching it for each signature in turn (the baseline). Returns the
+ * fingerprint that matches at the lowest position, as match_fingerprint() does
+ */
+
+struct fingerprint *search_fingerprint(struct fpdb *db, unsigned char *data, size_t len){
+	struct fingerprint	*fp, *best=NULL;
+	unsigned char		*p;
+	size_t				start, bstart=0;
+	unsigned int		i;
+
+	for(i=0; i < db->nfps; i++){
+		fp= &(db->fps[i]);
+
+		/* The significant run of the pattern is searched for, and the whole pattern is then checked */
+		for(p= data; (p=memmem(p, len - (p - data), fp->pattern + fp->keyoff, fp->nkey)) != NULL; p++){
+			if((size_t) (p - data) < fp->keyoff)
+				continue;
+
+			start= (p - data) - fp->keyoff;
+
+			if(check_fingerprint(fp, data, len, start)){
+				if(best == NULL || (start + fp->keyoff + fp->nkey) < (bstart + best->keyoff + best->nkey))
+					best= fp, bstart= start;
+
+				break;
+			}
+		}
+	}
+
+	return(best);
+}
+
+
+/*
+ * Function: bench()
+ *
+ * Classifies the corpus repeatedly for at least BENCH_NSEC nanoseconds, and prints the throughput
+ */
+
+void bench(const char *name, struct fpdb *db, struct corpus *corpus, unsigned int automaton_f){
+	uint64_t		start, elapsed;
+	unsigned long	n=0;
+	unsigned int	i;
+
+	start= monotonic_nsec();
+
+	do{
+		for(i=0; i < CORPUS_SIZE; i++){
+			if(automaton_f)
+				sink+= (match_fingerprint(db, corpus->data[i], corpus->len[i], FP_ANY_FAMILY) != NULL);
+			else
+				sink+= (search_fingerprint(db, corpus->data[i], corpus->len[i]) != NULL);
+		}
+
+		n++;
+		elapsed= monotonic_nsec() - start;
+	}while(elapsed < BENCH_NSEC);
+
+	printf("  %-30s %10.1f MB/s %12.0f datagrams/s\n", name, ((double) corpus->nbytes * n * 1000) / elapsed, \
+			((double) CORPUS_SIZE * n * 1000000000) / elapsed);
+}
+
+
+/*
+ * Function: destroy_db()
+ *
+ * Releases a database built with build_db()
+ */
+
+void destroy_db(struct fpdb *db){
+	unsigned int	i;
+
+	for(i=0; i < db->nfps; i++){
+		free(db->fps[i].pattern);
+		free(db->fps[i].mask);
+	}
+
+	destroy_fpdb(db);
+}
+
+
+/*
+ * Function: destroy_corpus()
+ *
+ * Releases a corpus built with build_corpus()
+ */
+
+void destroy_corpus(struct corpus *corpus){
+	unsigned int	i;
+
+	for(i=0; i < CORPUS_SIZE; i++)
+		free(corpus->data[i]);
+}
@@ -0,0 +1,580 @@
+/*
+ * bench-json: Measures the throughput of the JSON tokenizer against the previous JSON parser
+ *
+ * Copyright (C) 2017 Fernando Gont <fgont@si6networks.com>
+ *
+ * Programmed by Fernando Gont for SI6 Networks <https://www.si6networks.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build and run with: make bench
+ *
+ * Two representative payloads (a get_sysinfo response, and a get_dev_icon response carrying a
+ * 16 KB icon) are processed the way the tools do: the previous parser extracts the members of
+ * system.get_sysinfo (or system.get_dev_icon) with three levels of json_get_objects(), while the
+ * current code resolves the same paths with json_get_paths(). json_tokenize() of the whole payload is
+ * measured, too. The current code is measured with each SIMD implementation supported by the CPU.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <pcap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libiot.h"
+
+#define BENCH_NSEC		500000000	/* Each measurement lasts at least this long */
+#define ICON_LENGTH		16384
+
+#define OLD_MAX_JSON_ITEMS	150
+
+/* The previous parser copied each first-level member of an object into allocated strings */
+struct old_json{
+	unsigned int	nitem;
+	unsigned int	maxitems;
+	char			*key[OLD_MAX_JSON_ITEMS];
+	unsigned int	key_l[OLD_MAX_JSON_ITEMS];
+	char			*value[OLD_MAX_JSON_ITEMS];
+	unsigned int	value_l[OLD_MAX_JSON_ITEMS];
+};
+
+struct payload{
+	const char		*name;
+	char			*s;
+	size_t			len;
+	char			*object;		/* Object that holds the members (e.g. "\"get_sysinfo\"") */
+	char			**keys;
+	char			**paths;
+	unsigned int	nkeys;
+};
+
+struct old_json	*old_json_get_objects(char *, unsigned int);
+struct old_json	*old_json_alloc_struct(void);
+void			old_json_free_struct(struct old_json *);
+unsigned int	old_json_add_item(struct old_json *, char *, unsigned int, char *, unsigned int);
+unsigned int	old_json_get_value(struct old_json *, struct json_value *, char *);
+unsigned int	old_json_remove_quotes(struct old_json *);
+unsigned int	old_get_members(struct payload *);
+unsigned int	new_get_members(struct payload *);
+unsigned int	new_tokenize(struct payload *);
+void			bench(const char *, unsigned int (*)(struct payload *), struct payload *);
+char			*build_sysinfo(size_t *);
+char			*build_icon(size_t *);
+
+/* Keeps the compiler from discarding the results */
+volatile unsigned int	sink;
+
+char	*sysinfo_keys[]= {"type", "model", "dev_name", "alias"};
+char	*sysinfo_paths[]= {"system.get_sysinfo.type", "system.get_sysinfo.model", "system.get_sysinfo.dev_name", \
+							"system.get_sysinfo.alias"};
+char	*icon_keys[]= {"icon", "hash"};
+char	*icon_paths[]= {"system.get_dev_icon.icon", "system.get_dev_icon.hash"};
+
+
+int main(int argc, char **argv){
+	struct payload	payloads[2];
+	unsigned int	i;
+	int				levels[]= {SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2};
+	const char		*names[]= {"json_get_paths (scalar)", "json_get_paths (SSE2)", "json_get_paths (AVX2)"};
+	const char		*tnames[]= {"json_tokenize (scalar)", "json_tokenize (SSE2)", "json_tokenize (AVX2)"};
+	unsigned int	p, l;
+
+	payloads[0].name= "get_sysinfo response";
+	payloads[0].s= build_sysinfo(&(payloads[0].len));
+	payloads[0].object= "\"get_sysinfo\"";
+	payloads[0].keys= sysinfo_keys;
+	payloads[0].paths= sysinfo_paths;
+	payloads[0].nkeys= sizeof(sysinfo_keys)/sizeof(char *);
+
+	payloads[1].name= "get_dev_icon response";
+	payloads[1].s= build_icon(&(payloads[1].len));
+	payloads[1].object= "\"get_dev_icon\"";
+	payloads[1].keys= icon_keys;
+	payloads[1].paths= icon_paths;
+	payloads[1].nkeys= sizeof(icon_keys)/sizeof(char *);
+
+	for(p=0; p < 2; p++){
+		/* Both parsers must find all the members */
+		if(old_get_members(&(payloads[p])) != payloads[p].nkeys || new_get_members(&(payloads[p])) != payloads[p].nkeys){
+			printf("Could not parse the %s\n", payloads[p].name);
+			exit(EXIT_FAILURE);
+		}
+
+		printf("%s (%lu bytes):\n", payloads[p].name, (unsigned long) payloads[p].len);
+		bench("json_get_objects (previous parser)", old_get_members, &(payloads[p]));
+
+		for(l=0; l < sizeof(levels)/sizeof(int); l++){
+			if(simd_select(levels[l]) == FAILURE)
+				continue;
+
+			bench(names[l], new_get_members, &(payloads[p]));
+			bench(tnames[l], new_tokenize, &(payloads[p]));
+		}
+
+		simd_select(SIMD_AUTO);
+	}
+
+	for(i=0; i < 2; i++)
+		free(payloads[i].s);
+
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Function: bench()
+ *
+ * Runs a function on a payload for at least BENCH_NSEC nanoseconds, and prints its throughput
+ */
+
+void bench(const char *name, unsigned int (*f)(struct payload *), struct payload *payload){
+	uint64_t		start, elapsed;
+	unsigned long	n=0, i;
+
+	start= monotonic_nsec();
+
+	do{
+		for(i=0; i < 64; i++)
+			sink+= f(payload);
+
+		n+= 64;
+		elapsed= monotonic_nsec() - start;
+	}while(elapsed < BENCH_NSEC);
+
+	printf("  %-36s %10.1f MB/s %12.0f ns/payload\n", name, ((double) payload->len * n * 1000) / elapsed, (double) elapsed / n);
+}
+
+
+/*
+ * Function: old_get_members()
+ *
+ * Obtains the members of system.<object> with the previous parser, as the tools did
+ */
+
+unsigned int old_get_members(struct payload *payload){
+	struct old_json		*json1, *json2, *json3;
+	struct json_value	json_value;
+	unsigned int		i, n=0;
+
+	if( (json1=old_json_get_objects(payload->s, payload->len)) == NULL)
+		return(0);
+
+	if(old_json_get_value(json1, &json_value, "\"system\"") && (json2=old_json_get_objects(json_value.value, json_value.len)) != NULL){
+		if(old_json_get_value(json2, &json_value, payload->object) && (json3=old_json_get_objects(json_value.value, json_value.len)) != NULL){
+			old_json_remove_quotes(json3);
+
+			for(i=0; i < payload->nkeys; i++){
+				if(old_json_get_value(json3, &json_value, payload->keys[i]))
+					n++;
+			}
+
+			old_json_free_struct(json3);
+		}
+
+		old_json_free_struct(json2);
+	}
+
+	old_json_free_struct(json1);
+	return(n);
+}
+
+
+/*
+ * Function: new_get_members()
+ *
+ * Obtains the members of system.<object> with json_get_paths()
+ */
+
+unsigned int new_get_members(struct payload *payload){
+	struct json_value	values[JSON_MAX_PATHS];
+	int					n;
+
+	n= json_get_paths(payload->s, payload->len, payload->paths, values, payload->nkeys);
+	return((n > 0)?n:0);
+}
+
+
+/*
+ * Function: new_tokenize()
+ *
+ * Tokenizes the whole payload with json_tokenize()
+ */
+
+unsigned int new_tokenize(struct payload *payload){
+	struct json_token	tokens[JSON_MAX_TOKENS];
+	int					n;
+
+	n= json_tokenize(payload->s, payload->len, tokens, JSON_MAX_TOKENS);
+	return((n > 0)?n:0);
+}
+
+
+/*
+ * Function: build_sysinfo()
+ *
+ * Builds the get_sysinfo response of an HS110 smart plug
+ */
+
+char *build_sysinfo(size_t *len){
+	const char	*sysinfo= "{\"system\":{\"get_sysinfo\":{\"err_code\":0,\"sw_ver\":\"1.2.5 Build 171213 Rel.101523\","
+				"\"hw_ver\":\"2.0\",\"type\":\"IOT.SMARTPLUGSWITCH\",\"model\":\"HS110(EU)\",\"mac\":\"50:C7:BF:00:11:22\","
+				"\"dev_name\":\"Wi-Fi Smart Plug With Energy Monitoring\",\"alias\":\"Lab plug\",\"relay_state\":1,"
+				"\"on_time\":86244,\"active_mode\":\"schedule\",\"feature\":\"TIM:ENE\",\"updating\":0,\"icon_hash\":\"\","
+				"\"rssi\":-52,\"led_off\":0,\"longitude_i\":-585238,\"latitude_i\":-346177,"
+				"\"hwId\":\"044A516EE63C875F9458DA25C2CCC5A0\",\"fwId\":\"00000000000000000000000000000000\","
+				"\"oemId\":\"1998A14DAA86E4E001FD7CAF42868B5E\",\"deviceId\":\"8006BE6BA3A6E3F9A5A7C4A3D1B5C0D9E3F2A1B0\","
+				"\"next_action\":{\"type\":1,\"id\":\"A1B2C3D4E5F60718293A4B5C6D7E8F90\",\"schd_sec\":72000,\"action\":0},"
+				"\"ntc_state\":0}},\"emeter\":{\"get_realtime\":{\"voltage_mv\":229541,\"current_ma\":37,\"power_mw\":4120,"
+				"\"total_wh\":1203,\"err_code\":0}}}";
+	char		*s;
+
+	*len= strlen(sysinfo);
+
+	if( (s=malloc(*len + 1)) == NULL){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(s, sysinfo, *len + 1);
+	return(s);
+}
+
+
+/*
+ * Function: build_icon()
+ *
+ * Builds a get_dev_icon response, with ICON_LENGTH bytes of base64-encoded icon
+ */
+
+char *build_icon(size_t *len){
+	const char	*b64= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char		*s;
+	size_t		n, i;
+
+	if( (s=malloc(ICON_LENGTH + 128)) == NULL){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	n= sprintf(s, "{\"system\":{\"get_dev_icon\":{\"icon\":\"");
+	srandom(1);
+
+	for(i=0; i < ICON_LENGTH; i++)
+		s[n++]= b64[random() % 64];
+
+	n+= sprintf(s + n, "\",\"hash\":\"6E1B5A2F0C9D8E7F\",\"err_code\":0}}}");
+	*len= n;
+	return(s);
+}
+
+
+/*
+ * The previous parser, as it was before the structural index (is_valid_json_string() returned TRUE
+ * straight away, and is hence omitted). The only change is that json_free_struct() releases the
+ * strings of the items, rather than leaking them.
+ */
+
+/*
+ * Function: old_json_get_objects()
+ *
+ * Obtains the first-level JSON objects
+ */
+
+struct old_json *old_json_get_objects(char *s, unsigned int len){
+	struct old_json	*json;
+	unsigned int	i;
+	char			*kstart=NULL, *kend=NULL, *vstart=NULL, *vend=NULL;
+	char			quoted_f=FALSE, open_quote_f=FALSE;
+	int				bracket_depth=0, curly_depth=0;
+
+	if( (json=old_json_alloc_struct()) == NULL)
+		return(NULL);
+
+	for(i=0; i < len; i++){
+		if(open_quote_f){
+			switch(s[i]){
+				case '\\':
+					quoted_f= TRUE;
+					break;
+
+				case '"':
+					if(quoted_f)
+						quoted_f= FALSE;
+					else
+						open_quote_f= FALSE;
+
+					break;
+
+				default:
+					quoted_f= FALSE;
+					break;
+			}
+		}
+		else{
+			switch(s[i]){
+				case '\\':
+					quoted_f= TRUE;
+					break;
+
+				case '[':
+					bracket_depth++;
+					quoted_f= FALSE;
+					break;
+
+				case ']':
+					bracket_depth--;
+					quoted_f= FALSE;
+
+					if(bracket_depth < 0)
+						return(NULL);
+
+					break;
+
+				case '{':
+					curly_depth++;
+					if(curly_depth == 1 && kstart==NULL)
+						kstart= s+i+1;
+
+					quoted_f= FALSE;
+					break;
+
+				case ':':
+					if(curly_depth == 1 && kstart != NULL && kend==NULL){
+						kend= s+i;
+						vstart= s+i+1;
+					}
+
+					quoted_f= FALSE;
+					break;
+
+				case ',':
+					if(curly_depth == 1 && kstart != NULL && kend!=NULL && vstart!=NULL){
+						vend= s+i;
+
+						if(!old_json_add_item(json, kstart, kend-kstart, vstart, vend-vstart)){
+							old_json_free_struct(json);
+							return(NULL);
+						}
+
+						kstart= s+i+1;
+						kend= NULL;
+						vstart= NULL;
+						vend= NULL;
+					}
+					else if(curly_depth == 1 && kstart == NULL && kend==NULL && vstart==NULL && vend==NULL){
+						kstart= s+i+1;
+					}
+
+					quoted_f= FALSE;
+					break;
+
+				case '}':
+					curly_depth--;
+
+					if(curly_depth <= 1 && curly_depth >= 0  && kstart != NULL && kend!=NULL && vstart!=NULL){
+						vend= s+i+curly_depth;
+
+						if(!old_json_add_item(json, kstart, kend-kstart, vstart, vend-vstart)){
+							old_json_free_struct(json);
+							return(NULL);
+						}
+
+						kstart= NULL;
+						kend= NULL;
+						vstart= NULL;
+						vend= NULL;
+					}
+
+					quoted_f= FALSE;
+
+					if(curly_depth < 0)
+						return(NULL);
+
+					break;
+
+				case '"':
+					if(quoted_f)
+						quoted_f= FALSE;
+					else
+						open_quote_f=TRUE;
+
+					break;
+
+				default:
+					quoted_f= FALSE;
+					break;
+			}
+		}
+	}
+
+	return(json);
+}
+
+
+/*
+ * Function: old_json_alloc_struct()
+ *
+ * Allocates a struct old_json
+ */
+
+struct old_json *old_json_alloc_struct(void){
+	struct old_json	*json;
+	unsigned int	i;
+
+	if( (json= malloc(sizeof(struct old_json))) == NULL)
+		return(NULL);
+
+	json->nitem=0;
+	json->maxitems= OLD_MAX_JSON_ITEMS;
+
+	for(i=0; i<OLD_MAX_JSON_ITEMS; i++){
+		json->key[i]=NULL;
+		json->key_l[i]=0;
+		json->value[i]=NULL;
+		json->value_l[i]=0;
+	}
+
+	return(json);
+}
+
+
+/*
+ * Function: old_json_free_struct()
+ *
+ * Releases a struct old_json
+ */
+
+void old_json_free_struct(struct old_json *json){
+	unsigned int i;
+
+	for(i=0; i < json->nitem; i++){
+		free(json->key[i]);
+		free(json->value[i]);
+	}
+
+	free(json);
+}
+
+
+/*
+ * Function: old_json_add_item()
+ *
+ * Add an item to a struct old_json
+ */
+
+unsigned int old_json_add_item(struct old_json *json, char *kstart, unsigned int klen, char *vstart, unsigned int vlen){
+	if(json->nitem >= json->maxitems)
+		return(FALSE);
+
+	if( (json->key[json->nitem]= malloc(klen+1)) == NULL)
+		return(FALSE);
+
+	if( (json->value[json->nitem]= malloc(vlen+1)) == NULL){
+		free(json->key[json->nitem]);
+		return(FALSE);
+	}
+
+	memcpy(json->key[json->nitem], kstart, klen);
+	*(json->key[json->nitem]+klen)= 0x00;
+	json->key_l[json->nitem]= klen;
+	memcpy(json->value[json->nitem], vstart, vlen);
+	json->value_l[json->nitem]= vlen;
+	*(json->value[json->nitem]+vlen)= 0x00;
+	json->nitem++;
+	return(TRUE);
+}
+
+
+/*
+ * Function: old_json_get_value()
+ *
+ * Obtain the value for a given key
+ */
+
+unsigned int old_json_get_value(struct old_json *json, struct json_value *json_value, char *key){
+	unsigned int i, klen;
+
+	klen= Strnlen(key, 50);
+
+	for(i=0; i < json->nitem; i++){
+		if(strncmp(json->key[i], key, klen) == 0){
+			json_value->value= json->value[i];
+			json_value->len= json->value_l[i];
+			return(TRUE);
+		}
+	}
+
+	return(FALSE);
+}
+
+
+/*
+ * Function: old_json_remove_quotes()
+ *
+ * Remove quotes in keys and values
+ */
+
+unsigned int old_json_remove_quotes(struct old_json *json){
+	char			*buff;
+	unsigned int	i;
+
+	for(i=0; i<json->nitem;i++){
+		if(json->key_l[i] >= 2 && *(json->key[i]) == '"' && *(json->key[i] + json->key_l[i] - 1) == '"'){
+			if(json->key_l[i] == 2){
+				*(json->key[i])= 0x00;
+				json->key_l[i]=0;
+			}
+			else{
+				if( (buff=malloc(json->key_l[i] - 1)) == NULL)
+					return(FALSE);
+
+				memcpy(buff, (json->key[i]+1), json->key_l[i] - 2);
+				*(buff + json->key_l[i] - 2)= 0x00;
+				memcpy(json->key[i], buff, json->key_l[i] - 1);
+				json->key_l[i]= json->key_l[i]-2;
+				free(buff);
+			}
+		}
+
+		if(json->value_l[i] >= 2 && *(json->value[i]) == '"' && *(json->value[i] + json->value_l[i] -1 ) == '"'){
+			if(json->value_l[i] == 2){
+				*(json->value[i])= 0x00;
+				json->value_l[i]=0;
+			}
+			else{
+				if( (buff=malloc(json->value_l[i] - 1)) == NULL)
+					return(FALSE);
+
+				memcpy(buff, (json->value[i]+1), json->value_l[i] - 2);
+				*(buff + json->value_l[i] - 2)= 0x00;
+				memcpy(json->value[i], buff, json->value_l[i] - 1);
+				json->value_l[i]= json->value_l[i]-2;
+				free(buff);
+			}
+		}
+	}
+
+	return(TRUE);
+}
@@ -0,0 +1,236 @@
+/*
+ * test-tp-link-crypt: Checks the TP-Link autokey cipher against a reference implementation
+ *
+ * Copyright (C) 2017 Fernando Gont <fgont@si6networks.com>
+ *
+ * Programmed by Fernando Gont for SI6 Networks <https://www.si6networks.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build and run with: make test
+ *
+ * tp_link_crypt(), tp_link_decrypt() and tp_link_decrypt_chunk() are run with each SIMD
+ * implementation supported by the CPU, and must produce exactly the same output as the byte-at-a-time
+ * loops below for every length from 0 to MAX_LENGTH (by default) or to the length given as argument.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <pcap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libiot.h"
+
+#define MAX_LENGTH		2999
+#define GUARD_LENGTH	64
+#define GUARD_BYTE		0xa5
+
+void	ref_crypt(unsigned char *, size_t);
+void	ref_decrypt(unsigned char *, size_t);
+int		check_guards(unsigned char *, size_t);
+int		test_length(unsigned char *, unsigned char *, size_t);
+int		test_level(int, const char *, size_t);
+
+
+int main(int argc, char **argv){
+	size_t			maxlen= MAX_LENGTH;
+	unsigned int	nfailed=0;
+
+	if(argc > 1)
+		maxlen= strtoul(argv[1], NULL, 10);
+
+#ifdef X86_SIMD
+	/* Both SIMD code paths and the scalar tail must be exercised */
+	if(maxlen <= TP_LINK_SIMD_MIN){
+		printf("Length must be larger than TP_LINK_SIMD_MIN (%u)\n", TP_LINK_SIMD_MIN);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	srandom(1);
+
+	if(simd_select(SIMD_AVX2) == SUCCESS)
+		nfailed+= !test_level(SIMD_AVX2, "AVX2", maxlen);
+	else
+		puts("AVX2: skipped (not supported)");
+
+	if(simd_select(SIMD_SSE2) == SUCCESS)
+		nfailed+= !test_level(SIMD_SSE2, "SSE2", maxlen);
+	else
+		puts("SSE2: skipped (not supported)");
+
+	if(simd_select(SIMD_SCALAR) == SUCCESS)
+		nfailed+= !test_level(SIMD_SCALAR, "scalar", maxlen);
+
+	exit(nfailed?EXIT_FAILURE:EXIT_SUCCESS);
+}
+
+
+/*
+ * Function: ref_crypt()
+ *
+ * Encrypts a buffer with the TP-Link autokey cipher, one byte at a time
+ */
+
+void ref_crypt(unsigned char *p, size_t size){
+	unsigned char	key= TP_LINK_KEY;
+	size_t			i;
+
+	for(i=0; i < size; i++){
+		p[i]= p[i] ^ key;
+		key= p[i];
+	}
+}
+
+
+/*
+ * Function: ref_decrypt()
+ *
+ * Decrypts a buffer encrypted with the TP-Link autokey cipher, one byte at a time
+ */
+
+void ref_decrypt(unsigned char *p, size_t size){
+	unsigned char	key= TP_LINK_KEY, c;
+	size_t			i;
+
+	for(i=0; i < size; i++){
+		c= key ^ p[i];
+		key= p[i];
+		p[i]= c;
+	}
+}
+
+
+/*
+ * Function: check_guards()
+ *
+ * Checks that the bytes around a buffer have not been overwritten
+ */
+
+int check_guards(unsigned char *buff, size_t size){
+	size_t	i;
+
+	for(i=0; i < GUARD_LENGTH; i++){
+		if(buff[i] != GUARD_BYTE || buff[GUARD_LENGTH + size + i] != GUARD_BYTE)
+			return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Function: test_length()
+ *
+ * Compares the cipher against the reference implementation for random data of the specified length.
+ * "ref" and "buff" must have room for the data plus GUARD_LENGTH bytes on each side
+ */
+
+int test_length(unsigned char *ref, unsigned char *buff, size_t size){
+	unsigned char	*p= buff + GUARD_LENGTH, key;
+	size_t			i, chunk;
+
+	memset(buff, GUARD_BYTE, size + 2 * GUARD_LENGTH);
+
+	for(i=0; i < size; i++)
+		ref[i]= random();
+
+	/* Encryption */
+	memcpy(p, ref, size);
+	ref_crypt(ref, size);
+	tp_link_crypt(p, size);
+
+	if(memcmp(p, ref, size) != 0 || !check_guards(buff, size)){
+		printf("tp_link_crypt() differs from the reference for length %lu\n", (unsigned long) size);
+		return(FALSE);
+	}
+
+	/* Decryption of the whole buffer */
+	ref_decrypt(ref, size);
+	tp_link_decrypt(p, size);
+
+	if(memcmp(p, ref, size) != 0 || !check_guards(buff, size)){
+		printf("tp_link_decrypt() differs from the reference for length %lu\n", (unsigned long) size);
+		return(FALSE);
+	}
+
+	/* Decryption in chunks of random length, both below and above TP_LINK_SIMD_MIN */
+	ref_crypt(ref, size);
+	memcpy(p, ref, size);
+	ref_decrypt(ref, size);
+	key= TP_LINK_KEY;
+
+	for(i=0; i < size; i+= chunk){
+		chunk= 1 + random() % 200;
+
+		if(chunk > (size - i))
+			chunk= size - i;
+
+		key= tp_link_decrypt_chunk(p + i, chunk, key);
+	}
+
+	if(memcmp(p, ref, size) != 0 || !check_guards(buff, size)){
+		printf("tp_link_decrypt_chunk() differs from the reference for length %lu\n", (unsigned long) size);
+		return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Function: test_level()
+ *
+ * Runs the tests for all lengths up to "maxlen" with the selected SIMD implementation
+ */
+
+int test_level(int level, const char *name, size_t maxlen){
+	unsigned char	*ref, *buff;
+	size_t			size;
+
+	if( (ref=malloc(maxlen + 1)) == NULL || (buff=malloc(maxlen + 1 + 2 * GUARD_LENGTH)) == NULL){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	if(simd_level() != level){
+		printf("%s: could not be selected\n", name);
+		return(FALSE);
+	}
+
+	for(size=0; size <= maxlen; size++){
+		if(!test_length(ref, buff, size)){
+			printf("%s: FAILED\n", name);
+			free(ref);
+			free(buff);
+			return(FALSE);
+		}
+	}
+
+	printf("%s: OK (lengths 0 to %lu)\n", name, (unsigned long) maxlen);
+	free(ref);
+	free(buff);
+	return(TRUE);
+}
@@ -49,6 +49,13 @@
 #include <string.h>
 #include <setjmp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+#ifdef __linux__
+	#include <linux/filter.h>
+#endif
 
 #include "iot-scan.h"
 #include "iot-toolkit.h"
@@ -62,18 +69,265 @@ void				usage(void);
 int					process_config_file(const char *);
 
 
+/*
+   Set of nodes that have already responded. Addresses within the scanned prefix (if it is a /16
+   or smaller) are recorded in a bitmap; any other addresses are recorded in an open-addressing
+   hash set (linear probing), which grows as needed.
+ */
 struct nodes{
-	unsigned int	max;
+	uint32_t		base;		/* First address covered by the bitmap (host byte order) */
+	uint32_t		nbitmap;	/* Addresses covered by the bitmap (zero if there is no bitmap) */
+	uint32_t		*bitmap;
+	uint32_t		*set;		/* Addresses in host byte order (zero denotes an empty slot) */
+	unsigned int	bits;		/* The hash set has 2^bits slots */
+	unsigned int	nset;
+	unsigned char	zero_f;		/* 0.0.0.0 is in the set */
 	unsigned int	n;
-	struct in_addr  *node;
 };
 
-unsigned int 		create_local_nodes(struct nodes *);
+unsigned int 		create_local_nodes(struct nodes *, struct prefixv4_entry *);
 void				destroy_local_nodes(struct nodes *);
-void				add_to_local_nodes(struct nodes *, struct in_addr *);
+unsigned int		grow_local_nodes(struct nodes *);
+unsigned int		add_to_local_nodes(struct nodes *, struct in_addr *);
 unsigned int		is_in_local_nodes(struct nodes *, struct in_addr *);
 
 
+/*
+ * Device families that can be probed by iot-scan. Each entry describes the probe and the responses it
+ * elicits, such that supporting a new device family only requires a new entry (and its parser)
+ */
+struct probe_family{
+	uint32_t		type;		/* SCAN_SMART_PLUGS or SCAN_IP_CAMERAS */
+	uint16_t		dstport;	/* Port the probe is sent to */
+	uint16_t		srcport;	/* Port the responses are sent from */
+	char			*probe;
+	size_t			nprobe;
+	unsigned char	crypt_f;	/* The probe must be encrypted with tp_link_crypt() */
+	char			*packet;	/* Probe as sent, without addresses, source port and checksums (see init_probes()) */
+	size_t			npacket;
+	char			*payload;	/* Encoded probe payload (within the packet) */
+	uint32_t		ipsum;		/* Partial checksums of the constant fields of the packet */
+	uint32_t		udpsum;
+	size_t			minlen;		/* Range of valid response lengths */
+	size_t			maxlen;
+	void			(*parse)(char *, ssize_t, struct sockaddr_in *);	/* NULL: report the fingerprint */
+	unsigned char	enabled_f;
+	unsigned char	fingerprint_f;	/* Responses must match a fingerprint of the family */
+	struct nodes	nodes;		/* Nodes that have already responded */
+};
+
+#define FAMILY_TP_LINK_PLUG		0
+#define FAMILY_EDIMAX_PLUG		1
+#define FAMILY_TP_LINK_CAMERA	2
+#define FAMILY_GENIUS_CAMERA	3
+#define NUM_FAMILIES			4
+
+void				process_tp_link_plug(char *, ssize_t, struct sockaddr_in *);
+void				process_edimax_plug(char *, ssize_t, struct sockaddr_in *);
+
+struct probe_family	families[NUM_FAMILIES]={
+	{SCAN_SMART_PLUGS, TP_LINK_SMART_PORT, TP_LINK_SMART_PORT, TP_LINK_SMART_DISCOVER, sizeof(TP_LINK_SMART_DISCOVER)-1, TRUE, \
+		NULL, 0, NULL, 0, 0, 1, FP_ANY_LENGTH, process_tp_link_plug, FALSE},
+	{SCAN_SMART_PLUGS, EDIMAX_SMART_PLUG_SERVICE_PORT, EDIMAX_SMART_PLUG_SERVICE_PORT, EDIMAX_SMART_PLUG_DISCOVER, \
+		sizeof(EDIMAX_SMART_PLUG_DISCOVER), FALSE, NULL, 0, NULL, 0, 0, sizeof(struct edimax_discover_response), \
+		sizeof(struct edimax_discover_response), process_edimax_plug, FALSE},
+	{SCAN_IP_CAMERAS, TP_LINK_IP_CAMERA_TDDP_PORT, TP_LINK_IP_CAMERA_TDDP_PORT, TP_LINK_IP_CAMERA_DISCOVER, \
+		sizeof(TP_LINK_IP_CAMERA_DISCOVER), FALSE, NULL, 0, NULL, 0, 0, 1, FP_ANY_LENGTH, NULL, FALSE},
+	/* Genius cameras do not respond from the port the probe was sent to */
+	{SCAN_IP_CAMERAS, GENIUS_IP_CAMERA_SERVICE_PORT, GENIUS_IP_CAMERA_SENDING_PORT, GENIUS_IP_CAMERA_DISCOVER, \
+		sizeof(GENIUS_IP_CAMERA_DISCOVER), FALSE, NULL, 0, NULL, 0, 0, 1, FP_ANY_LENGTH, NULL, FALSE}
+};
+
+/* Built-in response fingerprints (more can be loaded from a fingerprint file with -P) */
+#define NUM_FINGERPRINTS		2
+
+struct fingerprint	fingerprints[NUM_FINGERPRINTS]={
+	{FAMILY_TP_LINK_CAMERA, "camera: TP-Link IP camera", (unsigned char *) TP_LINK_IP_CAMERA_RESPONSE, \
+		TP_LINK_IP_CAMERA_RESPONSE_MASK, sizeof(TP_LINK_IP_CAMERA_RESPONSE), 0, sizeof(TP_LINK_IP_CAMERA_RESPONSE), \
+		sizeof(TP_LINK_IP_CAMERA_RESPONSE)},
+	{FAMILY_GENIUS_CAMERA, "camera: Genius IP camera", \
+		(unsigned char *) GENIUS_IP_CAMERA_RESPONSE + sizeof(GENIUS_IP_CAMERA_RESPONSE) - GENIUS_IP_CAMERA_TRAILER_LEN, NULL, \
+		GENIUS_IP_CAMERA_TRAILER_LEN, sizeof(GENIUS_IP_CAMERA_RESPONSE) - GENIUS_IP_CAMERA_TRAILER_LEN, \
+		sizeof(GENIUS_IP_CAMERA_RESPONSE), sizeof(GENIUS_IP_CAMERA_RESPONSE)}
+};
+
+struct fpdb			fpdb;
+
+/* Maps the source port of a response to the enabled family that responds from it (NUM_FAMILIES if none) */
+unsigned char		port_family[65536];
+
+
+/* State employed for walking all addresses of the destination prefix */
+struct sweep{
+	uint32_t			base;		/* First address of the prefix (host byte order) */
+	unsigned long long	ntargets;
+	unsigned long long	naddrs;		/* Addresses of the prefix */
+	unsigned long long	next;		/* Position of the next target in the permutation */
+	uint32_t			index;		/* Index of the next target within the prefix */
+	unsigned char		skip_f;		/* The network and broadcast addresses are not probed */
+	unsigned int		family;		/* Next family to probe for the current target */
+	struct permutation	perm;		/* Order in which the targets are visited */
+};
+
+void				init_sweep(struct sweep *, struct prefixv4_entry *, uint64_t);
+void				sweep_skip(struct sweep *);
+void				sweep_target(struct sweep *, struct in_addr *, unsigned int *);
+unsigned int		sweep_advance(struct sweep *);
+
+
+/*
+   A (target, family) pair that has been probed, and whose response timeout has not yet expired.
+   It is tracked until a response arrives or the timeout for its last transmission expires.
+ */
+struct probe{
+	struct twheel_entry	entry;		/* Next retransmission or expiry (must be the first member) */
+	struct in_addr		target;
+	unsigned int		family;
+	unsigned int		ntx;		/* Number of transmissions so far */
+	uint64_t			sent;		/* Time of the last transmission */
+	uint32_t			hnext;		/* Next probe in the same hash bucket (or in the free list) */
+	unsigned char		queued_f;	/* Waiting in the retransmission queue rather than on the wheel */
+};
+
+struct inflight{
+	struct probe		*probes;
+	uint32_t			*buckets;	/* Hash table of the probes in flight, keyed by target and family */
+	uint32_t			nbuckets;	/* Power of two */
+	unsigned int		max;
+	unsigned int		n;
+	uint32_t			free;		/* List of unused probes */
+	struct twheel		wheel;
+	struct twheel_entry	*rtxq;		/* Probes due for retransmission, waiting for the token bucket */
+};
+
+unsigned int		create_inflight(struct inflight *, unsigned int, uint64_t);
+void				destroy_inflight(struct inflight *);
+uint32_t			inflight_hash(struct inflight *, struct in_addr *, unsigned int);
+struct probe		*add_inflight(struct inflight *, struct in_addr *, unsigned int);
+struct probe		*find_inflight(struct inflight *, struct in_addr *, unsigned int);
+void				remove_inflight(struct inflight *, struct probe *);
+
+
+/* State of a scan, shared by the event loop callbacks */
+struct scan_state{
+	struct reactor			reactor;
+	struct reactor_timer	rtx_timer;		/* Retransmissions (-L) or pacing of probes (-d) */
+	struct reactor_timer	end_timer;		/* Waits for the responses to the last probes */
+	struct reactor_timer	wheel_timer;	/* Drives the timing wheel of the probes in flight (-d) */
+	struct pktpool			rxpool;			/* Responses are received into, and parsed from, these buffers */
+	struct batch			txbatch;
+	struct token_bucket		tb;
+	struct inflight			inflight;
+	struct sweep			sweep;
+	struct quiescence		quiet;
+	struct rtt_estimator	rtt[NUM_FAMILIES];	/* Round-trip time of the responses to each family */
+	struct sockaddr_in		sockaddr_to;
+	int						sfd;
+	int						rfd;
+	pcap_t					*pcap;			/* Capture that collects the responses to a local scan (-C) */
+	int						dlt;
+	unsigned int			rxevents;		/* Events of interest on the socket, besides REACTOR_WRITE */
+	unsigned int			retrans;
+	uint64_t				sent;			/* Time of the last transmission */
+	unsigned char			sampled_f[NUM_FAMILIES];	/* The RTT of the last transmission has been sampled (-L) */
+	unsigned char			sweepdone_f;
+	unsigned char			idle_f;			/* Sending stopped until more probes can be sent */
+	unsigned int			maxtx;			/* Transmissions of each probe (-d) */
+	unsigned int			nactive;		/* Probes in flight that are yet to be retransmitted (-d) */
+	unsigned long long		nprobes;
+	unsigned long long		nanswered;
+	unsigned long long		ndropped;
+	unsigned long long		nunreported;	/* Answers the receiver threads could not report (-R) */
+};
+
+/* There are probes due for retransmission, or new targets that can be probed */
+#define PREFIX_PENDING(scan)	((scan)->inflight.rtxq != NULL || (!(scan)->sweepdone_f && (scan)->inflight.n < (scan)->inflight.max))
+
+/* State employed for reading the responses from a capture file (-F) */
+struct offline{
+	int					dlt;
+	struct pktpool		pool;
+	unsigned long long	nframes;
+	unsigned long long	nbytes;
+	unsigned long long	nresponses;	/* Datagrams sent from the port of a selected family */
+	unsigned long long	nclassified;	/* Responses that matched a fingerprint (-v) */
+	unsigned long long	nsecfp;		/* Time spent matching fingerprints (-v) */
+	unsigned char		inplace_f;	/* Frames can be modified (i.e., they live in a private mapping) */
+};
+
+/* Worker that scans the local subnet of one interface (-L without -i) */
+struct local_worker{
+	pthread_t			thread;
+	char				iface[IFACE_LENGTH];
+	struct in_addr		srcaddr;
+	int					fd;
+	pcap_t				*pcap;
+};
+
+/* Receiver thread of a unicast sweep (-R), which decrypts and parses its own share of the responses */
+struct receiver{
+	pthread_t			thread;
+	unsigned int		index;
+	int					fd;
+	struct pktpool		pool;
+	unsigned long long	ndropped;
+	unsigned long long	nunreported;	/* Answers dropped because the answer pipe was full */
+};
+
+/* Probe answered, as reported by a receiver thread to the event loop */
+struct answer{
+	struct in_addr		addr;
+	uint16_t			sport;
+	uint64_t			when;
+};
+
+void				scan_local(int, pcap_t *);
+int					open_local_socket(struct in_addr *, char *);
+unsigned int		open_local_workers(void);
+void				scan_local_workers(void);
+void				*local_worker(void *);
+void				create_family_nodes(struct prefixv4_entry *);
+void				destroy_family_nodes(void);
+void				local_io(struct reactor *, int, unsigned int, void *);
+void				local_retransmit(struct reactor *, void *);
+void				local_capture(struct reactor *, int, unsigned int, void *);
+void				capture_frame(unsigned char *, const struct pcap_pkthdr *, const unsigned char *);
+void				set_capture_filter(pcap_t *);
+void				read_capture(char *);
+void				offline_frame(unsigned char *, const struct pcap_pkthdr *, const unsigned char *);
+void				scan_end(struct reactor *, void *);
+void				schedule_end(struct scan_state *);
+void				scan_prefix(void);
+void				prefix_read(struct reactor *, int, unsigned int, void *);
+void				prefix_answers(struct reactor *, int, unsigned int, void *);
+void				prefix_write(struct reactor *, int, unsigned int, void *);
+void				prefix_pace(struct reactor *, void *);
+void				prefix_resume(struct scan_state *);
+void				prefix_tick(struct reactor *, void *);
+void				prefix_schedule(struct scan_state *);
+void				probe_expired(struct twheel *, struct twheel_entry *, void *);
+void				release_probe(struct scan_state *, struct probe *);
+void				answer_probe(struct scan_state *, struct in_addr *, uint16_t, uint64_t);
+int					check_response(unsigned char *, size_t, struct sockaddr_in *, unsigned char **, size_t *);
+int					open_receiver_socket(unsigned int);
+void				start_receivers(void);
+void				stop_receivers(struct scan_state *);
+void				*receiver(void *);
+void				init_port_families(void);
+void				init_fingerprints(void);
+void				init_probes(void);
+unsigned int		response_family(uint16_t);
+uint64_t			local_rto(struct scan_state *, unsigned int);
+uint64_t			probe_timeout(struct scan_state *, struct probe *);
+uint16_t			cookie_port(struct in_addr *);
+size_t				build_probe(char *, size_t, struct in_addr *, unsigned int);
+void				process_response(char *, ssize_t, struct sockaddr_in *);
+void				report_node(unsigned int, struct in_addr *, char *);
+void				start_output(void);
+void				stop_output(void);
+void				*output_writer(void *);
+
+
 
 /* Used for router discovery */
 struct iface_data			idata;
@@ -121,7 +375,7 @@ unsigned char			donesending_f=FALSE;
 uint16_t				srcport, dstport;
 uint32_t				scan_type;
 char					scan_type_f=FALSE;
-unsigned long			pktinterval, rate;
+unsigned long			pktinterval;
 unsigned int			packetsize;
 
 struct prefixv4_entry	prefix;
@@ -130,30 +384,58 @@ char					*charstart, *charend, *lastcolon;
 unsigned int			nsleep;
 int						sel;
 fd_set					sset, rset, wset, eset;
-struct timeval			curtime, pcurtime, lastprobe;
+struct timeval			pcurtime;
 struct tm				pcurtimetm;
 
 unsigned int			retrans;
+unsigned long			rx_timer=500000;
+unsigned long			rate= DEFAULT_PROBE_RATE;
+unsigned int			max_inflight= DEFAULT_MAX_INFLIGHT;
+
+/* Raw sockets employed for unicast sweeps */
+int						raw_sfd, raw_rfd;
+unsigned char			cookie_key[SIPHASH_KEY_LEN];
+
+/* Seed of the pseudorandom order in which sweep targets are visited */
+uint64_t				seed;
+unsigned char			seed_f=FALSE;
+
+/* Workers employed for scanning the local subnets of all interfaces */
+struct local_worker		workers[MAX_IFACES];
+unsigned int			nworkers=0;
+
+/* Serializes the output, and the sets of nodes that have responded, among threads */
+pthread_mutex_t			output_mutex= PTHREAD_MUTEX_INITIALIZER;
+
+/* Ring of output records, and the thread that writes them */
+struct ring				output_ring;
+pthread_t				output_thread;
+unsigned int			output_done_f=FALSE;
+unsigned char			output_wait_f=FALSE;
+
+/* Responses to local scans can be collected with packet capture rather than from the socket */
+unsigned char			capture_f=FALSE;
+
+/* Responses can also be read from a capture file (-F) */
+char					*offline_file;
+char					*fingerprint_file=NULL;
+unsigned char			offline_f=FALSE;
+
+/* Receiver threads of unicast sweeps, which report answered probes to the event loop through a pipe */
+struct receiver			receivers[MAX_RECEIVERS];
+unsigned int			nreceivers=1;
+int						answer_pipe[2], stop_pipe[2];
+
+/* The scan ends early once further responses become unlikely (-O is the upper bound) */
+double					quiet_threshold= QUIESCENCE_THRESHOLD;
 
 int main(int argc, char **argv){
 	extern char				*optarg;
 	int						r;
 	struct addrinfo			hints, *res, *aiptr;
 	struct target_ipv6		target;
-	struct timeval			timeout;
 	void					*voidptr;
-	const int				on=1;
-	struct sockaddr_in		sockaddr_in, sockaddr_from, sockaddr_to;
-	socklen_t				sockaddrfrom_len;
-	struct json				*json1, *json2, *json3;
-	struct json_value		json_value;
-	char					*alias, *dev_name, *type, *model;
-	struct nodes			nodes;
-
-	char edimax_man[EDIMAX_MAN_LEN+1], edimax_model[EDIMAX_MOD_LEN+1], edimax_version[EDIMAX_VER_LEN+1], edimax_display[EDIMAX_DIS_LEN+1];
-	struct edimax_discover_response *edimax;
-
-	unsigned long			rx_timer=500000;
+	unsigned int			f;
 
 	static struct option longopts[] = {
 		{"interface", required_argument, 0, 'i'},
@@ -162,12 +444,21 @@ int main(int argc, char **argv){
 		{"retrans", required_argument, 0, 'x'},
 		{"timeout", required_argument, 0, 'O'},
 		{"type", required_argument, 0, 't'},
+		{"rate", required_argument, 0, 'r'},
+		{"max-inflight", required_argument, 0, 'n'},
+		{"seed", required_argument, 0, 'S'},
+		{"quiescence", required_argument, 0, 'q'},
+		{"receivers", required_argument, 0, 'R'},
+		{"wait-output", no_argument, 0, 'W'},
+		{"capture", no_argument, 0, 'C'},
+		{"read-file", required_argument, 0, 'F'},
+		{"fingerprints", required_argument, 0, 'P'},
 		{"verbose", no_argument, 0, 'v'},
 		{"help", no_argument, 0, 'h'},
 		{0, 0, 0,  0 }
 	};
 
-	char shortopts[]= "i:d:Lx:O:t:vh";
+	char shortopts[]= "i:d:Lx:O:t:r:n:S:q:R:WCF:P:vh";
 
 	char option;
 
@@ -176,8 +467,6 @@ int main(int argc, char **argv){
 		exit(EXIT_FAILURE);
 	}
 
-	srandom(time(NULL));
-
 	init_iface_data(&idata);
 	idata.local_retrans=2;
 
@@ -277,6 +566,62 @@ int main(int argc, char **argv){
 
 				break;
 
+			case 'r':	/* Probe rate (packets per second) */
+				rate= strtoul(optarg, NULL, 10);
+				break;
+
+			case 'n':	/* Maximum number of probes in flight */
+				max_inflight= strtoul(optarg, NULL, 10);
+
+				if(max_inflight == 0){
+					puts("The maximum number of probes in flight must be greater than zero");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'S':	/* Seed for the order in which targets are probed */
+				seed= strtoull(optarg, NULL, 0);
+				seed_f=TRUE;
+				break;
+
+			case 'q':	/* Probability of further responses below which the scan ends */
+				quiet_threshold= strtod(optarg, NULL);
+
+				if(quiet_threshold <= 0 || quiet_threshold >= 1){
+					puts("The quiescence threshold must be greater than 0 and less than 1");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'R':	/* Number of threads that receive and parse the responses to a unicast sweep */
+				nreceivers= strtoul(optarg, NULL, 10);
+
+				if(nreceivers == 0 || nreceivers > MAX_RECEIVERS){
+					printf("The number of receivers must be between 1 and %u\n", MAX_RECEIVERS);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'W':	/* Wait for the output rather than drop results when it falls behind */
+				output_wait_f= TRUE;
+				break;
+
+			case 'C':	/* Collect the responses to a local scan with packet capture */
+				capture_f= TRUE;
+				break;
+
+			case 'F':	/* Read the responses from a capture file */
+				offline_file= optarg;
+				offline_f= TRUE;
+				break;
+
+			case 'P':	/* Load additional response fingerprints */
+				fingerprint_file= optarg;
+				break;
+
 			case 'v':	/* Be verbose */
 				idata.verbose_f++;
 				break;
@@ -294,42 +639,97 @@ int main(int argc, char **argv){
 		} /* switch */
 	} /* while(getopt) */
 
+	/* A fixed seed makes the order in which targets are probed (and thus whole runs) reproducible */
+	if(!seed_f){
+		srandom(time(NULL));
+		random_key((unsigned char *) &seed, sizeof(seed));
+	}
+
+	srandom((unsigned int) seed);
+
 	/*
 	    XXX: This is rather ugly, but some local functions need to check for verbosity, and it was not warranted
 	    to pass &idata as an argument
 	 */
 	verbose_f= idata.verbose_f;
 
-	if(geteuid()){
-		puts("iot-scan needs superuser privileges to run");
+	if(!dst_f && !scan_local_f && !offline_f){
+		puts("Must specify either a destination prefix ('-d'), a local scan ('-L'), or a capture file ('-F')");
 		exit(EXIT_FAILURE);
 	}
 
-	if(scan_local_f && !idata.iface_f){
-		/* XXX This should later allow to just specify local scan and automatically choose an interface */
-		puts("Must specify the network interface with the -i option when a local scan is selected");
+	/* Reading a capture file does not touch the network */
+	if((dst_f || scan_local_f) && geteuid()){
+		puts("iot-scan needs superuser privileges to run");
 		exit(EXIT_FAILURE);
 	}
 
-	if(!dst_f && !scan_local_f){
-		puts("Must specify either a destination prefix ('-d'), or a local scan ('-L')");
+	if(capture_f && !scan_local_f){
+		puts("Packet capture ('-C') can only be employed with a local scan ('-L')");
 		exit(EXIT_FAILURE);
 	}
 
-	release_privileges();
-
 	if(get_local_addrs(&idata) == FAILURE){
 		puts("Error obtaining list of local interfaces and addresses");
 		exit(EXIT_FAILURE);
 	}
 
+	/* Unicast sweeps employ raw sockets, which must be created before releasing superuser privileges */
+	if(dst_f){
+		if( (raw_sfd=socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1){
+			puts("Could not create raw socket for sending probes");
+			exit(EXIT_FAILURE);
+		}
+
+		if(nreceivers > 1){
+			for(i=0; i < nreceivers; i++){
+				if( (receivers[i].fd=open_receiver_socket(i)) == -1){
+					puts("Could not create raw socket for receiving responses");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		else if( (raw_rfd=socket(AF_INET, SOCK_RAW, IPPROTO_UDP)) == -1){
+			puts("Could not create raw socket for receiving responses");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	   When no interface is specified, local scans are performed on all interfaces at once, with
+	   one socket per interface. SO_BINDTODEVICE requires superuser privileges.
+	 */
+	if(scan_local_f && !idata.iface_f && !open_local_workers()){
+		puts("No interfaces with IPv4 addresses available for a local scan");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Opening a capture requires superuser privileges, too */
+	if(scan_local_f && idata.iface_f && capture_f){
+		if( (idata.pfd=open_capture(idata.iface, errbuf)) == NULL){
+			printf("Error opening capture on interface %s: %s\n", idata.iface, errbuf);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	release_privileges();
+
 /*	debug_print_iflist(&(idata.iflist)); */
 
 	if(!scan_type_f){
 		scan_type= SCAN_IP_CAMERAS | SCAN_SMART_PLUGS;
 	}
 
-	if(scan_local_f){
+	for(f=0; f < NUM_FAMILIES; f++){
+		if(scan_type & families[f].type)
+			families[f].enabled_f= TRUE;
+	}
+
+	init_port_families();
+	init_fingerprints();
+	init_probes();
+
+	if(scan_local_f || dst_f){
 		/* If an interface was specified, we select an IPv4 address from such interface */
 		if(idata.iface_f){
 			if( (voidptr=find_v4addr_for_iface(&(idata.iflist), idata.iface)) == NULL){
@@ -347,704 +747,1983 @@ int main(int argc, char **argv){
 
 			idata.srcaddr= *((struct in_addr *)voidptr);
 		}
+	}
 
-		if( (idata.fd=socket(AF_INET, SOCK_DGRAM, 0)) == -1){
-			puts("Could not create socket");
-			exit(EXIT_FAILURE);
-		}
+	if(scan_local_f){
+		create_family_nodes(NULL);
+		start_output();
 
-		if( setsockopt(idata.fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1){
-			puts("Error while setting SO_BROADCAST socket option");
-			exit(EXIT_FAILURE);
+		if(nworkers){
+			scan_local_workers();
 		}
+		else{
+			if( (idata.fd=open_local_socket(&(idata.srcaddr), NULL)) == -1)
+				exit(EXIT_FAILURE);
 
-		memset(&sockaddr_in, 0, sizeof(sockaddr_in));
-		sockaddr_in.sin_family= AF_INET;
-		sockaddr_in.sin_port= 0;  /* Allow Sockets API to set an ephemeral port */
-		sockaddr_in.sin_addr= idata.srcaddr;
+			if(capture_f)
+				set_capture_filter(idata.pfd);
 
-		if(bind(idata.fd, (struct sockaddr *) &sockaddr_in, sizeof(sockaddr_in)) == -1){
-			puts("Error bind()ing socket to local address");
-			exit(EXIT_FAILURE);
+			scan_local(idata.fd, idata.pfd);
+
+			if(capture_f)
+				pcap_close(idata.pfd);
 		}
 
+		stop_output();
+		destroy_family_nodes();
+	}
 
-		/* TP-Link Smart plugs */
-		if(scan_type | SCAN_SMART_PLUGS){
-			retrans=0;
-			if(!create_local_nodes(&nodes)){
-				puts("Not enough memory");
-				exit(EXIT_FAILURE);
-			}
+	if(dst_f)
+		scan_prefix();
 
-			memset(&sockaddr_to, 0, sizeof(sockaddr_to));
-			sockaddr_to.sin_family= AF_INET;
-			sockaddr_to.sin_port= htons(TP_LINK_SMART_PORT);
+	if(offline_f)
+		read_capture(offline_file);
 
-			memset(&sockaddr_from, 0, sizeof(sockaddr_from));
-			sockaddr_from.sin_family= AF_INET;
-			sockaddrfrom_len=sizeof(sockaddr_from);
+	exit(EXIT_SUCCESS);
+}
 
 
-			if ( inet_pton(AF_INET, IP_LIMITED_MULTICAST, &(sockaddr_to.sin_addr)) <= 0){
-				puts("inet_pton(): Error setting multicast address");
-				exit(EXIT_FAILURE);
-			}
 
-			FD_ZERO(&sset);
-			FD_SET(idata.fd, &sset);
+/*
+ * Function: scan_local()
+ *
+ * Probes the local subnet for all the selected device families. All families are probed from the
+ * same socket and within the same event loop, such that the whole scan takes as long as a single
+ * family would.
+ */
 
-			lastprobe.tv_sec= 0;	
-			lastprobe.tv_usec=0;
-			idata.pending_write_f=TRUE;	
+void scan_local(int fd, pcap_t *pcap){
+	struct scan_state		scan;
+	unsigned int			f;
 
-			/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-			   That is, we give responses enough time to come back
-			 */
-			while(!end_f){
-				rset= sset;
-				wset= sset;
-				eset= sset;
-
-				if(!donesending_f){
-					/* This is the retransmission timer */
-					timeout.tv_sec=  rx_timer/1000000;
-					timeout.tv_usec= rx_timer%1000000;
-				}
-				else{
-					/* XXX: This should use the parameter from command line */
-					timeout.tv_sec= idata.local_timeout;
-					timeout.tv_usec=0;
-				}
+	memset(&scan, 0, sizeof(scan));
 
-				/*
-					Check for readability and exceptions. We only check for writeability if there is pending data
-					to send.
-				 */
-				if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-					if(errno == EINTR){
-						continue;
-					}
-					else{
-						perror("iot-scan:");
-						exit(EXIT_FAILURE);
-					}
-				}
+	for(f=0; f < NUM_FAMILIES; f++)
+		rtt_init(&(scan.rtt[f]), rx_timer * NSEC_PER_USEC);
 
-				if(gettimeofday(&curtime, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-scan");
+	if(!create_pktpool(&(scan.rxpool), PKTPOOL_SIZE, BATCH_BUFFER_SIZE) || !create_batch(&(scan.txbatch), NUM_FAMILIES, BATCH_BUFFER_SIZE)){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
 
-					exit(EXIT_FAILURE);
-				}
+	scan.sockaddr_to.sin_family= AF_INET;
 
-				/* Check whether we have finished probing all targets */
-				if(donesending_f){
-					/*
-					   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-					*/
+	if ( inet_pton(AF_INET, IP_LIMITED_MULTICAST, &(scan.sockaddr_to.sin_addr)) <= 0){
+		puts("inet_pton(): Error setting multicast address");
+		exit(EXIT_FAILURE);
+	}
 
-					if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-						end_f=TRUE;
-					}
-				}
+	scan.sfd= fd;
+	scan.rfd= fd;
+	scan.pcap= pcap;
+	scan.rxevents= REACTOR_READ;
 
+	if(!reactor_init(&(scan.reactor))){
+		puts("Error initializing event loop");
+		exit(EXIT_FAILURE);
+	}
 
-				if(sel && FD_ISSET(idata.fd, &rset)){
-					/* XXX: Process response packet */
+	/* With a capture, responses are collected (whatever their destination) from the capture alone */
+	if(pcap != NULL){
+		scan.dlt= pcap_datalink(pcap);
+		scan.rxevents= 0;
 
-					if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+		if(pcap_get_selectable_fd(pcap) == -1 || \
+			!reactor_add(&(scan.reactor), pcap_get_selectable_fd(pcap), REACTOR_READ, local_capture, &scan)){
+			puts("Error initializing event loop");
+			exit(EXIT_FAILURE);
+		}
+	}
 
+	/* The first probes are sent as soon as the socket is writable */
+	if(!reactor_add(&(scan.reactor), fd, scan.rxevents | REACTOR_WRITE, local_io, &scan)){
+		puts("Error initializing event loop");
+		exit(EXIT_FAILURE);
+	}
 
-					if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+	reactor_timer_init(&(scan.rtx_timer), local_retransmit, &scan);
+	reactor_timer_init(&(scan.end_timer), scan_end, &scan);
+	quiescence_init(&(scan.quiet), quiet_threshold, monotonic_nsec());
 
-					tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
-
-					alias= NULL_STRING;
-					dev_name= NULL_STRING;
-					type= NULL_STRING;
-					model= NULL_STRING;
-
-					/* Get to system:get_sysinfo */
-					if( (json1=json_get_objects(readbuff, (nreadbuff))) != NULL){
-						if( json_get_value(json1, &json_value, "\"system\"")){
-							if( (json2=json_get_objects(json_value.value, json_value.len)) != NULL){
-								if( json_get_value(json2, &json_value, "\"get_sysinfo\"")){
-									if( (json3=json_get_objects(json_value.value, json_value.len)) != NULL){
-										json_remove_quotes(json3);
-										if( json_get_value(json3, &json_value, "type")){
-											type=json_value.value;
-										}
-										if( json_get_value(json3, &json_value, "model")){
-											model=json_value.value;
-										}
-										if( json_get_value(json3, &json_value, "dev_name")){
-											dev_name=json_value.value;
-										}
-										if( json_get_value(json3, &json_value, "alias")){
-											alias=json_value.value;
-										}	
-
-										if( !is_in_local_nodes(&nodes, &(sockaddr_from.sin_addr))){
-											add_to_local_nodes(&nodes, &(sockaddr_from.sin_addr));
-											printf("%s # %s: TP-Link %s: %s: \"%s\"\n", pv4addr, type, model, dev_name, alias);
-										}
-									}
-								}
-							}
-						}
-					}
-				}
+	if(!reactor_run(&(scan.reactor))){
+		perror("iot-scan");
+		exit(EXIT_FAILURE);
+	}
 
+	reactor_destroy(&(scan.reactor));
+	destroy_pktpool(&(scan.rxpool));
+	destroy_batch(&(scan.txbatch));
 
-				if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, rx_timer)){
-					idata.pending_write_f=TRUE;
-					continue;
-				}
+}
 
-				if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-					idata.pending_write_f=FALSE;
 
-					/* XXX: SEND PROBE PACKET */
-					nsendbuff= Strnlen(TP_LINK_SMART_DISCOVER, MAX_TP_COMMAND_LENGTH);
-					memcpy(sendbuff, TP_LINK_SMART_DISCOVER, nsendbuff);
-					tp_link_crypt((unsigned char *)sendbuff, nsendbuff);
+/*
+ * Function: open_local_socket()
+ *
+ * Creates the socket employed for a local scan, bound to a local address and (if "iface" is not
+ * NULL) to an interface. Returns the socket descriptor, or -1 on error
+ */
 
-					if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+int open_local_socket(struct in_addr *srcaddr, char *iface){
+	struct sockaddr_in	sockaddr_in;
+	const int			on=1;
+	int					fd;
 
-					if(gettimeofday(&lastprobe, NULL) == -1){
-						if(idata.verbose_f)
-							perror("iot-scan");
+	if( (fd=socket(AF_INET, SOCK_DGRAM, 0)) == -1){
+		puts("Could not create socket");
+		return(-1);
+	}
 
-						exit(EXIT_FAILURE);
-					}
+	if( setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1){
+		puts("Error while setting SO_BROADCAST socket option");
+		close(fd);
+		return(-1);
+	}
 
-					retrans++;
+#ifdef SO_BINDTODEVICE
+	/* Otherwise, probes to the limited broadcast address would leave through just one interface */
+	if(iface != NULL && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, iface, strlen(iface) + 1) == -1){
+		printf("Error while binding socket to interface %s\n", iface);
+		close(fd);
+		return(-1);
+	}
+#endif
 
-					if(retrans >= idata.local_retrans)
-						donesending_f= 1;
+	memset(&sockaddr_in, 0, sizeof(sockaddr_in));
+	sockaddr_in.sin_family= AF_INET;
+	sockaddr_in.sin_port= 0;  /* Allow Sockets API to set an ephemeral port */
+	sockaddr_in.sin_addr= *srcaddr;
 
-				}
+	if(bind(fd, (struct sockaddr *) &sockaddr_in, sizeof(sockaddr_in)) == -1){
+		puts("Error bind()ing socket to local address");
+		close(fd);
+		return(-1);
+	}
 
+	return(fd);
+}
 
-				if(FD_ISSET(idata.fd, &eset)){
-					if(idata.verbose_f)
-						puts("iot-scaner: Found exception on descriptor");
 
-					exit(EXIT_FAILURE);
-				}
-			}
+/*
+ * Function: open_local_workers()
+ *
+ * Sets up one worker (and socket) for each non-loopback interface with an IPv4 address. Returns
+ * the number of workers
+ */
 
-			destroy_local_nodes(&nodes);
-		}
+unsigned int open_local_workers(void){
+	struct iface_entry	*iface;
+	unsigned int		i;
 
+	for(i=0; i < idata.iflist.nifaces && nworkers < MAX_IFACES; i++){
+		iface= &(idata.iflist.ifaces[i]);
 
-		/* Edimax SmartPLugs */
-		if(scan_type | SCAN_SMART_PLUGS){
-			retrans=0;
+		if((iface->flags & IFACE_LOOPBACK) || iface->ip.nprefix == 0 || IN_IS_ADDR_LOOPBACK(&(iface->ip.prefix[0]->ip)))
+			continue;
 
-			if(!create_local_nodes(&nodes)){
-				puts("Not enough memory");
-				exit(EXIT_FAILURE);
-			}
+		snprintf(workers[nworkers].iface, sizeof(workers[nworkers].iface), "%s", iface->iface);
+		workers[nworkers].srcaddr= iface->ip.prefix[0]->ip;
 
-			donesending_f=FALSE;
-			end_f=FALSE;
-			memset(&sockaddr_to, 0, sizeof(sockaddr_to));
-			sockaddr_to.sin_family= AF_INET;
-			sockaddr_to.sin_port= htons(EDIMAX_SMART_PLUG_SERVICE_PORT);
+		/* An unusable interface does not prevent scanning the others */
+		if( (workers[nworkers].fd= open_local_socket(&(workers[nworkers].srcaddr), workers[nworkers].iface)) == -1)
+			continue;
 
-			memset(&sockaddr_from, 0, sizeof(sockaddr_from));
-			sockaddr_from.sin_family= AF_INET;
-			sockaddrfrom_len=sizeof(sockaddr_from);
+		workers[nworkers].pcap= NULL;
 
+		if(capture_f && (workers[nworkers].pcap= open_capture(workers[nworkers].iface, errbuf)) == NULL){
+			if(idata.verbose_f)
+				printf("Error opening capture on interface %s: %s\n", workers[nworkers].iface, errbuf);
 
-			if ( inet_pton(AF_INET, IP_LIMITED_MULTICAST, &(sockaddr_to.sin_addr)) <= 0){
-				puts("inet_pton(): Error setting multicast address");
-				exit(EXIT_FAILURE);
-			}
+			close(workers[nworkers].fd);
+			continue;
+		}
 
-			FD_ZERO(&sset);
-			FD_SET(idata.fd, &sset);
+		nworkers++;
+	}
 
-			lastprobe.tv_sec= 0;	
-			lastprobe.tv_usec=0;
-			idata.pending_write_f=TRUE;	
+	return(nworkers);
+}
 
-			/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-			   That is, we give responses enough time to come back
-			 */
-			while(!end_f){
-				rset= sset;
-				wset= sset;
-				eset= sset;
-
-				if(!donesending_f){
-					/* This is the retransmission timer */
-					timeout.tv_sec=  rx_timer/1000000;
-					timeout.tv_usec= rx_timer%1000000;
-				}
-				else{
-					/* XXX: This should use the parameter from command line */
-					timeout.tv_sec= idata.local_timeout;
-					timeout.tv_usec=0;
-				}
 
-				/*
-					Check for readability and exceptions. We only check for writeability if there is pending data
-					to send.
-				 */
-				if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-					if(errno == EINTR){
-						continue;
-					}
-					else{
-						perror("iot-scan:");
-						exit(EXIT_FAILURE);
-					}
-				}
+/*
+ * Function: scan_local_workers()
+ *
+ * Scans the local subnets of all interfaces in parallel, with one thread per interface. Results
+ * are merged into a single (deduplicated) output
+ */
 
-				if(gettimeofday(&curtime, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-scan");
+void scan_local_workers(void){
+	unsigned int	i;
 
-					exit(EXIT_FAILURE);
-				}
+	for(i=0; i < nworkers; i++){
+		if(idata.verbose_f){
+			if(inet_ntop(AF_INET, &(workers[i].srcaddr), pv4addr, sizeof(pv4addr)) != NULL)
+				printf("Scanning interface %s (%s)\n", workers[i].iface, pv4addr);
+		}
 
-				/* Check whether we have finished probing all targets */
-				if(donesending_f){
-					/*
-					   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-					*/
+		/* Filters are compiled here, since pcap_compile() is not thread-safe in older versions of libpcap */
+		if(workers[i].pcap != NULL)
+			set_capture_filter(workers[i].pcap);
 
-					if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-						end_f=TRUE;
-					}
-				}
+		if(pthread_create(&(workers[i].thread), NULL, local_worker, &(workers[i])) != 0){
+			puts("Error creating worker thread");
+			exit(EXIT_FAILURE);
+		}
+	}
 
+	for(i=0; i < nworkers; i++){
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
 
-				if(sel && FD_ISSET(idata.fd, &rset)){
-					/* XXX: Process response packet */
+		if(workers[i].pcap != NULL)
+			pcap_close(workers[i].pcap);
+	}
+}
 
-					if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
 
-					if( nreadbuff == sizeof(struct edimax_discover_response)){
-						if( !is_in_local_nodes(&nodes, &(sockaddr_from.sin_addr))){
-							add_to_local_nodes(&nodes, &(sockaddr_from.sin_addr));
+/*
+ * Function: local_worker()
+ *
+ * Worker thread that scans the local subnet of one interface
+ */
 
-							if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-								perror("iot-scan: ");
-								exit(EXIT_FAILURE);
-							}
+void *local_worker(void *arg){
+	struct local_worker	*worker= arg;
 
-							edimax= (struct edimax_discover_response *) readbuff;
+	scan_local(worker->fd, worker->pcap);
+	return(NULL);
+}
 
-							strncpy(edimax_man, edimax->manufacturer, EDIMAX_MAN_LEN);
-							edimax_man[EDIMAX_MAN_LEN]=0;
 
-							strncpy(edimax_model, edimax->model, EDIMAX_MOD_LEN);
-							edimax_model[EDIMAX_MOD_LEN]=0;
+/*
+ * Function: create_family_nodes()
+ *
+ * Creates the sets of nodes that have responded, for all the selected device families
+ */
 
-							strncpy(edimax_version, edimax->version, EDIMAX_VER_LEN);
-							edimax_version[EDIMAX_VER_LEN]=0;
+void create_family_nodes(struct prefixv4_entry *pref){
+	unsigned int	f;
 
-							strncpy(edimax_display, edimax->displayname, EDIMAX_DIS_LEN);
-							edimax_display[EDIMAX_DIS_LEN]=0;
+	for(f=0; f < NUM_FAMILIES; f++){
+		if(!families[f].enabled_f)
+			continue;
 
-							printf("%s # smartplug: %s %s %s: \"%s\"\n", pv4addr, edimax_man, edimax_model, edimax_version, edimax_display);
-						}
-					}
+		if(!create_local_nodes(&(families[f].nodes), pref)){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
 
-				}
 
+/*
+ * Function: destroy_family_nodes()
+ *
+ * Destroys the sets of nodes that have responded
+ */
 
-				if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, rx_timer)){
-					idata.pending_write_f=TRUE;
-					continue;
-				}
+void destroy_family_nodes(void){
+	unsigned int	f;
 
-				if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-					idata.pending_write_f=FALSE;
+	for(f=0; f < NUM_FAMILIES; f++){
+		if(families[f].enabled_f)
+			destroy_local_nodes(&(families[f].nodes));
+	}
+}
 
-					/* XXX: SEND PROBE PACKET */
 
-					/* XXX: Will not happen, but still check in case code is changed */
-					if(sizeof(GENIUS_IP_CAMERA_DISCOVER) > sizeof(sendbuff)){
-						puts("Internal buffer too short");
-						exit(EXIT_FAILURE);
-					}
+/*
+ * Function: local_io()
+ *
+ * Event loop callback for the socket employed by scan_local()
+ */
 
-					nsendbuff= sizeof(EDIMAX_SMART_PLUG_DISCOVER);
-					memcpy(sendbuff, EDIMAX_SMART_PLUG_DISCOVER, nsendbuff);
+void local_io(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct scan_state	*scan= arg;
+	struct pktbuf		*pkts[PKTBUF_MAX_BATCH];
+	unsigned int		f;
+	int					i, n;
 
-					if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+	if(events & REACTOR_ERROR){
+		if(idata.verbose_f)
+			puts("iot-scan: Found exception on descriptor");
 
-					if(gettimeofday(&lastprobe, NULL) == -1){
-						if(idata.verbose_f)
-							perror("iot-scan");
+		exit(EXIT_FAILURE);
+	}
 
-						exit(EXIT_FAILURE);
-					}
+	if(events & REACTOR_READ){
+		/* Drain all pending responses with as few system calls as possible */
+		if( (n=recv_pktbufs(fd, &(scan->rxpool), pkts, PKTBUF_MAX_BATCH)) == -1){
+			perror("iot-scan: ");
+			exit(EXIT_FAILURE);
+		}
 
-					retrans++;
+		for(i=0; i < n; i++){
+			process_response(PKTBUF_DATA(pkts[i]), pkts[i]->len, &(pkts[i]->addr));
 
-					if(retrans >= idata.local_retrans)
-						donesending_f= 1;
+			/*
+			   Responses to retransmitted probes are ambiguous, and are not employed for measuring the RTT.
+			   Only the first response of each family is a sample: later ones measure how long the other
+			   devices took to answer, rather than the round-trip time
+			 */
+			if(scan->retrans == 1 && (f= response_family(ntohs(pkts[i]->addr.sin_port))) < NUM_FAMILIES && !scan->sampled_f[f]){
+				rtt_sample(&(scan->rtt[f]), reactor->now - scan->sent);
+				scan->sampled_f[f]= TRUE;
+			}
 
+			quiescence_event(&(scan->quiet), reactor->now);
+			pktbuf_unref(pkts[i]);
+		}
+
+		/* Responses to the last probes may make the end of the scan closer */
+		if(n && scan->retrans >= idata.local_retrans)
+			schedule_end(scan);
+	}
+
+	if(events & REACTOR_WRITE){
+		/* Send one probe for each of the selected device families, all with one system call */
+		for(f=0; f < NUM_FAMILIES; f++){
+			if(!families[f].enabled_f)
+				continue;
+
+			scan->sockaddr_to.sin_port= htons(families[f].dstport);
+
+			/* XXX: Will not happen, but still check in case code is changed */
+			if(!batch_add(&(scan->txbatch), families[f].payload, families[f].nprobe, &(scan->sockaddr_to))){
+				puts("Internal buffer too short");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		while(scan->txbatch.n){
+			if(send_batch(fd, &(scan->txbatch)) == -1){
+				perror("iot-scan: ");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		scan->retrans++;
+		scan->sent= monotonic_nsec();
+		memset(scan->sampled_f, 0, sizeof(scan->sampled_f));
+
+		/* Wait for the next retransmission or, after the last one, for any remaining responses */
+		reactor_set_events(reactor, fd, scan->rxevents);
+
+		if(scan->retrans >= idata.local_retrans)
+			schedule_end(scan);
+		else
+			reactor_timer_set(reactor, &(scan->rtx_timer), local_rto(scan, scan->retrans - 1));
+	}
+}
+
+
+/*
+ * Function: local_retransmit()
+ *
+ * Event loop timer callback that triggers a retransmission of the scan_local() probes
+ */
+
+void local_retransmit(struct reactor *reactor, void *arg){
+	struct scan_state	*scan= arg;
+
+	reactor_set_events(reactor, scan->sfd, scan->rxevents | REACTOR_WRITE);
+}
+
+
+/*
+ * Function: local_capture()
+ *
+ * Event loop callback for the capture that collects the responses to scan_local() probes
+ */
+
+void local_capture(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct scan_state	*scan= arg;
+	int					n;
+
+	if(events & REACTOR_ERROR){
+		if(idata.verbose_f)
+			puts("iot-scan: Found exception on descriptor");
+
+		exit(EXIT_FAILURE);
+	}
+
+	/* Process whatever the kernel has delivered (on Linux, one block of the capture ring) */
+	if( (n=pcap_dispatch(scan->pcap, -1, capture_frame, (unsigned char *) scan)) == -1){
+		printf("Error capturing responses: %s\n", pcap_geterr(scan->pcap));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Responses to the last probes may make the end of the scan closer */
+	if(n > 0 && scan->retrans >= idata.local_retrans)
+		schedule_end(scan);
+}
+
+
+/*
+ * Function: capture_frame()
+ *
+ * Processes a frame captured by local_capture(). Responses are decoded in the capture buffer,
+ * but their payload is taken to a packet buffer, since parsers may decrypt it in place
+ */
+
+void capture_frame(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *frame){
+	struct scan_state	*scan= (struct scan_state *) arg;
+	struct ip_hdr		ip_hdr;
+	struct udp_hdr		udp_hdr;
+	struct pktbuf		*pkt;
+	unsigned char		*data;
+	size_t				ndata;
+	unsigned int		f;
+
+	if(decode_frame(scan->dlt, (unsigned char *) frame, pkthdr->caplen, &ip_hdr, &udp_hdr, &data, &ndata) != SUCCESS)
+		return;
+
+	/* As in recv_pktbufs(), the statistics of the pool are protected by its mutex */
+	if(ndata > scan->rxpool.bufsize){
+		pthread_mutex_lock(&(scan->rxpool.mutex));
+		scan->rxpool.ntrunc++;
+		pthread_mutex_unlock(&(scan->rxpool.mutex));
+		return;
+	}
+
+	if( (pkt=pktbuf_alloc(&(scan->rxpool))) == NULL)
+		return;
+
+	memcpy(PKTBUF_DATA(pkt), data, ndata);
+	pkt->len= ndata;
+	memset(&(pkt->addr), 0, sizeof(pkt->addr));
+	pkt->addr.sin_family= AF_INET;
+	pkt->addr.sin_addr= ip_hdr.ip_src;
+	pkt->addr.sin_port= udp_hdr.uh_sport;
+
+	process_response(PKTBUF_DATA(pkt), pkt->len, &(pkt->addr));
+
+	/* As for datagram sockets, only the first response of each family to the first round is an RTT sample */
+	if(scan->retrans == 1 && (f= response_family(ntohs(udp_hdr.uh_sport))) < NUM_FAMILIES && !scan->sampled_f[f]){
+		rtt_sample(&(scan->rtt[f]), scan->reactor.now - scan->sent);
+		scan->sampled_f[f]= TRUE;
+	}
+
+	quiescence_event(&(scan->quiet), scan->reactor.now);
+	pktbuf_unref(pkt);
+}
+
+
+/*
+ * Function: read_capture()
+ *
+ * Reads the responses to previous scans from a capture file. Files in the classic pcap format are
+ * mapped into memory and processed in place, while any others are read with libpcap
+ */
+
+void read_capture(char *path){
+	struct offline		offline;
+	struct capfile		cf;
+	struct pcap_pkthdr	pkthdr;
+	unsigned char		*frame;
+	pcap_t				*pcap;
+	uint64_t			start;
+	int					r;
+
+	memset(&offline, 0, sizeof(offline));
+
+	if(!create_pktpool(&(offline.pool), 1, CAPTURE_SNAPLEN)){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	create_family_nodes(NULL);
+	start_output();
+	start= monotonic_nsec();
+
+	if(open_capfile(&cf, path)){
+		offline.dlt= cf.dlt;
+		offline.inplace_f= TRUE;
+
+		while( (r=next_capfile_frame(&cf, &pkthdr, &frame)) == 1)
+			offline_frame((unsigned char *) &offline, &pkthdr, frame);
+
+		close_capfile(&cf);
+	}
+	else{
+		if( (pcap=pcap_open_offline(path, errbuf)) == NULL){
+			printf("Error opening capture file %s: %s\n", path, errbuf);
+			exit(EXIT_FAILURE);
+		}
+
+		offline.dlt= pcap_datalink(pcap);
+
+		r= pcap_dispatch(pcap, -1, offline_frame, (unsigned char *) &offline);
+		pcap_close(pcap);
+	}
+
+	stop_output();
+
+	/* Results are written by the output thread: errors are reported once it is done */
+	if(r == -1)
+		printf("Error reading capture file %s (it may be truncated)\n", path);
+
+	if(idata.verbose_f){
+		printf("Read %llu frames (%llu bytes) in %.3f seconds\n", offline.nframes, offline.nbytes, \
+				(double) (monotonic_nsec() - start) / NSEC_PER_SEC);
+		printf("Found %llu datagrams from the ports of the selected device types\n", offline.nresponses);
+		printf("Fingerprinted %llu datagrams (%llu matched) in %.3f seconds (%.0f datagrams/s)\n", offline.nresponses, \
+				offline.nclassified, (double) offline.nsecfp / NSEC_PER_SEC, \
+				offline.nsecfp?((double) offline.nresponses * NSEC_PER_SEC / offline.nsecfp):0);
+	}
+
+	destroy_pktpool(&(offline.pool));
+	destroy_family_nodes();
+}
+
+
+/*
+ * Function: offline_frame()
+ *
+ * Processes a frame read by read_capture(). Only datagrams sent from the port of a selected
+ * device family are handed to the parsers
+ */
+
+void offline_frame(unsigned char *arg, const struct pcap_pkthdr *pkthdr, const unsigned char *frame){
+	struct offline		*offline= (struct offline *) arg;
+	struct sockaddr_in	sockaddr_from;
+	struct ip_hdr		ip_hdr;
+	struct udp_hdr		udp_hdr;
+	struct pktbuf		*pkt;
+	unsigned char		*data;
+	size_t				ndata;
+	unsigned int		f;
+	uint64_t			start;
+
+	offline->nframes++;
+	offline->nbytes+= pkthdr->caplen;
+
+	if(decode_frame(offline->dlt, (unsigned char *) frame, pkthdr->caplen, &ip_hdr, &udp_hdr, &data, &ndata) != SUCCESS || \
+		(f= response_family(ntohs(udp_hdr.uh_sport))) >= NUM_FAMILIES || ndata > offline->pool.bufsize)
+		return;
+
+	offline->nresponses++;
+
+	/* Measure how fast responses are classified (including those that are discarded below) */
+	if(idata.verbose_f){
+		start= monotonic_nsec();
+
+		if(match_fingerprint(&fpdb, data, ndata, FP_ANY_FAMILY) != NULL)
+			offline->nclassified++;
+
+		offline->nsecfp+= monotonic_nsec() - start;
+	}
+
+	/* Captures usually contain many responses from each node: only the first one is parsed */
+	if(is_in_local_nodes(&(families[f].nodes), &(ip_hdr.ip_src)))
+		return;
+
+	memset(&sockaddr_from, 0, sizeof(sockaddr_from));
+	sockaddr_from.sin_family= AF_INET;
+	sockaddr_from.sin_addr= ip_hdr.ip_src;
+	sockaddr_from.sin_port= udp_hdr.uh_sport;
+
+	if(offline->inplace_f){
+		process_response((char *) data, ndata, &sockaddr_from);
+		return;
+	}
+
+	/* Frames read by libpcap are read-only, while parsers may decrypt them in place */
+	if( (pkt=pktbuf_alloc(&(offline->pool))) == NULL)
+		return;
+
+	memcpy(PKTBUF_DATA(pkt), data, ndata);
+	process_response(PKTBUF_DATA(pkt), ndata, &sockaddr_from);
+	pktbuf_unref(pkt);
+}
+
+
+/*
+ * Function: set_capture_filter()
+ *
+ * Restricts a capture to UDP datagrams sent from the ports of the selected device families
+ */
+
+void set_capture_filter(pcap_t *pcap){
+	struct bpf_program	filter;
+	char				expr[CAPTURE_FILTER_LEN];
+	size_t				len;
+	unsigned int		f, n=0;
+
+	len= snprintf(expr, sizeof(expr), "udp and (");
+
+	for(f=0; f < NUM_FAMILIES && len < sizeof(expr); f++){
+		if(!families[f].enabled_f)
+			continue;
+
+		len+= snprintf(expr + len, sizeof(expr) - len, "%ssrc port %u", (n++)?" or ":"", families[f].srcport);
+	}
+
+	if(len < sizeof(expr))
+		len+= snprintf(expr + len, sizeof(expr) - len, ")");
+
+	if(len >= sizeof(expr) || pcap_compile(pcap, &filter, expr, 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(pcap, &filter) == -1){
+		printf("Error setting capture filter: %s\n", pcap_geterr(pcap));
+		exit(EXIT_FAILURE);
+	}
+
+	pcap_freecode(&filter);
+}
+
+
+/*
+ * Function: schedule_end()
+ *
+ * (Re)schedules the end of a scan after the last probes have been sent: once further responses
+ * become unlikely, but no earlier than one RTO and no later than the response timeout
+ */
+
+void schedule_end(struct scan_state *scan){
+	uint64_t	rto, deadline, now;
+
+	rto= local_rto(scan, 0);
+	deadline= quiescence_deadline(&(scan->quiet), scan->sent + rto, scan->sent + MAX(idata.local_timeout * NSEC_PER_SEC, rto));
+	now= monotonic_nsec();
+	reactor_timer_set(&(scan->reactor), &(scan->end_timer), (deadline > now)?(deadline - now):0);
+}
+
+
+/*
+ * Function: scan_end()
+ *
+ * Event loop timer callback that ends a scan once the response timeout has expired
+ */
+
+void scan_end(struct reactor *reactor, void *arg){
+	reactor_stop(reactor);
+}
+
+
+
+/*
+ * Function: scan_prefix()
+ *
+ * Probes every address of the destination prefix for all the selected device families. Probes
+ * are paced with a token bucket, and the number of probes in flight is limited. Each probe is
+ * retransmitted on its own timer until a response arrives or its response timeout expires
+ */
+
+void scan_prefix(void){
+	struct scan_state		scan;
+	unsigned int			f;
+	struct in_addr			dstaddr;
+	const int				on=1;
+
+	create_family_nodes(&prefix);
+	start_output();
+	memset(&scan, 0, sizeof(scan));
+
+	for(f=0; f < NUM_FAMILIES; f++)
+		rtt_init(&(scan.rtt[f]), rx_timer * NSEC_PER_USEC);
+
+	if(!create_inflight(&(scan.inflight), max_inflight, monotonic_nsec()) || !create_pktpool(&(scan.rxpool), PKTPOOL_SIZE, BATCH_BUFFER_SIZE) || \
+		!create_batch(&(scan.txbatch), BATCH_SIZE, BATCH_BUFFER_SIZE)){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	if(setsockopt(raw_sfd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) == -1){
+		puts("Error while setting IP_HDRINCL socket option");
+		exit(EXIT_FAILURE);
+	}
+
+	/* When the socket buffer fills up, we wait for writability rather than block in the kernel */
+	if(fcntl(raw_sfd, F_SETFL, fcntl(raw_sfd, F_GETFL) | O_NONBLOCK) == -1){
+		puts("Error while setting socket to non-blocking mode");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The cookie key is random, such that responses to previous scans are discarded */
+	random_key(cookie_key, sizeof(cookie_key));
+
+	/*
+	   Probes are built by hand, so the kernel does not pick their source address. Unless an
+	   interface was specified, we employ the address the routing table selects for the prefix
+	 */
+	if(!idata.iface_f){
+		dstaddr= prefix.ip;
+
+		if(prefix.len < 32)
+			dstaddr.s_addr|= htonl(1);
+
+		if(find_v4addr_for_dst(&dstaddr, &(idata.srcaddr)) == FAILURE){
+			puts("No route to the destination prefix");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(idata.verbose_f && inet_ntop(AF_INET, &(idata.srcaddr), pv4addr, sizeof(pv4addr)) != NULL)
+		printf("Probing from source address %s\n", pv4addr);
+
+	init_sweep(&(scan.sweep), &prefix, seed);
+
+	if(idata.verbose_f)
+		printf("Probing %llu targets in pseudorandom order (seed: %llu)\n", scan.sweep.ntargets, (unsigned long long) seed);
+
+	/* Allow for bursts of up to 10 ms worth of probes */
+	tb_init(&(scan.tb), rate, rate/100);
+
+	scan.sockaddr_to.sin_family= AF_INET;
+	scan.sfd= raw_sfd;
+	scan.rfd= raw_rfd;
+	scan.maxtx= (idata.local_retrans > 0)?idata.local_retrans:1;
+
+	/* With several receivers, the event loop only learns about the probes that have been answered */
+	if(nreceivers > 1)
+		start_receivers();
+
+	if(!reactor_init(&(scan.reactor)) || !reactor_add(&(scan.reactor), raw_sfd, REACTOR_WRITE, prefix_write, &scan) || \
+		!((nreceivers > 1)?reactor_add(&(scan.reactor), answer_pipe[0], REACTOR_READ, prefix_answers, &scan): \
+							reactor_add(&(scan.reactor), raw_rfd, REACTOR_READ, prefix_read, &scan))){
+		puts("Error initializing event loop");
+		exit(EXIT_FAILURE);
+	}
+
+	reactor_timer_init(&(scan.rtx_timer), prefix_pace, &scan);
+	reactor_timer_init(&(scan.wheel_timer), prefix_tick, &scan);
+	reactor_timer_init(&(scan.end_timer), scan_end, &scan);
+	quiescence_init(&(scan.quiet), quiet_threshold, monotonic_nsec());
+
+	if(!reactor_run(&(scan.reactor))){
+		perror("iot-scan");
+		exit(EXIT_FAILURE);
+	}
+
+	if(nreceivers > 1)
+		stop_receivers(&scan);
+
+	stop_output();
+
+	if(idata.verbose_f){
+		printf("Sent %llu probes to %llu targets\n", scan.nprobes, (unsigned long long) scan.sweep.ntargets);
+		printf("Received responses for %llu probes\n", scan.nanswered);
+		printf("Discarded %llu datagrams with an invalid cookie\n", scan.ndropped);
+
+		if(scan.rxpool.ntrunc)
+			printf("Discarded %llu truncated datagrams\n", scan.rxpool.ntrunc);
+
+		if(scan.nunreported)
+			printf("Could not report %llu answered probes to the event loop\n", scan.nunreported);
+	}
+
+	reactor_destroy(&(scan.reactor));
+	destroy_inflight(&(scan.inflight));
+	destroy_pktpool(&(scan.rxpool));
+	destroy_batch(&(scan.txbatch));
+
+	destroy_family_nodes();
+}
+
+
+/*
+ * Function: prefix_read()
+ *
+ * Event loop callback for the raw socket that receives the responses to scan_prefix() probes
+ */
+
+void prefix_read(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct scan_state	*scan= arg;
+	struct sockaddr_in	sockaddr_from;
+	struct pktbuf		*pkts[PKTBUF_MAX_BATCH];
+	unsigned char		*data;
+	size_t				ndata;
+	int					i, n, r;
+
+	if(events & REACTOR_ERROR){
+		if(idata.verbose_f)
+			puts("iot-scan: Found exception on descriptor");
+
+		exit(EXIT_FAILURE);
+	}
+
+	/* The raw socket receives every UDP datagram destined to this host: drain them in batches */
+	if( (n=recv_pktbufs(fd, &(scan->rxpool), pkts, PKTBUF_MAX_BATCH)) == -1){
+		perror("iot-scan: ");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sockaddr_from, 0, sizeof(sockaddr_from));
+	sockaddr_from.sin_family= AF_INET;
+
+	for(i=0; i < n; i++){
+		/* The datagram is validated, decrypted and parsed in place */
+		if( (r=check_response((unsigned char *) PKTBUF_DATA(pkts[i]), pkts[i]->len, &sockaddr_from, &data, &ndata)) == 1){
+			process_response((char *)data, ndata, &sockaddr_from);
+			answer_probe(scan, &(sockaddr_from.sin_addr), ntohs(sockaddr_from.sin_port), reactor->now);
+		}
+		else if(r == 0){
+			scan->ndropped++;
+		}
+
+		pktbuf_unref(pkts[i]);
+	}
+
+	prefix_resume(scan);
+}
+
+
+/*
+ * Function: check_response()
+ *
+ * Decodes a datagram received on a raw socket. Returns -1 if it is not an IPv4 UDP datagram,
+ * 0 if it does not carry a valid cookie, and 1 otherwise
+ */
+
+int check_response(unsigned char *pkt, size_t len, struct sockaddr_in *from, unsigned char **data, size_t *ndata){
+	struct ip_hdr		ip_hdr;
+	struct udp_hdr		udp_hdr;
+
+	if(decode_ipv4_udp(pkt, len, &ip_hdr, &udp_hdr, data, ndata) != SUCCESS)
+		return(-1);
+
+	from->sin_addr= ip_hdr.ip_src;
+	from->sin_port= udp_hdr.uh_sport;
+
+	/*
+	   Responses must be sent to the port encoded in the probe. Anything else (unrelated
+	   traffic, stale or spoofed responses) is discarded before any parsing takes place.
+	 */
+	return(ntohs(udp_hdr.uh_dport) == cookie_port(&(ip_hdr.ip_src)));
+}
+
+
+/*
+ * Function: answer_probe()
+ *
+ * Accounts for a response to a scan_prefix() probe, received at the specified time
+ */
+
+void answer_probe(struct scan_state *scan, struct in_addr *addr, uint16_t sport, uint64_t when){
+	struct probe	*probe;
+	unsigned int	f;
+
+	quiescence_event(&(scan->quiet), when);
+
+	/* The probe has been answered: cancel its pending retransmissions */
+	if( (f= response_family(sport)) < NUM_FAMILIES && (probe= find_inflight(&(scan->inflight), addr, f)) != NULL){
+		/* Karn's algorithm: only probes that were sent once yield RTT samples */
+		if(probe->ntx == 1 && when > probe->sent)
+			rtt_sample(&(scan->rtt[f]), when - probe->sent);
+
+		release_probe(scan, probe);
+		scan->nanswered++;
+	}
+}
+
+
+/*
+ * Function: prefix_answers()
+ *
+ * Event loop callback for the pipe through which the receiver threads report the probes that
+ * have been answered
+ */
+
+void prefix_answers(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct scan_state	*scan= arg;
+	struct answer		answers[ANSWER_BATCH];
+	ssize_t				nread;
+	unsigned int		i;
+
+	if(events & REACTOR_ERROR){
+		if(idata.verbose_f)
+			puts("iot-scan: Found exception on descriptor");
+
+		exit(EXIT_FAILURE);
+	}
+
+	/* Answers are written atomically, so the pipe never holds a partial one */
+	if( (nread=read(fd, answers, sizeof(answers))) == -1){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
+		perror("iot-scan: ");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i=0; i < (size_t) nread / sizeof(struct answer); i++)
+		answer_probe(scan, &(answers[i].addr), answers[i].sport, answers[i].when);
+
+	prefix_resume(scan);
+}
+
+
+/*
+ * Function: open_receiver_socket()
+ *
+ * Creates the raw socket of a receiver thread. Every raw socket gets a copy of each datagram, so
+ * on Linux a socket filter shards the responses among receivers by source address
+ */
+
+int open_receiver_socket(unsigned int index){
+#ifdef __linux__
+	struct sock_filter	code[]= {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),		/* IPv4 source address */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nreceivers),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, index, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0)
+	};
+	struct sock_fprog	fprog;
+#endif
+	int					fd;
+
+	if( (fd=socket(AF_INET, SOCK_RAW, IPPROTO_UDP)) == -1)
+		return(-1);
+
+#ifdef __linux__
+	fprog.len= sizeof(code)/sizeof(code[0]);
+	fprog.filter= code;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1){
+		close(fd);
+		return(-1);
+	}
+#endif
+
+	return(fd);
+}
+
+
+/*
+ * Function: start_receivers()
+ *
+ * Starts the receiver threads of a unicast sweep
+ */
+
+void start_receivers(void){
+	unsigned int	i;
+
+	if(pipe(answer_pipe) == -1 || pipe(stop_pipe) == -1){
+		perror("iot-scan");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	   Receivers must never block on a full pipe: the event loop stops reading it once the scan ends,
+	   and a blocked receiver would never notice that it has been stopped
+	 */
+	if(fcntl(answer_pipe[0], F_SETFL, fcntl(answer_pipe[0], F_GETFL) | O_NONBLOCK) == -1 || \
+		fcntl(answer_pipe[1], F_SETFL, fcntl(answer_pipe[1], F_GETFL) | O_NONBLOCK) == -1){
+		puts("Error while setting pipe to non-blocking mode");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i=0; i < nreceivers; i++){
+		receivers[i].index= i;
+
+		if(!create_pktpool(&(receivers[i].pool), PKTPOOL_SIZE, BATCH_BUFFER_SIZE)){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
+		}
+
+		if(pthread_create(&(receivers[i].thread), NULL, receiver, &(receivers[i])) != 0){
+			puts("Error creating receiver thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+/*
+ * Function: stop_receivers()
+ *
+ * Stops the receiver threads of a unicast sweep, and adds their statistics to those of the scan
+ */
+
+void stop_receivers(struct scan_state *scan){
+	unsigned int	i;
+
+	/* Closing the write end of the pipe wakes up all the receivers at once */
+	close(stop_pipe[1]);
+
+	for(i=0; i < nreceivers; i++){
+		pthread_join(receivers[i].thread, NULL);
+		scan->ndropped+= receivers[i].ndropped;
+		scan->nunreported+= receivers[i].nunreported;
+		scan->rxpool.ntrunc+= receivers[i].pool.ntrunc;
+		destroy_pktpool(&(receivers[i].pool));
+		close(receivers[i].fd);
+	}
+
+	close(stop_pipe[0]);
+	close(answer_pipe[0]);
+	close(answer_pipe[1]);
+}
+
+
+/*
+ * Function: receiver()
+ *
+ * Receiver thread of a unicast sweep: validates, decrypts and parses its share of the responses,
+ * and reports the probes that have been answered to the event loop
+ */
+
+void *receiver(void *arg){
+	struct receiver		*rx= arg;
+	struct pollfd		pfds[2];
+	struct sockaddr_in	sockaddr_from;
+	struct answer		answer;
+	struct pktbuf		*pkts[PKTBUF_MAX_BATCH];
+	unsigned char		*data;
+	size_t				ndata;
+	int					i, n, r;
+
+	memset(&sockaddr_from, 0, sizeof(sockaddr_from));
+	sockaddr_from.sin_family= AF_INET;
+	memset(&answer, 0, sizeof(answer));
+
+	pfds[0].fd= rx->fd;
+	pfds[0].events= POLLIN;
+	pfds[1].fd= stop_pipe[0];
+	pfds[1].events= POLLIN;
+
+	while(1){
+		if(poll(pfds, 2, -1) == -1){
+			if(errno == EINTR)
+				continue;
+
+			perror("iot-scan");
+			exit(EXIT_FAILURE);
+		}
+
+		if(pfds[1].revents)
+			break;
+
+		if(pfds[0].revents & (POLLERR | POLLNVAL)){
+			if(idata.verbose_f)
+				puts("iot-scan: Found exception on descriptor");
+
+			exit(EXIT_FAILURE);
+		}
+
+		if( (n=recv_pktbufs(rx->fd, &(rx->pool), pkts, PKTBUF_MAX_BATCH)) == -1){
+			perror("iot-scan: ");
+			exit(EXIT_FAILURE);
+		}
+
+		answer.when= monotonic_nsec();
+
+		for(i=0; i < n; i++){
+			r= check_response((unsigned char *) PKTBUF_DATA(pkts[i]), pkts[i]->len, &sockaddr_from, &data, &ndata);
+
+			/* Without a socket filter, every receiver sees all datagrams */
+			if(r != -1 && ntohl(sockaddr_from.sin_addr.s_addr) % nreceivers == rx->index){
+				if(r){
+					process_response((char *)data, ndata, &sockaddr_from);
+
+					answer.addr= sockaddr_from.sin_addr;
+					answer.sport= ntohs(sockaddr_from.sin_port);
+
+					/* An answer that is not reported only means that the probe may be retransmitted */
+					if(write(answer_pipe[1], &answer, sizeof(answer)) != sizeof(answer)){
+						if(errno != EAGAIN && errno != EWOULDBLOCK){
+							perror("iot-scan");
+							exit(EXIT_FAILURE);
+						}
+
+						rx->nunreported++;
+					}
 				}
+				else{
+					rx->ndropped++;
+				}
+			}
+
+			pktbuf_unref(pkts[i]);
+		}
+	}
+
+	return(NULL);
+}
+
+
+/*
+ * Function: prefix_write()
+ *
+ * Event loop callback for the raw socket employed for sending scan_prefix() probes. It sends as
+ * many probes (retransmissions first) as the token bucket and the in-flight limit allow, and
+ * then sleeps until more probes can be sent
+ */
+
+void prefix_write(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct scan_state	*scan= arg;
+	struct probe		*probe;
+	struct in_addr		target;
+	uint64_t			now, wait;
+	unsigned int		f, nobufs_f=FALSE, blocked_f=FALSE;
+	int					r;
+
+	if(events & REACTOR_ERROR){
+		if(idata.verbose_f)
+			puts("iot-scan: Found exception on descriptor");
+
+		exit(EXIT_FAILURE);
+	}
+
+	if( (now= monotonic_nsec()) == 0){
+		if(idata.verbose_f)
+			perror("iot-scan");
+
+		exit(EXIT_FAILURE);
+	}
+
+	scan->idle_f= FALSE;
+
+	while(!nobufs_f && !blocked_f){
+		/* Queue as many probes as the token bucket and the in-flight limit allow */
+		while(scan->txbatch.n < scan->txbatch.size && PREFIX_PENDING(scan) && tb_consume(&(scan->tb), now)){
+			if(scan->inflight.rtxq != NULL){
+				probe= (struct probe *) scan->inflight.rtxq;
+				twheel_unlink(&(probe->entry));
+				probe->queued_f= FALSE;
+			}
+			else{
+				sweep_target(&(scan->sweep), &target, &f);
+
+				/* XXX: Will not happen (the in-flight limit has been checked), but still check */
+				if( (probe= add_inflight(&(scan->inflight), &target, f)) == NULL)
+					break;
+
+				if(!sweep_advance(&(scan->sweep)))
+					scan->sweepdone_f= TRUE;
+
+				if(scan->maxtx > 1)
+					scan->nactive++;
+			}
+
+			/* Retransmit the probe later, or release it once the response timeout has expired */
+			probe->ntx++;
+			probe->sent= now;
+			scan->sent= now;
+
+			if(probe->ntx == scan->maxtx && scan->maxtx > 1)
+				scan->nactive--;
+			twheel_add(&(scan->inflight.wheel), &(probe->entry), now + probe_timeout(scan, probe));
+
+			scan->sockaddr_to.sin_addr= probe->target;
+			nsendbuff= build_probe(BATCH_SLOT(&(scan->txbatch), scan->txbatch.n), scan->txbatch.bufflen, &(probe->target), probe->family);
+			batch_add(&(scan->txbatch), BATCH_SLOT(&(scan->txbatch), scan->txbatch.n), nsendbuff, &(scan->sockaddr_to));
+		}
+
+		if(scan->txbatch.n == 0)
+			break;
+
+		/* Send the queued probes with as few system calls as possible */
+		while(scan->txbatch.n){
+			if( (r=send_batch(fd, &(scan->txbatch))) == -1){
+				/* The socket buffer is full: send the remaining probes once the socket is writable */
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					blocked_f= TRUE;
+					break;
+				}
+
+				/* The interface queue is full: try again a bit later */
+				if(errno == ENOBUFS){
+					nobufs_f= TRUE;
+					break;
+				}
+
+				/* Unreachable (or otherwise unusable) targets do not abort the scan */
+				if(idata.verbose_f > 1){
+					if(inet_ntop(AF_INET, &(scan->txbatch.addr[0].sin_addr), pv4addr, sizeof(pv4addr)) != NULL)
+						printf("Error sending probe to %s: %s\n", pv4addr, strerror(errno));
+				}
+
+				batch_drop(&(scan->txbatch), 1);
+			}
+			else{
+				scan->nprobes+= r;
+			}
+		}
+	}
+
+	prefix_schedule(scan);
+
+	if(blocked_f)
+		return;
+
+	/* Stop polling for writability: a timer will resume sending when more probes can be sent */
+	reactor_set_events(reactor, fd, 0);
+
+	if(nobufs_f){
+		wait= PACE_RETRY_INTERVAL;
+	}
+	else if(scan->txbatch.n == 0 && !PREFIX_PENDING(scan)){
+		/*
+		   Nothing can be sent until a probe is due for retransmission or a probe in flight is
+		   released (see prefix_resume())
+		 */
+		scan->idle_f= TRUE;
+		prefix_resume(scan);
+		return;
+	}
+	else{
+		wait= tb_wait_time(&(scan->tb), now);
+	}
+
+	reactor_timer_set(reactor, &(scan->rtx_timer), (wait > 0)?wait:1);
+}
+
+
+/*
+ * Function: prefix_pace()
+ *
+ * Event loop timer callback that resumes sending scan_prefix() probes
+ */
+
+void prefix_pace(struct reactor *reactor, void *arg){
+	struct scan_state	*scan= arg;
+
+	reactor_set_events(reactor, scan->sfd, REACTOR_WRITE);
+}
+
+
+/*
+ * Function: prefix_resume()
+ *
+ * Ends the scan once all probes have been released (or schedules its end once all probes have
+ * been sent for the last time), or resumes sending probes if sending was stopped and there are
+ * more probes that can be sent
+ */
+
+void prefix_resume(struct scan_state *scan){
+	if(scan->sweepdone_f && scan->inflight.n == 0){
+		reactor_stop(&(scan->reactor));
+		return;
+	}
+
+	/* All probes have been sent for the last time: end once no further responses are expected */
+	if(scan->sweepdone_f && scan->nactive == 0)
+		schedule_end(scan);
+
+	if(scan->idle_f && PREFIX_PENDING(scan)){
+		scan->idle_f= FALSE;
+		reactor_set_events(&(scan->reactor), scan->sfd, REACTOR_WRITE);
+	}
+}
+
+
+/*
+ * Function: prefix_tick()
+ *
+ * Event loop timer callback that advances the timing wheel of the probes in flight
+ */
+
+void prefix_tick(struct reactor *reactor, void *arg){
+	struct scan_state	*scan= arg;
+
+	twheel_advance(&(scan->inflight.wheel), reactor->now, probe_expired, scan);
+	prefix_schedule(scan);
+	prefix_resume(scan);
+}
+
+
+/*
+ * Function: prefix_schedule()
+ *
+ * Arms the event loop timer that drives the timing wheel of the probes in flight
+ */
+
+void prefix_schedule(struct scan_state *scan){
+	uint64_t	next, now;
+
+	if( (next= twheel_next_expiry(&(scan->inflight.wheel))) == UINT64_MAX){
+		reactor_timer_cancel(&(scan->reactor), &(scan->wheel_timer));
+		return;
+	}
+
+	now= monotonic_nsec();
+	reactor_timer_set(&(scan->reactor), &(scan->wheel_timer), (next > now)?(next - now):0);
+}
+
+
+/*
+ * Function: probe_expired()
+ *
+ * Timing wheel callback for a probe in flight: the probe is queued for retransmission or, after
+ * the response timeout for its last transmission has expired, released
+ */
+
+void probe_expired(struct twheel *wheel, struct twheel_entry *entry, void *arg){
+	struct scan_state	*scan= arg;
+	struct probe		*probe= (struct probe *) entry;
+
+	if(probe->ntx < scan->maxtx){
+		twheel_link(&(scan->inflight.rtxq), entry);
+		probe->queued_f= TRUE;
+	}
+	else{
+		remove_inflight(&(scan->inflight), probe);
+	}
+}
+
+
+/*
+ * Function: release_probe()
+ *
+ * Releases a probe in flight, cancelling its pending retransmission or expiry
+ */
+
+void release_probe(struct scan_state *scan, struct probe *probe){
+	if(probe->ntx < scan->maxtx)
+		scan->nactive--;
+
+	if(probe->queued_f){
+		twheel_unlink(&(probe->entry));
+		probe->queued_f= FALSE;
+	}
+	else{
+		twheel_cancel(&(scan->inflight.wheel), &(probe->entry));
+	}
+
+	remove_inflight(&(scan->inflight), probe);
+}
+
+
+/*
+ * Function: probe_timeout()
+ *
+ * Obtains the time (in nanoseconds) to wait after a transmission of a probe: the RTO of its
+ * device family (with exponential backoff) before a retransmission, or the response timeout
+ * (but no less than the RTO) after the last transmission
+ */
+
+uint64_t probe_timeout(struct scan_state *scan, struct probe *probe){
+	uint64_t	rto;
+
+	rto= rtt_rto(&(scan->rtt[probe->family]), probe->ntx - 1);
+
+	if(probe->ntx < scan->maxtx)
+		return(rto);
+
+	return(MAX(idata.local_timeout * NSEC_PER_SEC, rto));
+}
+
+
+/*
+ * Function: local_rto()
+ *
+ * Obtains the retransmission timeout (in nanoseconds) for the scan_local() probes after "nbackoff"
+ * consecutive timeouts: the largest RTO of the selected device families
+ */
+
+uint64_t local_rto(struct scan_state *scan, unsigned int nbackoff){
+	uint64_t		rto, max=0;
+	unsigned int	f;
+
+	for(f=0; f < NUM_FAMILIES; f++){
+		if(families[f].enabled_f && (rto= rtt_rto(&(scan->rtt[f]), nbackoff)) > max)
+			max= rto;
+	}
+
+	return(max);
+}
+
+
+/*
+ * Function: init_port_families()
+ *
+ * Builds the table that maps the source port of a response to the enabled device family
+ * that responds from it
+ */
+
+void init_port_families(void){
+	unsigned int	f;
+
+	memset(port_family, NUM_FAMILIES, sizeof(port_family));
+
+	for(f=0; f < NUM_FAMILIES; f++){
+		if(families[f].enabled_f)
+			port_family[families[f].srcport]= f;
+	}
+}
+
+
+/*
+ * Function: response_family()
+ *
+ * Obtains the device family that responds from a specific UDP port. Returns NUM_FAMILIES if
+ * there is no such family
+ */
+
+unsigned int response_family(uint16_t sport){
+	return(port_family[sport]);
+}
+
+
+/*
+ * Function: init_fingerprints()
+ *
+ * Builds the database of response fingerprints (the built-in ones, plus those of the
+ * fingerprint file specified with -P)
+ */
+
+void init_fingerprints(void){
+	unsigned int	i;
+
+	init_fpdb(&fpdb);
+
+	for(i=0; i < NUM_FINGERPRINTS; i++){
+		if(add_fingerprint(&fpdb, &fingerprints[i]) == FAILURE){
+			puts("Error adding built-in fingerprints");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(fingerprint_file != NULL && load_fingerprints(&fpdb, fingerprint_file, NUM_FAMILIES) == FAILURE){
+		printf("Error loading fingerprint file %s\n", fingerprint_file);
+		exit(EXIT_FAILURE);
+	}
+
+	if(compile_fpdb(&fpdb) == FAILURE){
+		puts("Error compiling the response fingerprints");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i=0; i < fpdb.nfps; i++)
+		families[fpdb.fps[i].family].fingerprint_f= TRUE;
+
+	if(idata.verbose_f)
+		printf("Loaded %u response fingerprints (%u automaton states)\n", fpdb.nfps, fpdb.nstates);
+}
+
+
+/*
+ * Function: cookie_port()
+ *
+ * Computes the UDP source port employed for probing a target. The port is derived from a keyed
+ * hash of the target address, such that responses can be validated without keeping any state
+ */
+
+uint16_t cookie_port(struct in_addr *target){
+	return( COOKIE_PORT_BASE + (uint16_t) (siphash(cookie_key, &(target->s_addr), sizeof(target->s_addr)) % COOKIE_PORT_RANGE));
+}
+
+
+/*
+ * Function: build_probe()
+ *
+ * Builds the IPv4 packet that probes a target for a device family. Returns the packet length
+ */
+
+size_t build_probe(char *buff, size_t size, struct in_addr *target, unsigned int f){
+	struct ip_hdr		*ip_hdr;
+	struct udp_hdr		*udp_hdr;
+	uint32_t			addrsum;
+
+	/* XXX: Will not happen, but still check in case code is changed */
+	if(families[f].npacket > size){
+		puts("Internal buffer too short");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(buff, families[f].packet, families[f].npacket);
+	ip_hdr=(struct ip_hdr *) (buff);
+	udp_hdr = (struct udp_hdr *) (buff + sizeof(struct ip_hdr));
+
+	ip_hdr->ip_src= idata.srcaddr;
+	ip_hdr->ip_dst= *target;
+	udp_hdr->uh_sport = htons(cookie_port(target)); 
+
+	/* Only the addresses and the source port are added to the checksums computed by init_probes() */
+	addrsum= in_chksum_add(in_chksum_add(0, &(idata.srcaddr), sizeof(struct in_addr)), target, sizeof(struct in_addr));
 
+	if( (udp_hdr->uh_sum= in_chksum_fold(families[f].udpsum + addrsum + udp_hdr->uh_sport)) == 0)
+		udp_hdr->uh_sum= 0xffff;
 
-				if(FD_ISSET(idata.fd, &eset)){
-					if(idata.verbose_f)
-						puts("iot-scan: Found exception on descriptor");
+	ip_hdr->ip_sum = in_chksum_fold(families[f].ipsum + addrsum);
+	return(families[f].npacket);
+}
 
-					exit(EXIT_FAILURE);
-				}
-			}
 
-			destroy_local_nodes(&nodes);
+/*
+ * Function: init_probes()
+ *
+ * Encodes the probe of each device family once, into a packet whose addresses, source port and
+ * checksums are filled by build_probe(). The partial checksums of the remaining fields are computed here
+ */
+
+void init_probes(void){
+	struct ip_hdr		*ip_hdr;
+	struct udp_hdr		*udp_hdr;
+	struct pseudohdr	pseudohdr;
+	unsigned int		f;
+	size_t				ndata;
+
+	for(f=0; f < NUM_FAMILIES; f++){
+		ndata= families[f].nprobe;
+		families[f].npacket= sizeof(struct ip_hdr) + sizeof(struct udp_hdr) + ndata;
+
+		if( (families[f].packet= calloc(1, families[f].npacket)) == NULL){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
 		}
 
+		families[f].payload= families[f].packet + sizeof(struct ip_hdr) + sizeof(struct udp_hdr);
+		memcpy(families[f].payload, families[f].probe, ndata);
+
+		if(families[f].crypt_f)
+			tp_link_crypt((unsigned char *) families[f].payload, ndata);
+
+		/* The UDP pseudo-header is not sent, and only contributes to the checksum */
+		memset(&pseudohdr, 0, sizeof(struct pseudohdr));
+		pseudohdr.protocol= IPPROTO_UDP;
+		pseudohdr.length= htons(sizeof(struct udp_hdr) + ndata);
+
+		udp_hdr = (struct udp_hdr *) (families[f].packet + sizeof(struct ip_hdr));
+		udp_hdr->uh_dport = htons(families[f].dstport); 
+		udp_hdr->uh_ulen= htons(sizeof(struct udp_hdr) + ndata);
+		families[f].udpsum= in_chksum_add(in_chksum_add(0, &pseudohdr, sizeof(struct pseudohdr)), udp_hdr, \
+								sizeof(struct udp_hdr) + ndata);
+
+		ip_hdr=(struct ip_hdr *) (families[f].packet);
+		ip_hdr->ip_v = 4;
+		ip_hdr->ip_hl= sizeof(struct ip_hdr) >> 2;
+		ip_hdr->ip_tos= 0;
+		ip_hdr->ip_len= htons(families[f].npacket);
+		ip_hdr->ip_id= 0; /* Filled by the kernel */
+		ip_hdr->ip_off= 0;
+		ip_hdr->ip_ttl= 64;
+		ip_hdr->ip_p= IPPROTO_UDP;
+		families[f].ipsum= in_chksum_add(0, ip_hdr, sizeof(struct ip_hdr));
+	}
+}
 
 
+/*
+ * Function: init_sweep()
+ *
+ * Initializes the state employed for walking all addresses of a prefix. Addresses are visited
+ * in a pseudorandom order (a keyed permutation of the prefix), such that load is spread across
+ * the network rather than hitting one subnet at a time
+ */
 
-		/* TP-Link IP Cameras */
-		if(scan_type | SCAN_IP_CAMERAS){
-			retrans=0;
+void init_sweep(struct sweep *sweep, struct prefixv4_entry *pref, uint64_t seed){
+	uint32_t	mask32;
 
-			if(!create_local_nodes(&nodes)){
-				puts("Not enough memory");
-				exit(EXIT_FAILURE);
-			}
+	mask32= (pref->len == 0)?0:(0xffffffff << (32 - pref->len));
+	sweep->base= ntohl(pref->ip.s_addr) & mask32;
+	sweep->naddrs= (unsigned long long) 1 << (32 - pref->len);
+	sweep->next= 0;
+	sweep->family= 0;
+	init_permutation(&(sweep->perm), 32 - pref->len, seed);
 
-			donesending_f=FALSE;
-			end_f=FALSE;
-			memset(&sockaddr_to, 0, sizeof(sockaddr_to));
-			sockaddr_to.sin_family= AF_INET;
-			sockaddr_to.sin_port= htons(TP_LINK_IP_CAMERA_TDDP_PORT);
+	/* Probing the network and broadcast addresses would send broadcasts (/31 and /32 prefixes have neither) */
+	sweep->skip_f= (pref->len < 31);
+	sweep->ntargets= sweep->skip_f?(sweep->naddrs - 2):sweep->naddrs;
+	sweep_skip(sweep);
 
-			memset(&sockaddr_from, 0, sizeof(sockaddr_from));
-			sockaddr_from.sin_family= AF_INET;
-			sockaddrfrom_len=sizeof(sockaddr_from);
+	/* Move to the first selected family */
+	while(sweep->family < NUM_FAMILIES && !families[sweep->family].enabled_f)
+		sweep->family++;
+}
 
 
-			if ( inet_pton(AF_INET, IP_LIMITED_MULTICAST, &(sockaddr_to.sin_addr)) <= 0){
-				puts("inet_pton(): Error setting multicast address");
-				exit(EXIT_FAILURE);
-			}
+/*
+ * Function: sweep_target()
+ *
+ * Obtains the next target address and device family to be probed
+ */
 
-			FD_ZERO(&sset);
-			FD_SET(idata.fd, &sset);
+void sweep_target(struct sweep *sweep, struct in_addr *target, unsigned int *family){
+	target->s_addr= htonl(sweep->base + sweep->index);
+	*family= sweep->family;
+}
 
-			lastprobe.tv_sec= 0;	
-			lastprobe.tv_usec=0;
-			idata.pending_write_f=TRUE;	
 
-			/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-			   That is, we give responses enough time to come back
-			 */
-			while(!end_f){
-				rset= sset;
-				wset= sset;
-				eset= sset;
-
-				if(!donesending_f){
-					/* This is the retransmission timer */
-					timeout.tv_sec=  rx_timer/1000000;
-					timeout.tv_usec= rx_timer%1000000;
-				}
-				else{
-					/* XXX: This should use the parameter from command line */
-					timeout.tv_sec= idata.local_timeout;
-					timeout.tv_usec=0;
-				}
+/*
+ * Function: sweep_skip()
+ *
+ * Moves to the first position of the permutation, starting at the current one, whose address is to
+ * be probed, and obtains its index within the prefix
+ */
 
-				/*
-					Check for readability and exceptions. We only check for writeability if there is pending data
-					to send.
-				 */
-				if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-					if(errno == EINTR){
-						continue;
-					}
-					else{
-						perror("iot-scan:");
-						exit(EXIT_FAILURE);
-					}
-				}
+void sweep_skip(struct sweep *sweep){
+	for(; sweep->next < sweep->naddrs; sweep->next++){
+		sweep->index= permute_index(&(sweep->perm), (uint32_t) sweep->next);
 
-				if(gettimeofday(&curtime, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-scan");
+		if(!sweep->skip_f || (sweep->index != 0 && sweep->index != (sweep->naddrs - 1)))
+			break;
+	}
+}
 
-					exit(EXIT_FAILURE);
-				}
 
-				/* Check whether we have finished probing all targets */
-				if(donesending_f){
-					/*
-					   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-					*/
+/*
+ * Function: sweep_advance()
+ *
+ * Moves to the next (target, family) pair. Returns FALSE when all targets have been visited
+ */
 
-					if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-						end_f=TRUE;
-					}
-				}
+unsigned int sweep_advance(struct sweep *sweep){
+	do{
+		sweep->family++;
+	}while(sweep->family < NUM_FAMILIES && !families[sweep->family].enabled_f);
 
+	if(sweep->family < NUM_FAMILIES)
+		return(TRUE);
 
-				if(sel && FD_ISSET(idata.fd, &rset)){
-					/* XXX: Process response packet */
+	sweep->family= 0;
 
-					if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+	while(sweep->family < NUM_FAMILIES && !families[sweep->family].enabled_f)
+		sweep->family++;
 
+	sweep->next++;
+	sweep_skip(sweep);
+	return(sweep->next < sweep->naddrs);
+}
 
-					if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
 
-					/* Compare response with known one */
-					if(nreadbuff == sizeof(TP_LINK_IP_CAMERA_RESPONSE)){
-						if(memcmp(readbuff, TP_LINK_IP_CAMERA_RESPONSE, nreadbuff) == 0){
-							if( !is_in_local_nodes(&nodes, &(sockaddr_from.sin_addr))){
-								add_to_local_nodes(&nodes, &(sockaddr_from.sin_addr));
-								printf("%s # camera: TP-Link IP camera\n", pv4addr);
-							}
-						}
-					}
+/*
+ * Function: create_inflight()
+ *
+ * Creates the structure that tracks (up to "max") probes in flight. "now" is the current
+ * monotonic time (in nanoseconds)
+ */
 
-				}
+unsigned int create_inflight(struct inflight *inflight, unsigned int max, uint64_t now){
+	uint32_t	i;
 
+	inflight->max= (max > 0)?max:1;
+	inflight->n=0;
+	inflight->rtxq= NULL;
 
-				if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, rx_timer)){
-					idata.pending_write_f=TRUE;
-					continue;
-				}
+	for(inflight->nbuckets=1; inflight->nbuckets < inflight->max; inflight->nbuckets<<= 1);
+
+	if( (inflight->probes= malloc(sizeof(struct probe) * inflight->max)) == NULL)
+		return FALSE;
 
-				if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-					idata.pending_write_f=FALSE;
+	if( (inflight->buckets= malloc(sizeof(uint32_t) * inflight->nbuckets)) == NULL){
+		free(inflight->probes);
+		inflight->probes= NULL;
+		return FALSE;
+	}
 
-					/* XXX: SEND PROBE PACKET */
+	for(i=0; i < inflight->nbuckets; i++)
+		inflight->buckets[i]= PROBE_NONE;
 
-					/* XXX: Will not happen, but still check in case code is changed */
-					if(sizeof(TP_LINK_IP_CAMERA_DISCOVER) > sizeof(sendbuff)){
-						puts("Internal buffer too short");
-						exit(EXIT_FAILURE);
-					}
+	/* All probes start in the free list */
+	for(i=0; i < inflight->max; i++){
+		inflight->probes[i].entry.next= NULL;
+		inflight->probes[i].entry.pprev= NULL;
+		inflight->probes[i].hnext= ((i + 1) < inflight->max)?(i + 1):PROBE_NONE;
+	}
 
-					nsendbuff= sizeof(TP_LINK_IP_CAMERA_DISCOVER);
-					memcpy(sendbuff, TP_LINK_IP_CAMERA_DISCOVER, nsendbuff);
+	inflight->free= 0;
+	twheel_init(&(inflight->wheel), WHEEL_TICK, now);
+	return TRUE;
+}
 
-					if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
 
-					if(gettimeofday(&lastprobe, NULL) == -1){
-						if(idata.verbose_f)
-							perror("iot-scan");
+/*
+ * Function: destroy_inflight()
+ *
+ * Destroys the structure that tracks the probes in flight
+ */
 
-						exit(EXIT_FAILURE);
-					}
+void destroy_inflight(struct inflight *inflight){
+	inflight->max=0;
+	inflight->n=0;
+	free(inflight->probes);
+	inflight->probes= NULL;
+	free(inflight->buckets);
+	inflight->buckets= NULL;
+}
 
-					retrans++;
 
-					if(retrans >= idata.local_retrans)
-						donesending_f= 1;
+/*
+ * Function: inflight_hash()
+ *
+ * Computes the hash bucket of a (target, family) pair
+ */
 
-				}
+uint32_t inflight_hash(struct inflight *inflight, struct in_addr *target, unsigned int family){
+	uint32_t	h;
 
+	h= (ntohl(target->s_addr) ^ (family << 29)) * 0x9e3779b1;
+	return( (h ^ (h >> 16)) & (inflight->nbuckets - 1));
+}
 
-				if(FD_ISSET(idata.fd, &eset)){
-					if(idata.verbose_f)
-						puts("iot-scan: Found exception on descriptor");
 
-					exit(EXIT_FAILURE);
-				}
-			}
+/*
+ * Function: add_inflight()
+ *
+ * Starts tracking a probe for a (target, family) pair. Returns NULL if the in-flight limit
+ * has been reached
+ */
+
+struct probe *add_inflight(struct inflight *inflight, struct in_addr *target, unsigned int family){
+	struct probe	*probe;
+	uint32_t		i, h;
+
+	if( (i= inflight->free) == PROBE_NONE)
+		return(NULL);
+
+	probe= &(inflight->probes[i]);
+	inflight->free= probe->hnext;
+
+	probe->target= *target;
+	probe->family= family;
+	probe->ntx= 0;
+	probe->queued_f= FALSE;
+
+	h= inflight_hash(inflight, target, family);
+	probe->hnext= inflight->buckets[h];
+	inflight->buckets[h]= i;
+	inflight->n++;
+	return(probe);
+}
+
+
+/*
+ * Function: find_inflight()
+ *
+ * Looks up the probe in flight for a (target, family) pair
+ */
+
+struct probe *find_inflight(struct inflight *inflight, struct in_addr *target, unsigned int family){
+	uint32_t	i;
+
+	for(i= inflight->buckets[inflight_hash(inflight, target, family)]; i != PROBE_NONE; i= inflight->probes[i].hnext){
+		if(inflight->probes[i].target.s_addr == target->s_addr && inflight->probes[i].family == family)
+			return(&(inflight->probes[i]));
+	}
+
+	return(NULL);
+}
+
+
+/*
+ * Function: remove_inflight()
+ *
+ * Stops tracking a probe (which must not be linked to the timing wheel or retransmission queue)
+ */
+
+void remove_inflight(struct inflight *inflight, struct probe *probe){
+	uint32_t	i, *prev;
+
+	i= probe - inflight->probes;
+	prev= &(inflight->buckets[inflight_hash(inflight, &(probe->target), probe->family)]);
+
+	while(*prev != PROBE_NONE && *prev != i)
+		prev= &(inflight->probes[*prev].hnext);
+
+	/* XXX: Will not happen, but still check in case code is changed */
+	if(*prev == PROBE_NONE)
+		return;
+
+	*prev= probe->hnext;
+	probe->hnext= inflight->free;
+	inflight->free= i;
+	inflight->n--;
+}
+
+
+/*
+ * Function: process_response()
+ *
+ * Hands a response datagram to the parser of the matching device family: the family is looked up
+ * by source port, and the response must then have a valid length and match a fingerprint of the
+ * family (if it has any). Families without a parser are reported with the fingerprint description
+ */
 
-			destroy_local_nodes(&nodes);
+void process_response(char *buff, ssize_t nbuff, struct sockaddr_in *from){
+	struct probe_family		*family;
+	struct fingerprint		*fp;
+	unsigned int			f;
+
+	if( (f= port_family[ntohs(from->sin_port)]) >= NUM_FAMILIES)
+		return;
+
+	family= &families[f];
+
+	if((size_t) nbuff < family->minlen || (size_t) nbuff > family->maxlen)
+		return;
+
+	if(family->fingerprint_f){
+		if( (fp=match_fingerprint(&fpdb, (unsigned char *) buff, nbuff, f)) == NULL)
+			return;
+
+		if(family->parse == NULL){
+			report_node(f, &(from->sin_addr), fp->desc);
+			return;
 		}
+	}
 
+	family->parse(buff, nbuff, from);
+}
 
-		/* Genius IP cameras */
-		if(scan_type | SCAN_IP_CAMERAS){
-			retrans=0;
 
-			if(!create_local_nodes(&nodes)){
-				puts("Not enough memory");
-				exit(EXIT_FAILURE);
-			}
+/*
+ * Function: process_tp_link_plug()
+ *
+ * Processes a response from a TP-Link smart plug
+ */
 
-			donesending_f=FALSE;
-			end_f=FALSE;
-			memset(&sockaddr_to, 0, sizeof(sockaddr_to));
-			sockaddr_to.sin_family= AF_INET;
-			sockaddr_to.sin_port= htons(GENIUS_IP_CAMERA_SERVICE_PORT);
+void process_tp_link_plug(char *buff, ssize_t nbuff, struct sockaddr_in *from){
+	struct json_value		values[NUM_SYSINFO_PATHS];
+	char					desc[REPORT_LENGTH];
+	unsigned int			i;
 
-			memset(&sockaddr_from, 0, sizeof(sockaddr_from));
-			sockaddr_from.sin_family= AF_INET;
-			sockaddrfrom_len=sizeof(sockaddr_from);
+	tp_link_decrypt((unsigned char *)buff, nbuff);
 
+	for(i=0; i < NUM_SYSINFO_PATHS; i++){
+		values[i].value= NULL_STRING;
+		values[i].len= 0;
+	}
 
-			if ( inet_pton(AF_INET, IP_LIMITED_MULTICAST, &(sockaddr_to.sin_addr)) <= 0){
-				puts("inet_pton(): Error setting multicast address");
-				exit(EXIT_FAILURE);
-			}
+	values[SYSINFO].value= NULL;
 
-			FD_ZERO(&sset);
-			FD_SET(idata.fd, &sset);
+	/* All the members of system:get_sysinfo are obtained in a single pass */
+	if(json_get_paths(buff, nbuff, sysinfo_paths, values, NUM_SYSINFO_PATHS) > 0 && values[SYSINFO].value != NULL){
+		snprintf(desc, sizeof(desc), "%.*s: TP-Link %.*s: %.*s: \"%.*s\"", (int) values[SYSINFO_TYPE].len, values[SYSINFO_TYPE].value, \
+				(int) values[SYSINFO_MODEL].len, values[SYSINFO_MODEL].value, (int) values[SYSINFO_DEV_NAME].len, values[SYSINFO_DEV_NAME].value, \
+				(int) values[SYSINFO_ALIAS].len, values[SYSINFO_ALIAS].value);
+		report_node(FAMILY_TP_LINK_PLUG, &(from->sin_addr), desc);
+	}
+}
 
-			lastprobe.tv_sec= 0;	
-			lastprobe.tv_usec=0;
-			idata.pending_write_f=TRUE;	
 
-			/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-			   That is, we give responses enough time to come back
-			 */
-			while(!end_f){
-				rset= sset;
-				wset= sset;
-				eset= sset;
-
-				if(!donesending_f){
-					/* This is the retransmission timer */
-					timeout.tv_sec=  rx_timer/1000000;
-					timeout.tv_usec= rx_timer%1000000;
-				}
-				else{
-					/* XXX: This should use the parameter from command line */
-					timeout.tv_sec= idata.local_timeout;
-					timeout.tv_usec=0;
-				}
+/*
+ * Function: process_edimax_plug()
+ *
+ * Processes a response from an Edimax smart plug
+ */
 
-				/*
-					Check for readability and exceptions. We only check for writeability if there is pending data
-					to send.
-				 */
-				if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-					if(errno == EINTR){
-						continue;
-					}
-					else{
-						perror("iot-scan:");
-						exit(EXIT_FAILURE);
-					}
-				}
+void process_edimax_plug(char *buff, ssize_t nbuff, struct sockaddr_in *from){
+	char edimax_man[EDIMAX_MAN_LEN+1], edimax_model[EDIMAX_MOD_LEN+1], edimax_version[EDIMAX_VER_LEN+1], edimax_display[EDIMAX_DIS_LEN+1];
+	struct edimax_discover_response *edimax;
+	char					desc[REPORT_LENGTH];
 
-				if(gettimeofday(&curtime, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-scan");
+	edimax= (struct edimax_discover_response *) buff;
 
-					exit(EXIT_FAILURE);
-				}
+	strncpy(edimax_man, edimax->manufacturer, EDIMAX_MAN_LEN);
+	edimax_man[EDIMAX_MAN_LEN]=0;
 
-				/* Check whether we have finished probing all targets */
-				if(donesending_f){
-					/*
-					   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-					*/
+	strncpy(edimax_model, edimax->model, EDIMAX_MOD_LEN);
+	edimax_model[EDIMAX_MOD_LEN]=0;
 
-					if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-						end_f=TRUE;
-					}
-				}
+	strncpy(edimax_version, edimax->version, EDIMAX_VER_LEN);
+	edimax_version[EDIMAX_VER_LEN]=0;
 
+	strncpy(edimax_display, edimax->displayname, EDIMAX_DIS_LEN);
+	edimax_display[EDIMAX_DIS_LEN]=0;
 
-				if(sel && FD_ISSET(idata.fd, &rset)){
-					/* XXX: Process response packet */
+	snprintf(desc, sizeof(desc), "smartplug: %s %s %s: \"%s\"", edimax_man, edimax_model, edimax_version, edimax_display);
+	report_node(FAMILY_EDIMAX_PLUG, &(from->sin_addr), desc);
+}
 
-					if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
-	/* puts("Got response"); */
 
-					if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+/*
+ * Function: report_node()
+ *
+ * Output stage shared by all the threads that parse responses: queues a node for the output
+ * thread the first time it responds for a device family. Only the set of nodes and the output are serialized, such that
+ * responses can be decrypted and parsed concurrently
+ */
 
-					if(nreadbuff == sizeof(GENIUS_IP_CAMERA_RESPONSE) && ntohs(sockaddr_from.sin_port) == GENIUS_IP_CAMERA_SENDING_PORT){
-						if( !is_in_local_nodes(&nodes, &(sockaddr_from.sin_addr))){
-							add_to_local_nodes(&nodes, &(sockaddr_from.sin_addr));
-							printf("%s # camera: Genius IP camera\n", pv4addr);
-						}
-					}
-				}
+void report_node(unsigned int f, struct in_addr *addr, char *desc){
+	char	paddr[INET_ADDRSTRLEN], *rec;
 
+	if(inet_ntop(AF_INET, addr, paddr, sizeof(paddr)) == NULL){
+		perror("iot-scan: ");
+		exit(EXIT_FAILURE);
+	}
 
-				if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, rx_timer)){
-					idata.pending_write_f=TRUE;
-					continue;
-				}
+	pthread_mutex_lock(&output_mutex);
 
-				if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-					idata.pending_write_f=FALSE;
+	/* A node whose record is dropped is not recorded, such that a later response may report it */
+	if(!is_in_local_nodes(&(families[f].nodes), addr) && (rec=ring_reserve(&output_ring, output_wait_f)) != NULL){
+		if(!add_to_local_nodes(&(families[f].nodes), addr)){
+			puts("Not enough memory");
+			exit(EXIT_FAILURE);
+		}
 
-					/* XXX: SEND PROBE PACKET */
+		snprintf(rec, output_ring.reclen, "%s # %s\n", paddr, desc);
+		ring_commit(&output_ring);
+	}
 
-					/* XXX: Will not happen, but still check in case code is changed */
-					if(sizeof(GENIUS_IP_CAMERA_DISCOVER) > sizeof(sendbuff)){
-						puts("Internal buffer too short");
-						exit(EXIT_FAILURE);
-					}
+	pthread_mutex_unlock(&output_mutex);
+}
 
-					nsendbuff= sizeof(GENIUS_IP_CAMERA_DISCOVER);
-					memcpy(sendbuff, GENIUS_IP_CAMERA_DISCOVER, nsendbuff);
 
-					if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-						perror("iot-scan: ");
-						exit(EXIT_FAILURE);
-					}
+/*
+ * Function: start_output()
+ *
+ * Starts the thread that writes the nodes that have responded
+ */
 
-					if(gettimeofday(&lastprobe, NULL) == -1){
-						if(idata.verbose_f)
-							perror("iot-scan");
+void start_output(void){
+	if(!create_ring(&output_ring, OUTPUT_RING_SIZE, OUTPUT_RECORD_LENGTH)){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
 
-						exit(EXIT_FAILURE);
-					}
+	output_done_f= FALSE;
 
-					retrans++;
+	if(pthread_create(&output_thread, NULL, output_writer, NULL) != 0){
+		puts("Error creating output thread");
+		exit(EXIT_FAILURE);
+	}
+}
 
-					if(retrans >= idata.local_retrans)
-						donesending_f= 1;
 
-				}
+/*
+ * Function: stop_output()
+ *
+ * Waits for the output thread to write all pending records, and reports any results that were
+ * dropped (or the time spent waiting) because the output could not keep up with the scan
+ */
 
+void stop_output(void){
+	__atomic_store_n(&output_done_f, TRUE, __ATOMIC_RELEASE);
+	pthread_join(output_thread, NULL);
 
-				if(FD_ISSET(idata.fd, &eset)){
-					if(idata.verbose_f)
-						puts("iot-scan: Found exception on descriptor");
+	if(output_ring.ndropped)
+		printf("Dropped %llu results because the output could not keep up (see '-W')\n", output_ring.ndropped);
+
+	if(idata.verbose_f && output_ring.blocked)
+		printf("Waited %.3f seconds for the output\n", (double) output_ring.blocked / NSEC_PER_SEC);
+
+	destroy_ring(&output_ring);
+}
 
-					exit(EXIT_FAILURE);
-				}
-			}
 
-			destroy_local_nodes(&nodes);
+/*
+ * Function: output_writer()
+ *
+ * Output thread: writes the records of the output ring, and flushes the output whenever the
+ * ring becomes empty
+ */
+
+void *output_writer(void *arg){
+	struct timespec	ts;
+	char			*rec;
+
+	ts.tv_sec= 0;
+	ts.tv_nsec= OUTPUT_IDLE_INTERVAL;
+
+	while(1){
+		if( (rec=ring_peek(&output_ring)) != NULL){
+			fputs(rec, stdout);
+			ring_release(&output_ring);
+			continue;
 		}
 
+		fflush(stdout);
+
+		/* Records committed before the end of the scan are visible once the flag is */
+		if(__atomic_load_n(&output_done_f, __ATOMIC_ACQUIRE) && ring_peek(&output_ring) == NULL)
+			break;
+
+		nanosleep(&ts, NULL);
 	}
 
-	exit(EXIT_SUCCESS);
+	return(NULL);
 }
 
 
@@ -1096,7 +2775,7 @@ int match_strings(char *buscar, char *buffer){
  */
 
 void usage(void){
-	puts("usage: iot-scan (-L | -d) [-i INTERFACE] [-v] [-h]");
+	puts("usage: iot-scan (-L | -d | -F) [-i INTERFACE] [-t TYPE] [-r RATE] [-n MAX] [-S SEED] [-q PROB] [-R NUM] [-W] [-C] [-P FILE] [-v] [-h]");
 }
 
 
@@ -1114,13 +2793,29 @@ void print_help(void){
 	puts("\nOPTIONS:\n"
 	     "  --interface, -i             Network interface\n"
 	     "  --dst-address, -d           Destination Range or Prefix\n"
-	     "  --local-scan, -L            Scan the local subnet\n"
+	     "  --local-scan, -L            Scan the local subnet (of all interfaces, unless -i is specified)\n"
 	     "  --retrans, -x               Number of retransmissions of each probe\n"
 	     "  --timeout, -O               Timeout in seconds (default: 1 second)\n"
 		 "  --type, -t                  Target device type\n"
+	     "  --rate, -r                  Probe rate in packets per second (default: 1000)\n"
+	     "  --max-inflight, -n          Maximum number of probes in flight (default: 8192)\n"
+	     "  --seed, -S                  Seed for the order in which targets are probed\n"
+	     "  --quiescence, -q            End once the probability of further responses is below this (default: 0.01)\n"
+	     "  --receivers, -R             Threads that receive and parse the responses to a sweep (default: 1)\n"
+	     "  --wait-output, -W           Wait for a slow output rather than drop results\n"
+	     "  --capture, -C               Collect the responses to a local scan with packet capture\n"
+	     "  --read-file, -F             Read the responses to previous scans from a capture file\n"
+	     "  --fingerprints, -P          Load additional response fingerprints from a fingerprint file\n"
 	     "  --help, -h                  Print help for the iot-scan tool\n"
 	     "  --verbose, -v               Be verbose\n"
 	     "\n"
+	     " Probes to a destination prefix are sent from the address the routing table selects for it\n"
+	     " (or from the address of the interface specified with -i), and from UDP source ports 49152-65535.\n"
+	     " No socket is bound to these ports, so the local host answers each response with an ICMP port\n"
+	     " unreachable error. For large sweeps, these errors should be filtered, e.g. on Linux:\n"
+	     "\n"
+	     "    iptables -A OUTPUT -p icmp --icmp-type port-unreachable -d PREFIX -j DROP\n"
+	     "\n"
 	     " Programmed by Fernando Gont for SI6 Networks <http://www.si6networks.com>\n"
 	     " Please send any bug reports to <fgont@si6networks.com>\n"
 	);
@@ -1131,17 +2826,28 @@ void print_help(void){
 /*
  * Function: create_local_nodes()
  *
- * Creates structure for discarding duplicate nodes
+ * Creates structure for discarding duplicate nodes. If "pref" is a /16 or smaller, addresses
+ * within it are recorded in a bitmap sized to the prefix
  */
 
-unsigned int create_local_nodes(struct nodes *nodes){
-#define MAX_LOCAL_NODES 65535
+unsigned int create_local_nodes(struct nodes *nodes, struct prefixv4_entry *pref){
+	memset(nodes, 0, sizeof(struct nodes));
+
+	if(pref != NULL && pref->len >= NODES_BITMAP_MIN_PREFLEN && pref->len <= 32){
+		nodes->nbitmap= (uint32_t) 1 << (32 - pref->len);
+		nodes->base= ntohl(pref->ip.s_addr) & (uint32_t) (0xffffffff << (32 - pref->len));
 
-	nodes->max= MAX_LOCAL_NODES;
-	nodes->n=0;
+		if( (nodes->bitmap= calloc((nodes->nbitmap + 31) / 32, sizeof(uint32_t))) == NULL)
+			return FALSE;
+	}
+
+	nodes->bits= NODES_MIN_BITS;
 
-	if( (nodes->node= malloc(sizeof(struct in_addr) * MAX_LOCAL_NODES)) == NULL)
+	if( (nodes->set= calloc((size_t) 1 << nodes->bits, sizeof(uint32_t))) == NULL){
+		free(nodes->bitmap);
+		nodes->bitmap= NULL;
 		return FALSE;
+	}
 
 	return TRUE;
 }
@@ -1154,31 +2860,91 @@ unsigned int create_local_nodes(struct nodes *nodes){
  */
 
 void destroy_local_nodes(struct nodes *nodes){
-#define MAX_LOCAL_NODES 65535
-
-	nodes->max=0;
-	nodes->n=0;
-	free(nodes->node);
+	free(nodes->bitmap);
+	free(nodes->set);
+	memset(nodes, 0, sizeof(struct nodes));
 	return;
 }
 
 
+/*
+ * Function: grow_local_nodes()
+ *
+ * Doubles the size of the hash set of local nodes
+ */
+
+unsigned int grow_local_nodes(struct nodes *nodes){
+	uint32_t		*set, *oldset, mask, h;
+	unsigned int	i, oldsize;
+
+	oldset= nodes->set;
+	oldsize= 1U << nodes->bits;
+
+	if( (set= calloc((size_t) oldsize * 2, sizeof(uint32_t))) == NULL)
+		return FALSE;
+
+	nodes->set= set;
+	nodes->bits++;
+	mask= (1U << nodes->bits) - 1;
+
+	for(i=0; i < oldsize; i++){
+		if(oldset[i] == 0)
+			continue;
+
+		for(h= NODES_HASH(oldset[i], nodes->bits); set[h] != 0; h= (h + 1) & mask);
+
+		set[h]= oldset[i];
+	}
+
+	free(oldset);
+	return TRUE;
+}
+
+
 /*
  * Function: add_to_local_nodes()
  *
- * Adds node to structure of local nodes
+ * Adds node to structure of local nodes. Returns FALSE if there is not enough memory
  */
 
-void add_to_local_nodes(struct nodes *nodes, struct in_addr *node){
-	if(nodes->n >= nodes->max)
-		return;
+unsigned int add_to_local_nodes(struct nodes *nodes, struct in_addr *node){
+	uint32_t	addr, mask, h;
 
-	if(nodes->node == NULL)
-		return;
+	addr= ntohl(node->s_addr);
 
-	nodes->node[nodes->n]= *node;
-	(nodes->n)++;
-	return;
+	if(nodes->bitmap != NULL && (addr - nodes->base) < nodes->nbitmap){
+		if(!(nodes->bitmap[(addr - nodes->base) >> 5] & (1U << ((addr - nodes->base) & 31)))){
+			nodes->bitmap[(addr - nodes->base) >> 5]|= 1U << ((addr - nodes->base) & 31);
+			nodes->n++;
+		}
+
+		return TRUE;
+	}
+
+	if(addr == 0){
+		if(!nodes->zero_f){
+			nodes->zero_f= TRUE;
+			nodes->n++;
+		}
+
+		return TRUE;
+	}
+
+	/* Keep the load factor of the hash set below 1/2 */
+	if((nodes->nset + 1) * 2 > (1U << nodes->bits) && !grow_local_nodes(nodes))
+		return FALSE;
+
+	mask= (1U << nodes->bits) - 1;
+
+	for(h= NODES_HASH(addr, nodes->bits); nodes->set[h] != 0; h= (h + 1) & mask){
+		if(nodes->set[h] == addr)
+			return TRUE;
+	}
+
+	nodes->set[h]= addr;
+	nodes->nset++;
+	nodes->n++;
+	return TRUE;
 }
 
 
@@ -1189,10 +2955,20 @@ void add_to_local_nodes(struct nodes *nodes, struct in_addr *node){
  */
 
 unsigned int is_in_local_nodes(struct nodes *nodes, struct in_addr *node){
-	unsigned int i;
+	uint32_t	addr, mask, h;
+
+	addr= ntohl(node->s_addr);
 
-	for(i=0; i < nodes->n; i++){
-		if( nodes->node[i].s_addr == node->s_addr)
+	if(nodes->bitmap != NULL && (addr - nodes->base) < nodes->nbitmap)
+		return( (nodes->bitmap[(addr - nodes->base) >> 5] & (1U << ((addr - nodes->base) & 31)))?TRUE:FALSE);
+
+	if(addr == 0)
+		return(nodes->zero_f);
+
+	mask= (1U << nodes->bits) - 1;
+
+	for(h= NODES_HASH(addr, nodes->bits); nodes->set[h] != 0; h= (h + 1) & mask){
+		if(nodes->set[h] == addr)
 			return TRUE;
 	}
 
@@ -1201,4 +2977,3 @@ unsigned int is_in_local_nodes(struct nodes *nodes, struct in_addr *node){
 
 
 
-
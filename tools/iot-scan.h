@@ -82,12 +82,67 @@ union my6_addr{
 #define SCAN_IP_CAMERAS		0x00000002
 #define SCAN_ALL			(SCAN_SMART_PLUGS | SCAN_IP_CAMERAS)
 
+/* Pacing of unicast sweeps of the destination prefix */
+#define DEFAULT_PROBE_RATE		1000	/* Packets per second */
+#define DEFAULT_MAX_INFLIGHT	8192
+
+/* Time (in nanoseconds) to wait before retrying when the socket buffer is full */
+#define PACE_RETRY_INTERVAL		(1 * NSEC_PER_MSEC)
+
+/* Resolution (in nanoseconds) of the timing wheel that tracks the probes in flight */
+#define WHEEL_TICK				(1 * NSEC_PER_MSEC)
+#define PROBE_NONE				0xffffffff
+
+/*
+   Responses to unicast sweeps can be decrypted and parsed by several receiver threads (-R), each
+   with its own raw socket. Answered probes are reported to the event loop in batches.
+ */
+#define MAX_RECEIVERS			64
+#define ANSWER_BATCH			256
+
+/* Maximum length of the description of a node that has responded */
+#define REPORT_LENGTH			512
+
+/*
+   Nodes that have responded are printed by a writer thread, fed through a ring of output records,
+   such that a slow consumer of the output does not stall the reception of responses
+ */
+#define OUTPUT_RING_SIZE		4096
+#define OUTPUT_RECORD_LENGTH	(INET_ADDRSTRLEN + REPORT_LENGTH + 4)
+#define OUTPUT_IDLE_INTERVAL	(1 * NSEC_PER_MSEC)
+
+/*
+   Probes of unicast sweeps are sent from a UDP source port that encodes a keyed hash of the target
+   address (a "cookie"). The ports are taken from the IANA dynamic port range.
+ */
+#define COOKIE_PORT_BASE		49152
+#define COOKIE_PORT_RANGE		16384
+
+/*
+   Nodes that have already responded are recorded in a bitmap when the scanned prefix is a /16 or
+   smaller, and in a hash set (with an initial size of 2^NODES_MIN_BITS slots) otherwise
+ */
+#define NODES_BITMAP_MIN_PREFLEN	16
+#define NODES_MIN_BITS				8
+#define NODES_HASH(addr, bits)		((uint32_t) ((addr) * 0x9e3779b1U) >> (32 - (bits)))
+
 
 #define						GENIUS_IP_CAMERA_SERVICE_PORT	32761
 #define						GENIUS_IP_CAMERA_SENDING_PORT	16353
 
 
 char 					TP_LINK_SMART_DISCOVER[]="{\"system\":{\"get_sysinfo\":null},\"emeter\":{\"get_realtime\":null}}";
+
+/* Members of the response to get_sysinfo that are reported, resolved with json_get_paths() */
+#define SYSINFO				0
+#define SYSINFO_TYPE		1
+#define SYSINFO_MODEL		2
+#define SYSINFO_DEV_NAME	3
+#define SYSINFO_ALIAS		4
+#define NUM_SYSINFO_PATHS	5
+
+char					*sysinfo_paths[NUM_SYSINFO_PATHS]= {"system.get_sysinfo", "system.get_sysinfo.type", "system.get_sysinfo.model", \
+						                                    "system.get_sysinfo.dev_name", "system.get_sysinfo.alias"};
 char 					TP_LINK_IP_CAMERA_DISCOVER[]={0x02, 0x03, 0x01, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x17, 0x00, \
 						                               0x07, 0xd8, 0xa1, 0x4f, 0xc2, 0x90, 0x98, 0x93, 0xec, 0x5b, 0x80, 0x5e, \
 						                               0xfa, 0xe2, 0x06, 0xd5, 0x63, 0x86, 0xb6, 0xdc, 0x3c, 0x8a, 0xff, 0x48, \
@@ -98,6 +153,11 @@ char					TP_LINK_IP_CAMERA_RESPONSE[]= {0x02, 0x03, 0x02, 0x03, 0x00, 0x00, 0x00
 						                               0x17, 0x00, 0x72, 0xa9, 0xa2, 0x32, 0xad, 0xd8, 0x65, 0xae, \
 						                               0x78, 0x40, 0xad, 0x62, 0x08, 0xf9, 0x34, 0x16};
 
+/* Bytes of the response that identify TP-Link IP cameras (the packet length and ID, and the digest, vary) */
+unsigned char			TP_LINK_IP_CAMERA_RESPONSE_MASK[]= {0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+						                                    0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+						                                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
 
 
 char 					GENIUS_IP_CAMERA_DISCOVER[]={0x6e, 0x4c, 0x9d, 0x8c, 0x40, 0xd1, 0x40, 0xda, 0x2d, 0x2d, 0x68, 0x2c, \
@@ -113,6 +173,9 @@ char 					GENIUS_IP_CAMERA_RESPONSE[]={0x4e, 0x4f, 0x8d, 0xac, 0x40, 0xd0, 0x40,
 						                             0x12, 0xd0, 0x40, 0xca, 0x28, 0x26, 0x0d, 0x29, 0x66, 0xae, 0xf1, 0xd8, \
 						                             0x61, 0x72, 0x43, 0x68};
 
+/* Responses end with the same trailer as the probe */
+#define					GENIUS_IP_CAMERA_TRAILER_LEN	4
+
 
 
 #define					EDIMAX_SMART_PLUG_SERVICE_PORT	20560
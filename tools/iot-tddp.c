@@ -60,7 +60,15 @@
 
 /* #define DEBUG */
 
+/* Request sent by the TDDP session, and the key for decrypting responses */
+struct tddp_request{
+	struct sockaddr_in		sockaddr_to;
+	DES_key_schedule		*key;
+};
+
 /* Function prototypes */
+void				send_tddp_request(struct udp_session *, int);
+unsigned int		receive_tddp_response(struct udp_session *, int);
 void				init_packet_data(struct iface_data *);
 void				free_host_entries(struct host_list *);
 int					host_scan_local(pcap_t *, struct iface_data *, struct in6_addr *, unsigned char, \
@@ -141,12 +149,12 @@ int main(int argc, char **argv){
 	int						r;
 	struct addrinfo			hints, *res, *aiptr;
 	struct target_ipv6		target;
-	struct timeval			timeout;
 	void					*voidptr;
 	const int				on=1;
-	struct sockaddr_in		sockaddr_in, sockaddr_from, sockaddr_to;
-	socklen_t				sockaddrfrom_len;
+	struct sockaddr_in		sockaddr_in, sockaddr_to;
 	struct	tddp_hdr		*tddp_hdr;
+	struct udp_session		session;
+	struct tddp_request		request;
 	unsigned int			npayload=0;
 
 	char				username_admin[]="admin";
@@ -495,9 +503,6 @@ tddp_reply = "00"
 		}
 		sockaddr_to.sin_addr= idata.dstaddr;		
 
-		memset(&sockaddr_from, 0, sizeof(sockaddr_from));
-		sockaddr_from.sin_family= AF_INET;
-		sockaddrfrom_len=sizeof(sockaddr_from);
 		tddp_hdr= (struct tddp_hdr *) sendbuff;
 		memset(tddp_hdr, 0, sizeof(struct tddp_hdr));
 
@@ -551,168 +556,90 @@ tddp_reply = "00"
 		}
 
 
-		FD_ZERO(&srset);
-		FD_ZERO(&swset);
-		FD_ZERO(&seset);
-
-		FD_SET(idata.fd, &swset);
-		FD_SET(idata.fd, &srset);
-		FD_SET(idata.fd2, &srset);
-		FD_SET(idata.fd, &seset);
-		FD_SET(idata.fd2, &seset);
-
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
-		idata.pending_write_f=TRUE;	
-
-		/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-		   That is, we give responses enough time to come back
-		 */
-		while(!end_f){
-			rset= srset;
-			wset= swset;
-			eset= seset;
-
-			if(!donesending_f){
-				/* This is the retransmission timer */
-				timeout.tv_sec= 1;
-				timeout.tv_usec= 0;
-			}
-			else{
-				/* XXX: This should use the parameter from command line */
-				timeout.tv_sec= idata.local_timeout;
-				timeout.tv_usec=0;
-			}
+		request.sockaddr_to= sockaddr_to;
+		request.key= &key;
 
-			/*
-				Check for readability and exceptions. We only check for writeability if there is pending data
-				to send.
-			 */
-			if((sel=select(idata.fd2+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-				if(errno == EINTR){
-					continue;
-				}
-				else{
-					perror("iot-tddp:");
-					exit(EXIT_FAILURE);
-				}
-			}
+		/* Responses may arrive on the socket the request is sent from, or on the TDDP receive port */
+		if(!udp_session_init(&session, idata.fd, idata.local_retrans, RETRANS_INTERVAL, idata.local_timeout * NSEC_PER_SEC, \
+								QUIESCENCE_THRESHOLD, send_tddp_request, receive_tddp_response, &request) || \
+			!udp_session_add(&session, idata.fd2)){
+			puts("Error initializing event loop");
+			exit(EXIT_FAILURE);
+		}
 
-			if(gettimeofday(&curtime, NULL) == -1){
+		if(!udp_session_run(&session)){
+			if(session.error_f){
 				if(idata.verbose_f)
-					perror("iot-tddp");
-
-				exit(EXIT_FAILURE);
-			}
-
-			/* Check whether we have finished probing all targets */
-			if(donesending_f){
-				/*
-				   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-				*/
-
-				if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-					end_f=TRUE;
-				}
-			}
-
-
-			if(sel && FD_ISSET(idata.fd2, &rset)){
-				/* XXX: Process response packet */
-
-				if( (nreadbuff = recvfrom(idata.fd2, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-					perror("iot-tddp: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-					perror("iot-tddp: ");
-					exit(EXIT_FAILURE);
-				}
-
-				printf("Read %u bytes from %s\n", (unsigned int)nreadbuff, pv4addr);
-				print_tddp_packet(readbuff, nreadbuff);
+					puts("iot-tddp: Found exception on descriptor");
 			}
+			else
+				perror("iot-tddp");
 
-			if(sel && FD_ISSET(idata.fd, &rset)){
-				/* XXX: Process response packet */
-
-				if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-					perror("iot-tddp: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-					perror("iot-tddp: ");
-					exit(EXIT_FAILURE);
-				}
-
-				/* There's data to be desencrypted */
-				if(nreadbuff> sizeof(struct tddp_hdr)){
-					for(i=0; i< ((nreadbuff-sizeof(struct tddp_hdr))/8); i++){
-					    DES_ecb_encrypt( (DES_cblock *)(readbuff+ sizeof(struct tddp_hdr) + i * 8), \
-						(DES_cblock *)(readbuff+ sizeof(struct tddp_hdr) + i * 8), &key, 0);
-					}
-				}
-
-				printf("Read %u bytes from %s\n", (unsigned int)nreadbuff, pv4addr);
-				print_tddp_packet(readbuff, nreadbuff);
-			}
+			exit(EXIT_FAILURE);
+		}
+	}	
 
+	exit(EXIT_SUCCESS);
+}
 
-			if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, 1 * 1000000)){
-				idata.pending_write_f=TRUE;
-				continue;
-			}
 
-			if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-				idata.pending_write_f=FALSE;
 
-				/* XXX: SEND PROBE PACKET */
 
-				if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-					perror("iot-tddp: ");
-					exit(EXIT_FAILURE);
-				}
 
+/*
+ * Function: send_tddp_request()
+ *
+ * Sends the TDDP request of the session
+ */
 
-				if(gettimeofday(&lastprobe, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-tddp");
+void send_tddp_request(struct udp_session *session, int fd){
+	struct tddp_request		*request= session->arg;
 
-					exit(EXIT_FAILURE);
-				}
+	if( sendto(fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &(request->sockaddr_to), sizeof(request->sockaddr_to)) == -1){
+		perror("iot-tddp: ");
+		exit(EXIT_FAILURE);
+	}
+}
 
-				retrans++;
 
-				if(retrans >= idata.local_retrans)
-					donesending_f= 1;
+/*
+ * Function: receive_tddp_response()
+ *
+ * Reads and prints a TDDP response. Responses received on the socket employed for sending
+ * requests carry an encrypted payload, while those received on the TDDP receive port do not
+ */
 
-			}
+unsigned int receive_tddp_response(struct udp_session *session, int fd){
+	struct tddp_request		*request= session->arg;
+	struct sockaddr_in		sockaddr_from;
+	socklen_t				sockaddrfrom_len;
 
+	sockaddrfrom_len=sizeof(sockaddr_from);
 
-			if(FD_ISSET(idata.fd, &eset)){
-				if(idata.verbose_f)
-					puts("iot-tddp: Found exception on descriptor");
+	if( (nreadbuff = recvfrom(fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
+		perror("iot-tddp: ");
+		exit(EXIT_FAILURE);
+	}
 
-				exit(EXIT_FAILURE);
-			}
-			if(FD_ISSET(idata.fd2, &eset)){
-				if(idata.verbose_f)
-					puts("iot-tddp: Found exception on descriptor");
+	if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
+		perror("iot-tddp: ");
+		exit(EXIT_FAILURE);
+	}
 
-				exit(EXIT_FAILURE);
-			}
+	/* There's data to be desencrypted */
+	if(fd == session->fd && nreadbuff> sizeof(struct tddp_hdr)){
+		for(i=0; i< ((nreadbuff-sizeof(struct tddp_hdr))/8); i++){
+		    DES_ecb_encrypt( (DES_cblock *)(readbuff+ sizeof(struct tddp_hdr) + i * 8), \
+			(DES_cblock *)(readbuff+ sizeof(struct tddp_hdr) + i * 8), request->key, 0);
 		}
+	}
 
-	}	
-
-	exit(EXIT_SUCCESS);
+	printf("Read %u bytes from %s\n", (unsigned int)nreadbuff, pv4addr);
+	print_tddp_packet(readbuff, nreadbuff);
+	return(1);
 }
 
 
-
-
 /*
  * Function: match_strings()
  *
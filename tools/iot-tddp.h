@@ -5,6 +5,9 @@
 
 #define BUFFER_SIZE		65556
 
+/* Interval (in nanoseconds) between retransmissions of a request */
+#define RETRANS_INTERVAL	(1 * NSEC_PER_SEC)
+
 /* Constants used with the multi_scan_local() function */
 #define	PROBE_ICMP6_ECHO	1
 #define PROBE_UNREC_OPT		2
@@ -40,6 +40,7 @@
 #include <pcap.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <time.h>
 #include <getopt.h>
@@ -55,7 +56,42 @@
 #include "libiot.h"
 
 
+/* Request sent by a UDP session (see run_udp_session()), and the function that processes its responses */
+struct udp_request{
+	struct sockaddr_in		sockaddr_to;
+	void					(*process)(char *, size_t, struct sockaddr_in *);
+};
+
+/*
+   Framed response being read from a TCP connection. The reads of all connections are driven by one
+   event loop (see read_tcp_response()), and each response is decrypted and parsed as it arrives
+ */
+struct tcp_mux{
+	struct reactor			reactor;
+	struct reactor_timer	idle_timer;	/* Fires when no connection has made progress for a while */
+	unsigned int			npending;	/* Connections whose responses are not complete yet */
+	unsigned char			timeout_f;
+};
+
+struct tcp_response{
+	struct tcp_mux			*mux;
+	struct tp_link_stream	ts;
+	struct json_stream		js;
+	unsigned char			malformed_f;
+	unsigned char			closed_f;	/* The connection was closed before the response was complete */
+};
+
 /* Function prototypes */
+void				run_udp_session(struct sockaddr_in *, void (*)(char *, size_t, struct sockaddr_in *));
+void				send_udp_request(struct udp_session *, int);
+unsigned int		receive_udp_responses(struct udp_session *, int);
+void				print_sysinfo_response(char *, size_t, struct sockaddr_in *);
+void				print_command_response(char *, size_t, struct sockaddr_in *);
+void				print_json_response(char *, size_t, struct sockaddr_in *);
+void				read_tcp_response(int, struct sockaddr_in *);
+void				tcp_response_io(struct reactor *, int, unsigned int, void *);
+void				tcp_response_timeout(struct reactor *, void *);
+void				print_json_field(struct json_stream *, char *, char *, size_t, unsigned int);
 void				free_host_entries(struct host_list *);
 int					host_scan_local(pcap_t *, struct iface_data *, struct in6_addr *, unsigned char, \
 									struct host_entry *);
@@ -78,6 +114,8 @@ struct bpf_program		pcap_filter;
 char 					dev[64], errbuf[PCAP_ERRBUF_SIZE];
 unsigned char			buffer[BUFFER_SIZE], buffrh[MIN_IPV6_HLEN + MIN_TCP_HLEN];
 char			readbuff[BUFFER_SIZE], sendbuff[BUFFER_SIZE];
+struct batch			txbatch;
+struct pktpool			rxpool;
 ssize_t					nreadbuff, nsendbuff;
 char					line[LINE_BUFFER_SIZE];
 
@@ -119,10 +157,14 @@ char					*charstart, *charend, *lastcolon;
 unsigned int			nsleep;
 int						sel;
 fd_set					sset, rset, wset, eset;
-struct timeval			curtime, pcurtime, lastprobe, starttime;
+struct timeval			pcurtime;
+uint64_t				curtime, lastprobe, starttime;
 struct tm				pcurtimetm;
 unsigned int			retrans=0;
 
+/* UDP sessions end early once further responses become unlikely (-O is the upper bound) */
+double					quiet_threshold= QUIESCENCE_THRESHOLD;
+
 char *command, *arg1, *arg2;
 
 
@@ -137,9 +179,7 @@ int main(int argc, char **argv){
 	const int				on=1;
 	struct sockaddr_in		sockaddr_in, sockaddr_from, sockaddr_to;
 	socklen_t				sockaddrfrom_len;
-	struct json				*json1, *json2, *json3;
-	struct json_value		json_value;
-	char					*json, *command, *alias, *dev_name, *type, *model;
+	char					*json, *command;
 	struct pseudohdr 		*pseudohdr;
 	struct udp_hdr 			*udp_hdr;
 	struct ip_hdr			*ip_hdr;
@@ -161,12 +201,13 @@ int main(int argc, char **argv){
 		{"retrans", required_argument, 0, 'x'},
 		{"scan", no_argument, 0, 'Z'},
 		{"timeout", required_argument, 0, 'O'},
+		{"quiescence", required_argument, 0, 'q'},
 		{"verbose", no_argument, 0, 'v'},
 		{"help", no_argument, 0, 'h'},
 		{0, 0, 0,  0 }
 	};
 
-	char shortopts[]= "i:c:j:P:p:T:o:a:s:d:Lx:O:Zvh";
+	char shortopts[]= "i:c:j:P:p:T:o:a:s:d:Lx:O:q:Zvh";
 
 	char option;
 
@@ -531,6 +572,16 @@ int main(int argc, char **argv){
 				idata.local_timeout=atoi(optarg);
 				break;
 
+			case 'q':	/* Probability of further responses below which we stop waiting */
+				quiet_threshold= strtod(optarg, NULL);
+
+				if(quiet_threshold <= 0 || quiet_threshold >= 1){
+					puts("The quiescence threshold must be greater than 0 and less than 1");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
 			case 'Z':	/* scan */
 				scan_f= TRUE;
 				break;
@@ -675,156 +726,11 @@ XXX This should later allow to just specify local scan and automatically choose
 		}
 
 
-		FD_ZERO(&sset);
-		FD_SET(idata.fd, &sset);
-
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
-		idata.pending_write_f=TRUE;	
-
-		/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-		   That is, we give responses enough time to come back
-		 */
-		while(!end_f){
-			rset= sset;
-			wset= sset;
-			eset= sset;
-
-			if(!donesending_f){
-				/* This is the retransmission timer */
-				timeout.tv_sec= 1;
-				timeout.tv_usec= 0;
-			}
-			else{
-				/* XXX: This should use the parameter from command line */
-				timeout.tv_sec= idata.local_timeout;
-				timeout.tv_usec=0;
-			}
-
-			/*
-				Check for readability and exceptions. We only check for writeability if there is pending data
-				to send.
-			 */
-			if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-				if(errno == EINTR){
-					continue;
-				}
-				else{
-					perror("iot-tl-plug:");
-					exit(EXIT_FAILURE);
-				}
-			}
-
-			if(gettimeofday(&curtime, NULL) == -1){
-				if(idata.verbose_f)
-					perror("iot-tl-plug");
-
-				exit(EXIT_FAILURE);
-			}
-
-			/* Check whether we have finished probing all targets */
-			if(donesending_f){
-				/*
-				   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-				*/
-
-				if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-					end_f=TRUE;
-				}
-			}
-
-
-			if(sel && FD_ISSET(idata.fd, &rset)){
-				/* XXX: Process response packet */
-
-				if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-/*				printf("Got response from: %s, port %u\n", pv4addr, ntohs(sockaddr_from.sin_port));*/
-				tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
-
-				alias=NULL;
-				dev_name=NULL;
-				type=NULL;
-				model=NULL;
-
-				/* Get to system:get_sysinfo */
-				if( (json1=json_get_objects(readbuff, (nreadbuff))) != NULL){
-					if( json_get_value(json1, &json_value, "\"system\"")){
-						if( (json2=json_get_objects(json_value.value, json_value.len)) != NULL){
-							if( json_get_value(json2, &json_value, "\"get_sysinfo\"")){
-								if( (json3=json_get_objects(json_value.value, json_value.len)) != NULL){
-									json_remove_quotes(json3);
-									if( json_get_value(json3, &json_value, "type")){
-										type=json_value.value;
-									}
-									if( json_get_value(json3, &json_value, "model")){
-										model=json_value.value;
-									}
-									if( json_get_value(json3, &json_value, "dev_name")){
-										dev_name=json_value.value;
-									}
-									if( json_get_value(json3, &json_value, "alias")){
-										alias=json_value.value;
-									}	
-
-									printf("%s: \"%s\" (\"%s\": %s %s)\n", pv4addr, alias, dev_name, type, model);
-			
-								}
-							}
-						}
-					}
-				}
-			}
-
-
-			if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, 1 * 1000000)){
-				idata.pending_write_f=TRUE;
-				continue;
-			}
-
-			if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-				idata.pending_write_f=FALSE;
-
-				/* XXX: SEND PROBE PACKET */
-				nsendbuff= Strnlen(TP_LINK_SMART_DISCOVER, MAX_TP_COMMAND_LENGTH);
-				memcpy(sendbuff, TP_LINK_SMART_DISCOVER, nsendbuff);
-
-				if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(gettimeofday(&lastprobe, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-tl-plug");
-
-					exit(EXIT_FAILURE);
-				}
-
-				retrans++;
-
-				if(retrans >= idata.local_retrans)
-					donesending_f= 1;
-
-			}
-
-
-			if(FD_ISSET(idata.fd, &eset)){
-				if(idata.verbose_f)
-					puts("iot-tl-plug: Found exception on descriptor");
-
-				exit(EXIT_FAILURE);
-			}
-		}
+		/* The discovery request is sent unencrypted */
+		nsendbuff= Strnlen(TP_LINK_SMART_DISCOVER, MAX_TP_COMMAND_LENGTH);
+		memcpy(sendbuff, TP_LINK_SMART_DISCOVER, nsendbuff);
 
+		run_udp_session(&sockaddr_to, print_sysinfo_response);
 		exit(EXIT_SUCCESS);
 	}
 	else if(command_f && proto_f && proto == IPPROTO_TCP){
@@ -985,30 +891,7 @@ XXX This should later allow to just specify local scan and automatically choose
 		}while(i<nsendbuff);
 		
 
-		nreadbuff=0;
-		while( nreadbuff < 4 && (nbytes=read(idata.fd, (readbuff+nreadbuff), 4-nreadbuff) ) > 0){
-			nreadbuff= nreadbuff+nbytes;
-		}
-
-		datalen= ntohl(*((uint32_t *)readbuff));
-		if(datalen >= sizeof(readbuff)){
-			puts("Response is too large");
-			exit(EXIT_FAILURE);
-		}	
-
-		nreadbuff=0;
-		while( (nreadbuff< datalen) && (nbytes=read(idata.fd, (readbuff+nreadbuff), datalen-nreadbuff) ) > 0){
-			nreadbuff= nreadbuff+nbytes;
-		}
-
-		if(nbytes < 0){
-			perror("iot-tl-plug:");
-			exit(EXIT_FAILURE);
-		}
-
-		readbuff[nreadbuff]= 0x00;
-
-		tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
+		read_tcp_response(idata.fd, &sockaddr_to);
 		exit(EXIT_SUCCESS);
 	}
 	else if(command_f){
@@ -1165,126 +1048,7 @@ XXX This should later allow to just specify local scan and automatically choose
 		}
 
 
-		FD_ZERO(&sset);
-		FD_SET(idata.fd, &sset);
-
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
-		idata.pending_write_f=TRUE;	
-
-		/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-		   That is, we give responses enough time to come back
-		 */
-		while(!end_f){
-			rset= sset;
-			wset= sset;
-			eset= sset;
-
-			if(!donesending_f){
-				/* This is the retransmission timer */
-				timeout.tv_sec= 1;
-				timeout.tv_usec= 0;
-			}
-			else{
-				/* XXX: This should use the parameter from command line */
-				timeout.tv_sec= idata.local_timeout;
-				timeout.tv_usec=0;
-			}
-
-			/*
-				Check for readability and exceptions. We only check for writeability if there is pending data
-				to send.
-			 */
-			if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-				if(errno == EINTR){
-					continue;
-				}
-				else{
-					perror("iot-tl-plug:");
-					exit(EXIT_FAILURE);
-				}
-			}
-
-			if(gettimeofday(&curtime, NULL) == -1){
-				if(idata.verbose_f)
-					perror("iot-tl-plug");
-
-				exit(EXIT_FAILURE);
-			}
-
-			/* Check whether we have finished probing all targets */
-			if(donesending_f){
-				/*
-				   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-				*/
-
-				if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-					end_f=TRUE;
-				}
-			}
-
-
-			if(sel && FD_ISSET(idata.fd, &rset)){
-				/* XXX: Process response packet */
-
-				if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(nreadbuff>= (sizeof(readbuff)-1)){
-					/* XXX: SHould never happen, but let's play safe */
-					puts("Response is too large");
-					continue;
-				}
-
-				readbuff[nreadbuff]= 0x00; /* Null-terminate what we read, so that we can printf() it */
-
-				if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
-				printf("Got response from: %s, port %u\n%s\n\n", pv4addr, ntohs(sockaddr_from.sin_port), readbuff);
-			}
-
-			if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, 1 * 1000000)){
-				idata.pending_write_f=TRUE;
-				continue;
-			}
-
-			if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-				idata.pending_write_f=FALSE;
-
-				if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(gettimeofday(&lastprobe, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-tl-plug");
-
-					exit(EXIT_FAILURE);
-				}
-
-				retrans++;
-
-				if(retrans >= idata.local_retrans)
-					donesending_f= 1;
-
-			}
-
-
-			if(FD_ISSET(idata.fd, &eset)){
-				if(idata.verbose_f)
-					puts("iot-tl-plug: Found exception on libpcap descriptor");
-
-				exit(EXIT_FAILURE);
-			}
-		}
-
+		run_udp_session(&sockaddr_to, print_command_response);
 		exit(EXIT_SUCCESS);
 	}
 
@@ -1368,30 +1132,7 @@ XXX This should later allow to just specify local scan and automatically choose
 		}while(i<nsendbuff);
 		
 
-		nreadbuff=0;
-		while( nreadbuff < 4 && (nbytes=read(idata.fd, (readbuff+nreadbuff), 4-nreadbuff) ) > 0){
-			nreadbuff= nreadbuff+nbytes;
-		}
-
-		datalen= ntohl(*((uint32_t *)readbuff));
-		if(datalen >= sizeof(readbuff)){
-			puts("Response is too large");
-			exit(EXIT_FAILURE);
-		}	
-
-		nreadbuff=0;
-		while( (nreadbuff< datalen) && (nbytes=read(idata.fd, (readbuff+nreadbuff), datalen-nreadbuff) ) > 0){
-			nreadbuff= nreadbuff+nbytes;
-		}
-
-		if(nbytes < 0){
-			perror("iot-tl-plug:");
-			exit(EXIT_FAILURE);
-		}
-
-		readbuff[nreadbuff]= 0x00;
-
-		tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
+		read_tcp_response(idata.fd, &sockaddr_to);
 		exit(EXIT_SUCCESS);
 	}
 	else if(json_f){
@@ -1472,133 +1213,13 @@ XXX This should later allow to just specify local scan and automatically choose
 		}
 
 
-		FD_ZERO(&sset);
-		FD_SET(idata.fd, &sset);
+		nsendbuff= Strnlen(json, MAX_TP_COMMAND_LENGTH);
+		memcpy(sendbuff, json, nsendbuff);
+		tp_link_crypt((unsigned char *)sendbuff, nsendbuff);
 
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
-		idata.pending_write_f=TRUE;	
-
-		/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
-		   That is, we give responses enough time to come back
-		 */
-		while(!end_f){
-			rset= sset;
-			wset= sset;
-			eset= sset;
-
-			if(!donesending_f){
-				/* This is the retransmission timer */
-				timeout.tv_sec= 1;
-				timeout.tv_usec= 0;
-			}
-			else{
-				/* XXX: This should use the parameter from command line */
-				timeout.tv_sec= idata.local_timeout;
-				timeout.tv_usec=0;
-			}
-
-			/*
-				Check for readability and exceptions. We only check for writeability if there is pending data
-				to send.
-			 */
-			if((sel=select(idata.fd+1, &rset, (idata.pending_write_f?&wset:NULL), &eset, &timeout)) == -1){
-				if(errno == EINTR){
-					continue;
-				}
-				else{
-					perror("iot-tl-plug:");
-					exit(EXIT_FAILURE);
-				}
-			}
-
-			if(gettimeofday(&curtime, NULL) == -1){
-				if(idata.verbose_f)
-					perror("iot-tl-plug");
-
-				exit(EXIT_FAILURE);
-			}
-
-			/* Check whether we have finished probing all targets */
-			if(donesending_f){
-				/*
-				   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
-				*/
-
-				if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
-					end_f=TRUE;
-				}
-			}
-
-
-			if(sel && FD_ISSET(idata.fd, &rset)){
-				/* XXX: Process response packet */
-
-				if( (nreadbuff = recvfrom(idata.fd, readbuff, sizeof(readbuff), 0, (struct sockaddr *)&sockaddr_from, &sockaddrfrom_len)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(nreadbuff>= (sizeof(readbuff)-1)){
-					/* XXX: SHould never happen, but let's play safe */
-					puts("Response is too large");
-					continue;
-				}
-
-				readbuff[nreadbuff]= 0x00; /* Null-terminate what we read, so that we can printf() it */
-
-				if(inet_ntop(AF_INET, &(sockaddr_from.sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				tp_link_decrypt((unsigned char *)readbuff, nreadbuff);
-				printf("Got response from: %s\n%s\n\n", pv4addr, readbuff);
-			}
-
-			if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, 1 * 1000000)){
-				idata.pending_write_f=TRUE;
-				continue;
-			}
-
-			if(!donesending_f && idata.pending_write_f && FD_ISSET(idata.fd, &wset)){
-				idata.pending_write_f=FALSE;
-
-				/* XXX: SEND PROBE PACKET */
-				nsendbuff= Strnlen(json, MAX_TP_COMMAND_LENGTH);
-				memcpy(sendbuff, json, nsendbuff);
-				tp_link_crypt((unsigned char *)sendbuff, nsendbuff);
-
-				if( sendto(idata.fd, sendbuff, nsendbuff, 0, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1){
-					perror("iot-tl-plug: ");
-					exit(EXIT_FAILURE);
-				}
-
-				if(gettimeofday(&lastprobe, NULL) == -1){
-					if(idata.verbose_f)
-						perror("iot-tl-plug");
-
-					exit(EXIT_FAILURE);
-				}
-
-				retrans++;
-
-				if(retrans >= idata.local_retrans)
-					donesending_f= 1;
-
-			}
-
-
-			if(FD_ISSET(idata.fd, &eset)){
-				if(idata.verbose_f)
-					puts("iot-tl-plug: Found exception on libpcap descriptor");
-
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		exit(EXIT_SUCCESS);
-	}
+		run_udp_session(&sockaddr_to, print_json_response);
+		exit(EXIT_SUCCESS);
+	}
 
 	else if(dos_pingpong_f){
 		host_local.nhosts=0;
@@ -1640,11 +1261,10 @@ XXX This should later allow to just specify local scan and automatically choose
 		FD_ZERO(&sset);
 		FD_SET(idata.fd, &sset);
 
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
+		lastprobe= 0;
 
 		if(attack_length_f){
-			if(gettimeofday(&starttime, NULL) == -1){
+			if( (starttime= monotonic_nsec()) == 0){
 				if(idata.verbose_f)
 					perror("iot-tl-plug");
 
@@ -1679,7 +1299,7 @@ XXX This should later allow to just specify local scan and automatically choose
 				}
 			}
 
-			if(gettimeofday(&curtime, NULL) == -1){
+			if( (curtime= monotonic_nsec()) == 0){
 				if(idata.verbose_f)
 					perror("iot-tl-plug");
 
@@ -1687,12 +1307,12 @@ XXX This should later allow to just specify local scan and automatically choose
 			}
 
 
-			if(attack_length_f && is_time_elapsed(&curtime, &starttime, attack_length * 1000000)){
+			if(attack_length_f && is_time_elapsed_ns(curtime, starttime, attack_length * NSEC_PER_SEC)){
 				end_f=TRUE;
 			}
 
 
-			if(!idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, delay * 1000)){
+			if(!idata.pending_write_f && is_time_elapsed_ns(curtime, lastprobe, delay * NSEC_PER_MSEC)){
 				idata.pending_write_f=TRUE;
 				continue;
 			}
@@ -1748,7 +1368,7 @@ XXX This should later allow to just specify local scan and automatically choose
 						exit(EXIT_FAILURE);
 					}
 
-					if(gettimeofday(&lastprobe, NULL) == -1){
+					if( (lastprobe= monotonic_nsec()) == 0){
 						if(idata.verbose_f)
 							perror("iot-tl-plug");
 
@@ -1851,7 +1471,7 @@ XXX This should later allow to just specify local scan and automatically choose
 		FD_SET(idata.fd, &sset);
 
 		if(attack_length_f){
-			if(gettimeofday(&starttime, NULL) == -1){
+			if( (starttime= monotonic_nsec()) == 0){
 				if(idata.verbose_f)
 					perror("iot-tl-plug");
 
@@ -1859,8 +1479,7 @@ XXX This should later allow to just specify local scan and automatically choose
 			}
 		}
 
-		lastprobe.tv_sec= 0;	
-		lastprobe.tv_usec=0;
+		lastprobe= 0;
 		idata.pending_write_f=TRUE;	
 
 		/* The end_f flag is set after the last probe has been sent and a timeout period has elapsed.
@@ -1896,7 +1515,7 @@ XXX This should later allow to just specify local scan and automatically choose
 				}
 			}
 
-			if(gettimeofday(&curtime, NULL) == -1){
+			if( (curtime= monotonic_nsec()) == 0){
 				if(idata.verbose_f)
 					perror("iot-tl-plug");
 
@@ -1909,7 +1528,7 @@ XXX This should later allow to just specify local scan and automatically choose
 				   Just wait for SELECT_TIMEOUT seconds for any incoming responses.
 				*/
 
-				if(is_time_elapsed(&curtime, &lastprobe, idata.local_timeout * 1000000)){
+				if(is_time_elapsed_ns(curtime, lastprobe, idata.local_timeout * NSEC_PER_SEC)){
 					end_f=TRUE;
 				}
 			}
@@ -1940,7 +1559,7 @@ XXX This should later allow to just specify local scan and automatically choose
 				printf("%s:%s\n", pv4addr, readbuff);
 			}
 
-			if(!donesending_f && !idata.pending_write_f && is_time_elapsed(&curtime, &lastprobe, delay * 1000)){
+			if(!donesending_f && !idata.pending_write_f && is_time_elapsed_ns(curtime, lastprobe, delay * NSEC_PER_MSEC)){
 				idata.pending_write_f=TRUE;
 				continue;
 			}
@@ -1968,7 +1587,7 @@ XXX This should later allow to just specify local scan and automatically choose
 					exit(EXIT_FAILURE);
 				}
 
-				if(gettimeofday(&lastprobe, NULL) == -1){
+				if( (lastprobe= monotonic_nsec()) == 0){
 					if(idata.verbose_f)
 						perror("iot-tl-plug");
 
@@ -1976,7 +1595,7 @@ XXX This should later allow to just specify local scan and automatically choose
 				}
 
 
-				if(attack_length_f && is_time_elapsed(&curtime, &starttime, attack_length * 1000000)){
+				if(attack_length_f && is_time_elapsed_ns(curtime, starttime, attack_length * NSEC_PER_SEC)){
 					donesending_f=TRUE;
 				}
 
@@ -2002,6 +1621,326 @@ XXX This should later allow to just specify local scan and automatically choose
 
 
 
+
+/*
+ * Function: run_udp_session()
+ *
+ * Sends the request in sendbuff (retransmitting it as configured), and passes every response to
+ * the specified function until the response timeout expires
+ */
+
+void run_udp_session(struct sockaddr_in *sockaddr_to, void (*process)(char *, size_t, struct sockaddr_in *)){
+	struct udp_session	session;
+	struct udp_request	request;
+
+	request.sockaddr_to= *sockaddr_to;
+	request.process= process;
+
+	if(!create_pktpool(&rxpool, PKTPOOL_SIZE, BATCH_BUFFER_SIZE) || !create_batch(&txbatch, 1, BATCH_BUFFER_SIZE)){
+		puts("Not enough memory");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!udp_session_init(&session, idata.fd, idata.local_retrans, RETRANS_INTERVAL, idata.local_timeout * NSEC_PER_SEC, quiet_threshold, \
+							send_udp_request, receive_udp_responses, &request)){
+		puts("Error initializing event loop");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!udp_session_run(&session)){
+		if(session.error_f){
+			if(idata.verbose_f)
+				puts("iot-tl-plug: Found exception on descriptor");
+		}
+		else
+			perror("iot-tl-plug");
+
+		exit(EXIT_FAILURE);
+	}
+
+	destroy_pktpool(&rxpool);
+	destroy_batch(&txbatch);
+}
+
+
+/*
+ * Function: send_udp_request()
+ *
+ * Sends the request of a UDP session
+ */
+
+void send_udp_request(struct udp_session *session, int fd){
+	struct udp_request	*request= session->arg;
+
+	if(!batch_add(&txbatch, sendbuff, nsendbuff, &(request->sockaddr_to))){
+		puts("Internal buffer too short");
+		exit(EXIT_FAILURE);
+	}
+
+	while(txbatch.n){
+		if(send_batch(fd, &txbatch) == -1){
+			perror("iot-tl-plug: ");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+/*
+ * Function: receive_udp_responses()
+ *
+ * Drains the responses pending on the socket of a UDP session, with as few system calls as
+ * possible. Responses are decrypted and parsed in the buffers they were received into
+ */
+
+unsigned int receive_udp_responses(struct udp_session *session, int fd){
+	struct udp_request	*request= session->arg;
+	struct pktbuf		*pkts[PKTBUF_MAX_BATCH];
+	int					i, n;
+
+	if( (n=recv_pktbufs(fd, &rxpool, pkts, PKTBUF_MAX_BATCH)) == -1){
+		perror("iot-tl-plug: ");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i=0; i < n; i++){
+		request->process(PKTBUF_DATA(pkts[i]), pkts[i]->len, &(pkts[i]->addr));
+		pktbuf_unref(pkts[i]);
+	}
+
+	return(n);
+}
+
+
+/*
+ * Function: print_sysinfo_response()
+ *
+ * Prints a summary of a response to a get_sysinfo request
+ */
+
+void print_sysinfo_response(char *buff, size_t nbuff, struct sockaddr_in *from){
+	struct json_value	values[NUM_SYSINFO_PATHS];
+	unsigned int		i;
+
+	if(inet_ntop(AF_INET, &(from->sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
+		perror("iot-tl-plug: ");
+		exit(EXIT_FAILURE);
+	}
+
+	tp_link_decrypt((unsigned char *)buff, nbuff);
+
+	for(i=0; i < NUM_SYSINFO_PATHS; i++){
+		values[i].value= NULL_STRING;
+		values[i].len= 0;
+	}
+
+	values[SYSINFO].value= NULL;
+
+	/* All the members of system:get_sysinfo are obtained in a single pass */
+	if(json_get_paths(buff, nbuff, sysinfo_paths, values, NUM_SYSINFO_PATHS) > 0 && values[SYSINFO].value != NULL){
+		printf("%s: \"%.*s\" (\"%.*s\": %.*s %.*s)\n", pv4addr, (int) values[SYSINFO_ALIAS].len, values[SYSINFO_ALIAS].value, \
+				(int) values[SYSINFO_DEV_NAME].len, values[SYSINFO_DEV_NAME].value, (int) values[SYSINFO_TYPE].len, values[SYSINFO_TYPE].value, \
+				(int) values[SYSINFO_MODEL].len, values[SYSINFO_MODEL].value);
+	}
+}
+
+
+/*
+ * Function: print_command_response()
+ *
+ * Prints the (decrypted) response to a command, along with the port it came from
+ */
+
+void print_command_response(char *buff, size_t nbuff, struct sockaddr_in *from){
+	/* Packet buffers have room for NUL-terminating what we read, so that we can printf() it */
+	buff[nbuff]= 0x00;
+
+	if(inet_ntop(AF_INET, &(from->sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
+		perror("iot-tl-plug: ");
+		exit(EXIT_FAILURE);
+	}
+
+	tp_link_decrypt((unsigned char *)buff, nbuff);
+	printf("Got response from: %s, port %u\n%s\n\n", pv4addr, ntohs(from->sin_port), buff);
+}
+
+
+/*
+ * Function: print_json_response()
+ *
+ * Prints the (decrypted) response to a JSON request
+ */
+
+void print_json_response(char *buff, size_t nbuff, struct sockaddr_in *from){
+	/* Packet buffers have room for NUL-terminating what we read, so that we can printf() it */
+	buff[nbuff]= 0x00;
+
+	if(inet_ntop(AF_INET, &(from->sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
+		perror("iot-tl-plug: ");
+		exit(EXIT_FAILURE);
+	}
+
+	tp_link_decrypt((unsigned char *)buff, nbuff);
+	printf("Got response from: %s\n%s\n\n", pv4addr, buff);
+}
+
+
+/*
+ * Function: read_tcp_response()
+ *
+ * Reads a framed response from a TCP connection, decrypting and parsing each chunk as it arrives
+ * (such that the fields are printed as soon as they are complete, and the response can be of any size).
+ * The connection is read from the event loop of a multiplexer, which could drive many connections
+ */
+
+void read_tcp_response(int fd, struct sockaddr_in *from){
+	struct tcp_mux			mux;
+	struct tcp_response		resp;
+
+	if(inet_ntop(AF_INET, &(from->sin_addr), pv4addr, sizeof(pv4addr)) == NULL){
+		perror("iot-tl-plug: ");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Got response from: %s\n", pv4addr);
+
+	memset(&mux, 0, sizeof(mux));
+	memset(&resp, 0, sizeof(resp));
+	resp.mux= &mux;
+	tp_link_stream_init(&(resp.ts));
+	json_stream_init(&(resp.js), print_json_field, &resp);
+
+	/* Reads must never block the event loop */
+	if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1){
+		puts("Error while setting socket to non-blocking mode");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!reactor_init(&(mux.reactor)) || !reactor_add(&(mux.reactor), fd, REACTOR_READ, tcp_response_io, &resp)){
+		puts("Error while initializing the event loop");
+		exit(EXIT_FAILURE);
+	}
+
+	mux.npending++;
+	reactor_timer_init(&(mux.idle_timer), tcp_response_timeout, &mux);
+	reactor_timer_set(&(mux.reactor), &(mux.idle_timer), idata.local_timeout * NSEC_PER_SEC);
+
+	if(!reactor_run(&(mux.reactor))){
+		perror("iot-tl-plug:");
+		exit(EXIT_FAILURE);
+	}
+
+	reactor_destroy(&(mux.reactor));
+
+	if(resp.malformed_f){
+		puts("Malformed JSON response");
+		exit(EXIT_FAILURE);
+	}
+	else if(resp.closed_f){
+		puts("Connection closed before the response was complete");
+		exit(EXIT_FAILURE);
+	}
+	else if(mux.timeout_f){
+		puts("Timeout while waiting for the response");
+		exit(EXIT_FAILURE);
+	}
+	else if(resp.js.state != JSON_STREAM_DONE){
+		puts("Incomplete JSON response");
+		exit(EXIT_FAILURE);
+	}
+
+	puts("");
+}
+
+
+/*
+ * Function: tcp_response_io()
+ *
+ * Event loop callback for a connection: processes whatever part of the response has arrived, and
+ * removes the connection from the multiplexer once the response is complete (or cannot be)
+ */
+
+void tcp_response_io(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct tcp_response		*resp= arg;
+	struct tcp_mux			*mux= resp->mux;
+	unsigned char			*body;
+	size_t					nbody;
+	ssize_t					nbytes;
+	unsigned int			done_f=FALSE;
+
+	while(!done_f){
+		if( (nbytes=read(fd, readbuff, sizeof(readbuff))) < 0){
+			if(errno == EINTR)
+				continue;
+			else if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			perror("iot-tl-plug:");
+			exit(EXIT_FAILURE);
+		}
+		else if(nbytes == 0){
+			resp->closed_f= TRUE;
+			break;
+		}
+
+		done_f= tp_link_stream_input(&(resp->ts), (unsigned char *)readbuff, nbytes, &body, &nbody);
+
+		if(json_stream_input(&(resp->js), (char *)body, nbody) == FAILURE){
+			resp->malformed_f= TRUE;
+			break;
+		}
+
+		/* A top-level primitive is only delimited by the end of the response */
+		if(done_f && resp->js.state == JSON_STREAM_PRIM)
+			json_stream_flush(&(resp->js), 0);
+	}
+
+	if(done_f || resp->closed_f || resp->malformed_f){
+		reactor_del(reactor, fd);
+
+		if(--(mux->npending) == 0){
+			reactor_timer_cancel(reactor, &(mux->idle_timer));
+			reactor_stop(reactor);
+		}
+	}
+	else{
+		/* Progress was made: wait for the rest of the responses */
+		reactor_timer_set(reactor, &(mux->idle_timer), idata.local_timeout * NSEC_PER_SEC);
+	}
+}
+
+
+/*
+ * Function: tcp_response_timeout()
+ *
+ * Event loop timer callback that gives up on the pending responses, when none has made progress
+ */
+
+void tcp_response_timeout(struct reactor *reactor, void *arg){
+	struct tcp_mux	*mux= arg;
+
+	mux->timeout_f= TRUE;
+	reactor_stop(reactor);
+}
+
+
+/*
+ * Function: print_json_field()
+ *
+ * Prints a field (or fragment of a field) of a response, as reported by json_stream_input()
+ */
+
+void print_json_field(struct json_stream *js, char *path, char *value, size_t nvalue, unsigned int flags){
+	if(!(flags & JSON_FIELD_CONT))
+		printf("%s: ", path);
+
+	fwrite(value, 1, nvalue, stdout);
+
+	if(!(flags & JSON_FIELD_MORE))
+		putchar('\n');
+}
+
+
 /*
  * Function: match_strings()
  *
@@ -2078,6 +2017,7 @@ void print_help(void){
 		 "  --scan, -Z                  Scan for TP-Link Smart PLugs\n"
 	     "  --retrans, -x               Number of retransmissions of each packet\n"
 	     "  --timeout, -O               Timeout in seconds (default: 1 second)\n"
+	     "  --quiescence, -q            Stop waiting once the probability of further responses is below this (default: 0.01)\n"
 	     "  --help, -h                  Print help for the iot-tl-plug tool\n"
 	     "  --verbose, -v               Be verbose\n"
 	     "\n"
@@ -5,6 +5,9 @@
 
 #define BUFFER_SIZE		65556
 
+/* Interval (in nanoseconds) between retransmissions of a request */
+#define RETRANS_INTERVAL	(1 * NSEC_PER_SEC)
+
 /* Constants used with the multi_scan_local() function */
 #define	PROBE_ICMP6_ECHO	1
 #define PROBE_UNREC_OPT		2
@@ -94,3 +97,13 @@ char TP_LINK_PING_PONG[]="{\"DoSme\":{\"err_code\":-1,\"err_msg\":\"module not s
 unsigned int	is_command_valid(char *);
 
 
+/* Members of the response to get_sysinfo that are reported, resolved with json_get_paths() */
+#define SYSINFO				0
+#define SYSINFO_TYPE		1
+#define SYSINFO_MODEL		2
+#define SYSINFO_DEV_NAME	3
+#define SYSINFO_ALIAS		4
+#define NUM_SYSINFO_PATHS	5
+
+char *sysinfo_paths[NUM_SYSINFO_PATHS]={"system.get_sysinfo", "system.get_sysinfo.type", "system.get_sysinfo.model", \
+				 "system.get_sysinfo.dev_name", "system.get_sysinfo.alias"};
@@ -25,10 +25,17 @@
  * Please send any bug reports to Fernando Gont <fgont@si6networks.com>
  */
 
+#ifdef __linux__
+	#define _GNU_SOURCE		/* For sendmmsg() and recvmmsg() */
+#endif
+
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -39,6 +46,8 @@
 #include <netdb.h>
 #include <ifaddrs.h>
 #ifdef __linux__
+	#include <sys/epoll.h>
+	#include <sys/timerfd.h>
 	#include <asm/types.h>
 	#include <linux/netlink.h>
 	#include <linux/rtnetlink.h>
@@ -48,6 +57,10 @@
 	#include <net/route.h>
 #endif
 
+#ifndef __linux__
+	#include <poll.h>
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -56,19 +69,28 @@
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <pcap.h>
 #include <setjmp.h>
 #include <pwd.h>
+#include <fcntl.h>
 
 #include "libiot.h"
 #include "iot-toolkit.h"
 
+#ifdef X86_SIMD
+	#include <immintrin.h>
+#endif
+
 
 /* pcap variables */
 char				errbuf[PCAP_ERRBUF_SIZE];
 struct bpf_program	pcap_filter;
 
+/* SIMD implementation selected with simd_select() (SIMD_AUTO: the best one supported by the CPU) */
+int					simd_selected= SIMD_AUTO;
+
 #ifdef __linux__
 /* Netlink requests */
 struct nlrequest{
@@ -495,6 +517,38 @@ void *find_v4addr(struct iface_list *iflist){
 }
 
 
+/*
+ * Function: find_v4addr_for_dst()
+ *
+ * Finds the IPv4 address the kernel would select as source for packets sent to "dst", by
+ * connecting a UDP socket (no packets are sent) and reading back its local address
+ */
+
+int find_v4addr_for_dst(struct in_addr *dst, struct in_addr *src){
+	struct sockaddr_in	sockaddr_to, sockaddr_from;
+	socklen_t			fromlen= sizeof(sockaddr_from);
+	int					fd;
+
+	if( (fd=socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return(FAILURE);
+
+	memset(&sockaddr_to, 0, sizeof(sockaddr_to));
+	sockaddr_to.sin_family= AF_INET;
+	sockaddr_to.sin_addr= *dst;
+	sockaddr_to.sin_port= htons(9);
+
+	if(connect(fd, (struct sockaddr *) &sockaddr_to, sizeof(sockaddr_to)) == -1 || \
+		getsockname(fd, (struct sockaddr *) &sockaddr_from, &fromlen) == -1 || sockaddr_from.sin_addr.s_addr == INADDR_ANY){
+		close(fd);
+		return(FAILURE);
+	}
+
+	close(fd);
+	*src= sockaddr_from.sin_addr;
+	return(SUCCESS);
+}
+
+
 
 /*
  * Function: Strnlen()
@@ -672,44 +726,301 @@ void release_privileges(void){
 
 
 /*
- * Function: tp_link_crypt()
+ * Function: simd_select()
+ *
+ * Selects the SIMD implementation employed by the TP-Link cipher and the JSON scanner (mostly for
+ * testing and benchmarking). Returns FAILURE if the CPU (or the platform) does not support it
+ */
+
+int simd_select(int level){
+	switch(level){
+		case SIMD_AUTO:
+		case SIMD_SCALAR:
+			break;
+
+#ifdef X86_SIMD
+		case SIMD_SSE2:
+			break;
+
+		case SIMD_AVX2:
+			if(!__builtin_cpu_supports("avx2"))
+				return(FAILURE);
+
+			break;
+#endif
+
+		default:
+			return(FAILURE);
+	}
+
+	simd_selected= level;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: simd_level()
+ *
+ * Returns the SIMD implementation to employ: the one selected with simd_select(), or the best one
+ * supported by the CPU
+ */
+
+int simd_level(void){
+	if(simd_selected != SIMD_AUTO)
+		return(simd_selected);
+
+#ifdef X86_SIMD
+	return(__builtin_cpu_supports("avx2")?SIMD_AVX2:SIMD_SSE2);
+#else
+	return(SIMD_SCALAR);
+#endif
+}
+
+
+/*
+ * Function: tp_link_decrypt()
  *
- * Releases memory allocated for holding IPv6 addresses and Ethernet addresses
+ * Decrypts a buffer encrypted with the TP-Link autokey cipher (in place). Each byte only depends on
+ * itself and on the previous ciphertext byte, and hence long buffers are decrypted with SIMD instructions
  */
 
 void tp_link_decrypt(unsigned char *p, size_t size){
-	unsigned char	key= 171, c;
-	unsigned int	i;
+	tp_link_decrypt_chunk(p, size, TP_LINK_KEY);
+}
+
+
+/*
+ * Function: tp_link_decrypt_chunk()
+ *
+ * Decrypts (in place) a chunk of a longer ciphertext, given the last ciphertext byte of the previous
+ * chunk (TP_LINK_KEY for the first one). Returns the key for the next chunk
+ */
+
+unsigned char tp_link_decrypt_chunk(unsigned char *p, size_t size, unsigned char key){
+	unsigned char	last, c;
+	size_t			i;
+
+	if(p == NULL || size == 0)
+		return(key);
+
+	last= p[size - 1];
 
-	if(p != NULL && size > 0){
-		for(i=0; i<size; i++){
-			c= key ^ p[i];
-			key= p[i];
-			p[i]= c;
+#ifdef X86_SIMD
+	/* The end of the buffer is decrypted with SIMD instructions, leaving the beginning */
+	if(size >= TP_LINK_SIMD_MIN){
+		switch(simd_level()){
+			case SIMD_AVX2:
+				size= tp_link_decrypt_avx2(p, size);
+				break;
+
+			case SIMD_SSE2:
+				size= tp_link_decrypt_sse2(p, size);
+				break;
 		}
 	}
+#endif
+
+	for(i=0; i<size; i++){
+		c= key ^ p[i];
+		key= p[i];
+		p[i]= c;
+	}
+
+	return(last);
+}
+
+
+/*
+ * Function: tp_link_stream_init()
+ *
+ * Initializes the state for decrypting a framed response
+ */
+
+void tp_link_stream_init(struct tp_link_stream *ts){
+	ts->key= TP_LINK_KEY;
+	ts->nheader= 0;
+	ts->length= 0;
+	ts->nbody= 0;
+}
+
+
+/*
+ * Function: tp_link_stream_input()
+ *
+ * Processes a chunk of a framed response as it arrives: the length header is consumed, and the part
+ * of the body within the chunk is decrypted in place and returned in "body". Returns TRUE once the
+ * whole body has been processed (any trailing bytes are ignored), or FALSE otherwise
+ */
+
+int tp_link_stream_input(struct tp_link_stream *ts, unsigned char *p, size_t len, unsigned char **body, size_t *nbody){
+	*body= p;
+	*nbody= 0;
+
+	while(ts->nheader < TP_LINK_FRAME_HLEN && len > 0){
+		ts->header[ts->nheader++]= *p++;
+		len--;
+
+		if(ts->nheader == TP_LINK_FRAME_HLEN)
+			ts->length= ((uint32_t) ts->header[0] << 24) | ((uint32_t) ts->header[1] << 16) | \
+						((uint32_t) ts->header[2] << 8) | ts->header[3];
+	}
+
+	if(ts->nheader < TP_LINK_FRAME_HLEN)
+		return(FALSE);
+
+	if(len > (ts->length - ts->nbody))
+		len= ts->length - ts->nbody;
+
+	ts->key= tp_link_decrypt_chunk(p, len, ts->key);
+	ts->nbody+= len;
+	*body= p;
+	*nbody= len;
+	return(ts->nbody == ts->length);
 }
 
 
 /*
  * Function: tp_link_crypt()
  *
- * Releases memory allocated for holding IPv6 addresses and Ethernet addresses
+ * Encrypts a buffer with the TP-Link autokey cipher (in place). Each ciphertext byte is the XOR of
+ * the key and all the plaintext bytes up to it, which is computed with SIMD instructions for long buffers
  */
 
 void tp_link_crypt(unsigned char *p, size_t size){
-	unsigned char	key= 171;
-	unsigned int	i;
+	unsigned char	key= TP_LINK_KEY;
+	size_t			i=0;
+
+	if(p == NULL || size == 0)
+		return;
+
+#ifdef X86_SIMD
+	/* The beginning of the buffer is encrypted with SIMD instructions, leaving the end */
+	if(size >= TP_LINK_SIMD_MIN){
+		switch(simd_level()){
+			case SIMD_AVX2:
+				i= tp_link_crypt_avx2(p, size);
+				break;
 
-	if(p != NULL && size > 0){
-		for(i=0; i<size; i++){
-			p[i]= p[i] ^ key;
-			key= p[i];
+			case SIMD_SSE2:
+				i= tp_link_crypt_sse2(p, size);
+				break;
 		}
+
+		if(i > 0)
+			key= p[i - 1];
+	}
+#endif
+
+	for(; i<size; i++){
+		p[i]= p[i] ^ key;
+		key= p[i];
+	}
+}
+
+
+#ifdef X86_SIMD
+/*
+ * Function: tp_link_decrypt_sse2()
+ *
+ * Decrypts blocks of 16 bytes at the end of a buffer, from the last one to the first one, such that
+ * the previous ciphertext byte of each block is still available. Returns the number of bytes left
+ * at the beginning of the buffer (for the scalar code)
+ */
+
+size_t tp_link_decrypt_sse2(unsigned char *p, size_t size){
+	__m128i		v, prev;
+
+	/* The first byte is decrypted with the key, rather than with a previous byte */
+	while(size > 16){
+		size-= 16;
+		v= _mm_loadu_si128((__m128i *) (p + size));
+		prev= _mm_loadu_si128((__m128i *) (p + size - 1));
+		_mm_storeu_si128((__m128i *) (p + size), _mm_xor_si128(v, prev));
+	}
+
+	return(size);
+}
+
+
+/*
+ * Function: tp_link_decrypt_avx2()
+ *
+ * Decrypts blocks of 32 bytes at the end of a buffer (see tp_link_decrypt_sse2())
+ */
+
+__attribute__((target("avx2"))) size_t tp_link_decrypt_avx2(unsigned char *p, size_t size){
+	__m256i		v, prev;
+
+	while(size > 32){
+		size-= 32;
+		v= _mm256_loadu_si256((__m256i *) (p + size));
+		prev= _mm256_loadu_si256((__m256i *) (p + size - 1));
+		_mm256_storeu_si256((__m256i *) (p + size), _mm256_xor_si256(v, prev));
+	}
+
+	return(size);
+}
+
+
+/*
+ * Function: tp_link_crypt_sse2()
+ *
+ * Encrypts the blocks of 16 bytes at the beginning of a buffer: the prefix XOR of each block is
+ * computed with four shift-and-XOR steps, and is then combined with the last ciphertext byte of the
+ * previous block. Returns the number of bytes encrypted
+ */
+
+size_t tp_link_crypt_sse2(unsigned char *p, size_t size){
+	__m128i			x;
+	unsigned char	key= TP_LINK_KEY;
+	size_t			i;
+
+	for(i=0; (size - i) >= 16; i+= 16){
+		x= _mm_loadu_si128((__m128i *) (p + i));
+		x= _mm_xor_si128(x, _mm_slli_si128(x, 1));
+		x= _mm_xor_si128(x, _mm_slli_si128(x, 2));
+		x= _mm_xor_si128(x, _mm_slli_si128(x, 4));
+		x= _mm_xor_si128(x, _mm_slli_si128(x, 8));
+		_mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(x, _mm_set1_epi8((char) key)));
+		key= p[i + 15];
 	}
+
+	return(i);
 }
 
 
+/*
+ * Function: tp_link_crypt_avx2()
+ *
+ * Encrypts the blocks of 32 bytes at the beginning of a buffer (see tp_link_crypt_sse2()). Shifts
+ * operate on each 128-bit lane, and hence the prefix of the low lane is then propagated to the high one
+ */
+
+__attribute__((target("avx2"))) size_t tp_link_crypt_avx2(unsigned char *p, size_t size){
+	__m256i			x, last;
+	unsigned char	key= TP_LINK_KEY;
+	size_t			i;
+
+	/* Selects the last byte of each lane */
+	last= _mm256_set1_epi8(15);
+
+	for(i=0; (size - i) >= 32; i+= 32){
+		x= _mm256_loadu_si256((__m256i *) (p + i));
+		x= _mm256_xor_si256(x, _mm256_slli_si256(x, 1));
+		x= _mm256_xor_si256(x, _mm256_slli_si256(x, 2));
+		x= _mm256_xor_si256(x, _mm256_slli_si256(x, 4));
+		x= _mm256_xor_si256(x, _mm256_slli_si256(x, 8));
+
+		/* The high lane is XORed with the last byte of the low lane (the low lane, with zero) */
+		x= _mm256_xor_si256(x, _mm256_shuffle_epi8(_mm256_permute2x128_si256(x, x, 0x08), last));
+		_mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(x, _mm256_set1_epi8((char) key)));
+		key= p[i + 31];
+	}
+
+	return(i);
+}
+#endif
+
 
 /*
  * Function: dump_hex()
@@ -763,513 +1074,3266 @@ int is_time_elapsed(struct timeval *curtime, struct timeval *lastprobe, unsigned
 }
 
 
-
-
 /*
- * Function: is_valid_json_string()
+ * Function: is_time_elapsed_ns()
  *
- * Performs some minimum sanity checks on JSON strings
+ * Checks whether "delta" nanoseconds have elapsed since "then" (both "now" and "then" are
+ * monotonic times, in nanoseconds)
  */
 
-int is_valid_json_string(char *s, unsigned int len){
-	unsigned int i;
-	int bracket_depth=0, curly_depth=0, quote_num=0, quoted_f=FALSE, openquote_f=FALSE;
+int is_time_elapsed_ns(uint64_t now, uint64_t then, uint64_t delta){
+	return(now >= then && (now - then) >= delta);
+}
 
-	return(TRUE);
 
-	if(s == NULL){
-/*puts("string nulo");*/
-		return(FALSE);
-	}
 
-	for(i=0; i< len; i++){
-		if(s[i] == 0x00){
-/*puts("Encontre 0x00");*/
-			return(FALSE);
-		}
+/*
+ * Function: tb_init()
+ *
+ * Initializes a token bucket with a specific rate (tokens per second) and depth (burst)
+ */
 
-		if(openquote_f){
-			switch(s[i]){
-				case '\\':
-					quoted_f= TRUE;
-					break;
+void tb_init(struct token_bucket *tb, unsigned long rate, unsigned long burst){
+	tb->rate= rate;
+	tb->burst= (burst > 0)?burst:1;
+	tb->tokens= tb->burst;
+	tb->last= 0;
+	tb->last_f= FALSE;
+}
 
-				case '"':
-					if(quoted_f){
-						quoted_f= FALSE;
-					}
-					else{
-						openquote_f= FALSE;
-						quote_num++;
-					}
-	
-					break;
 
-				default:
-					quoted_f= FALSE;
-					break;
-			}
-		}
-		else{
-			switch(s[i]){
-				case '\\':
-					quoted_f= TRUE;
-					break;
+/*
+ * Function: tb_refill()
+ *
+ * Adds the tokens accumulated since the last refill of a token bucket ("now" is the current
+ * monotonic time, in nanoseconds)
+ */
 
-				case '[':
-					bracket_depth++;
-					quoted_f= FALSE;
-					break;
+void tb_refill(struct token_bucket *tb, uint64_t now){
+	if(!tb->last_f){
+		tb->last= now;
+		tb->last_f= TRUE;
+		return;
+	}
 
-				case ']':
-					bracket_depth--;
-					quoted_f= FALSE;
+	/* Time went backwards: do not credit any tokens */
+	if(now < tb->last){
+		tb->last= now;
+		return;
+	}
 
-					if(bracket_depth < 0){
-/*puts("curly_depth < 0");*/
-						return(FALSE);
-					}
+	tb->tokens+= ((double) (now - tb->last) / NSEC_PER_SEC) * tb->rate;
 
-					break;
+	if(tb->tokens > tb->burst)
+		tb->tokens= tb->burst;
 
-				case '{':
-					curly_depth++;
-					quoted_f= FALSE;
-					break;
+	tb->last= now;
+}
 
-				case '}':
-					curly_depth--;
-					quoted_f= FALSE;
 
-					if(curly_depth < 0){
-/*puts("curly_depth < 0"); */
-						return(FALSE);
-					}
+/*
+ * Function: tb_consume()
+ *
+ * Takes one token from a token bucket. Returns TRUE if a token was available, and FALSE otherwise
+ */
 
-					break;
+unsigned int tb_consume(struct token_bucket *tb, uint64_t now){
+	if(tb->rate == 0)
+		return(TRUE);
 
-				case '"':
-					if(quoted_f){
-						quoted_f= FALSE;
-					}
-					else{
-						openquote_f= TRUE;
-						quote_num++;
-					}
-	
-					break;
+	tb_refill(tb, now);
 
-				default:
-					quoted_f= FALSE;
-					break;
-			}
-		}
+	if(tb->tokens < 1)
+		return(FALSE);
+
+	tb->tokens= tb->tokens - 1;
+	return(TRUE);
+}
 
-	}
 
 /*
-	if(quote_num % 2){
-puts("quote num no es par");
-	}
+ * Function: tb_wait_time()
+ *
+ * Returns the time (in nanoseconds) until a token will be available in a token bucket
+ */
 
-	if(curly_depth != 0){
-puts("curly_depth != 0");
-	}
+uint64_t tb_wait_time(struct token_bucket *tb, uint64_t now){
+	if(tb->rate == 0)
+		return(0);
 
-	if(bracket_depth != 0){
-puts("bracket_depth != 0");
-	}
-*/
+	tb_refill(tb, now);
 
-	if(quote_num % 2 || curly_depth != 0 || bracket_depth != 0){
-		return(FALSE);
-	}
+	if(tb->tokens >= 1)
+		return(0);
 
-	return(TRUE);
+	return( (uint64_t) ((1 - tb->tokens) * NSEC_PER_SEC / tb->rate) + 1);
 }
 
 
 
-
-
 /*
- * Function: get_json_objects()
+ * Function: siphash()
  *
- * Obtains the first-level JSON objects
+ * Computes the SipHash-2-4 keyed hash of a buffer (employed e.g. for computing stateless cookies)
  */
 
-struct json * json_get_objects(char *s, unsigned int len){
-	struct json	*json;
-	unsigned int i;
-	char	*kstart=NULL, *kend=NULL, *vstart=NULL, *vend=NULL;
-	char quoted_f=FALSE, open_quote_f=FALSE;
-	int bracket_depth=0, curly_depth=0;
-
-/*puts("Voy a chequear string");*/
-	if(!is_valid_json_string(s, len)){
-/*puts("String no valido");*/
-		return(NULL);
-	}
+#define SIP_ROTL(x, b)	(uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
 
-/*puts("String valido");*/
+#define SIP_ROUND(v0, v1, v2, v3)	\
+	do{	\
+		v0 += v1; v1= SIP_ROTL(v1, 13); v1 ^= v0; v0= SIP_ROTL(v0, 32);	\
+		v2 += v3; v3= SIP_ROTL(v3, 16); v3 ^= v2;	\
+		v0 += v3; v3= SIP_ROTL(v3, 21); v3 ^= v0;	\
+		v2 += v1; v1= SIP_ROTL(v1, 17); v1 ^= v2; v2= SIP_ROTL(v2, 32);	\
+	}while(0)
 
-/*puts("Voy a hacer alloc");*/
-	if( (json=json_alloc_struct()) == NULL){
-/*puts("No pude hacer alloc");*/
-		return(NULL);
-	}
+uint64_t siphash(const unsigned char *key, const void *data, size_t len){
+	const unsigned char	*p= data;
+	uint64_t			k0, k1, v0, v1, v2, v3, m, b;
+	size_t				i, j;
 
-/*puts("hice alloc"); */
+	k0= k1= 0;
 
-	for(i=0; i<	len; i++){
-		if(open_quote_f){
-			switch(s[i]){
-				case '\\':
-					quoted_f= TRUE;
-					break;
+	for(i=0; i < 8; i++){
+		k0|= (uint64_t) key[i] << (8 * i);
+		k1|= (uint64_t) key[i+8] << (8 * i);
+	}
 
-				case '"':
-					if(quoted_f){
-						quoted_f= FALSE;
-					}
-					else{
-						open_quote_f= FALSE;
-/*
-						if(curly_depth == 1 && kstart != NULL && kend==NULL){
-							kend= s+i+1;
-							vstart= s+i+1;
-						}
-*/
-					}
-	
-					break;
+	v0= k0 ^ 0x736f6d6570736575ULL;
+	v1= k1 ^ 0x646f72616e646f6dULL;
+	v2= k0 ^ 0x6c7967656e657261ULL;
+	v3= k1 ^ 0x7465646279746573ULL;
 
-				default:
-					quoted_f= FALSE;
-					break;
-			}
-		}
-		else{
-			switch(s[i]){
-				case '\\':
-					quoted_f= TRUE;
-					break;
+	for(i=0; (i+8) <= len; i+=8){
+		m=0;
 
-				case '[':
-					bracket_depth++;
-					quoted_f= FALSE;
-					break;
+		for(j=0; j < 8; j++)
+			m|= (uint64_t) p[i+j] << (8 * j);
 
-				case ']':
-					bracket_depth--;
-					quoted_f= FALSE;
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
 
-					if(bracket_depth < 0)
-						return(FALSE);
+	b= (uint64_t) len << 56;
 
-					break;
+	for(j=0; i+j < len; j++)
+		b|= (uint64_t) p[i+j] << (8 * j);
 
-				case '{':
-					curly_depth++;
-					if(curly_depth == 1 && kstart==NULL)
-						kstart= s+i+1;
+	v3 ^= b;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
 
-					quoted_f= FALSE;
-					break;
+	return(v0 ^ v1 ^ v2 ^ v3);
+}
 
-				case ':':
-					if(curly_depth == 1 && kstart != NULL && kend==NULL){
-						kend= s+i;
-						vstart= s+i+1;
-					}
 
-					quoted_f= FALSE;
-					break;
+/*
+ * Function: random_key()
+ *
+ * Obtains a random key (e.g. for the siphash() function)
+ */
 
-				case ',':
-					if(curly_depth == 1 && kstart != NULL && kend!=NULL && vstart!=NULL){
-						vend= s+i;
+void random_key(unsigned char *key, size_t len){
+	FILE	*fp;
+	size_t	i=0;
 
-						if(!json_add_item(json, kstart, kend-kstart, vstart, vend-vstart)){
-							json_free_struct(json);
-							return(FALSE);
-						}
+	if( (fp=fopen("/dev/urandom", "r")) != NULL){
+		i= fread(key, 1, len, fp);
+		fclose(fp);
+	}
 
-						kstart= s+i+1;
-						kend= NULL;
-						vstart= NULL;
-						vend= NULL;
-					}
-					else if(curly_depth == 1 && kstart == NULL && kend==NULL && vstart==NULL && vend==NULL){
-						kstart= s+i+1;
-					}
+	/* Fall back to random() if /dev/urandom is not available */
+	for(; i < len; i++)
+		key[i]= random();
+}
 
-					quoted_f= FALSE;
-					break;
 
-				case '}':
-					curly_depth--;
+/*
+ * Function: decode_ipv4_udp()
+ *
+ * Decodes an IPv4 packet carrying a UDP datagram. Returns copies of the IPv4 header (without options)
+ * and the UDP header, and a pointer to the UDP payload. Packets need not be aligned (e.g. within a
+ * mapped capture file), so the headers are copied rather than accessed in place
+ */
 
-					if(curly_depth <= 1 && curly_depth >= 0  && kstart != NULL && kend!=NULL && vstart!=NULL){
-						vend= s+i+curly_depth;
+int decode_ipv4_udp(unsigned char *pkt, size_t len, struct ip_hdr *iph, struct udp_hdr *udph, unsigned char **data, size_t *ndata){
+	size_t			iphlen, iplen, udplen;
 
-						if(!json_add_item(json, kstart, kend-kstart, vstart, vend-vstart)){
-							json_free_struct(json);
-							return(FALSE);
-						}
+	if(len < sizeof(struct ip_hdr))
+		return(FAILURE);
 
-						kstart= NULL;
-						kend= NULL;
-						vstart= NULL;
-						vend= NULL;
-					}
+	memcpy(iph, pkt, sizeof(struct ip_hdr));
+	iphlen= iph->ip_hl << 2;
+	iplen= ntohs(iph->ip_len);
 
-					quoted_f= FALSE;
+	if(iph->ip_v != 4 || iph->ip_p != IPPROTO_UDP || iphlen < sizeof(struct ip_hdr))
+		return(FAILURE);
 
-					if(curly_depth < 0)
-						return(FALSE);
+	/* Only the first fragment (or an unfragmented packet) contains the UDP header */
+	if(ntohs(iph->ip_off) & IP_OFFMASK)
+		return(FAILURE);
 
-					break;
+	if(iplen > len || iplen < (iphlen + MIN_UDP_HLEN))
+		return(FAILURE);
 
-				case '"':
-					if(quoted_f){
-						quoted_f= FALSE;
-					}
-					else{
-						open_quote_f=TRUE;
-					}
-	
-					break;
+	memcpy(udph, pkt + iphlen, sizeof(struct udp_hdr));
+	udplen= ntohs(udph->uh_ulen);
 
-				default:
-					quoted_f= FALSE;
-					break;
-			}
-		}
-	}
+	if(udplen < MIN_UDP_HLEN || udplen > (iplen - iphlen))
+		return(FAILURE);
 
-	return(json);
+	*data= pkt + iphlen + MIN_UDP_HLEN;
+	*ndata= udplen - MIN_UDP_HLEN;
+	return(SUCCESS);
 }
 
 
 /*
- * Function: json_alloc_struct()
+ * Function: decode_frame()
  *
- * Obtains the first-level JSON objects
+ * Decodes a captured frame (of the specified link-layer type) carrying an IPv4 UDP datagram.
+ * Returns copies of the IPv4 and UDP headers, and a pointer to the UDP payload (see decode_ipv4_udp())
  */
 
-struct json * json_alloc_struct(void){
-	struct json *json;
-	unsigned int i;
+int decode_frame(int dlt, unsigned char *frame, size_t len, struct ip_hdr *iph, struct udp_hdr *udph, unsigned char **data, size_t *ndata){
+	struct ether_header	ether;
+	struct dlt_null		null;
+	uint16_t			type;
+	size_t				offset;
 
-/*puts("entre a alloc");*/
-	/* XXX: Minimal check on the size of struct json
-		We have: 2 unsignet int, 2 arrays of MAX_ITEMS of unsigned in, 2 arrays of MAX_ITEMS of char *
-	*/
-/*printf("tam mem: %li\n", sizeof(struct json));*/
+	switch(dlt){
+		case DLT_EN10MB:
+			if(len < ETHER_HDR_LEN)
+				return(FAILURE);
 
-	if( (json= malloc(sizeof(struct json))) == NULL){
-		return(NULL);
-	}
+			memcpy(&ether, frame, sizeof(ether));
+			type= ntohs(ether.ether_type);
+			offset= ETHER_HDR_LEN;
 
-/*
-	if( (json= malloc(sizeof(struct json))) == NULL){
-puts("no pude reservar memoria");
-		return(NULL);
+			/* Frames may carry (one) 802.1Q tag when captured on the parent interface */
+			if(type == ETHERTYPE_8021Q){
+				if(len < (offset + VLAN_HLEN))
+					return(FAILURE);
+
+				memcpy(&type, frame + offset + 2, sizeof(type));
+				type= ntohs(type);
+				offset+= VLAN_HLEN;
+			}
+
+			break;
+
+		case DLT_LINUX_SLL:
+			if(len < SLL_HLEN)
+				return(FAILURE);
+
+			memcpy(&type, frame + SLL_HLEN - 2, sizeof(type));
+			type= ntohs(type);
+			offset= SLL_HLEN;
+			break;
+
+		case DLT_NULL:
+			if(len < sizeof(struct dlt_null))
+				return(FAILURE);
+
+			memcpy(&null, frame, sizeof(null));
+			type= (null.family == AF_INET)?ETHERTYPE_IPV4:0;
+			offset= sizeof(struct dlt_null);
+			break;
+
+		case DLT_RAW:
+#ifdef DLT_IPV4
+		case DLT_IPV4:
+#endif
+			type= ETHERTYPE_IPV4;
+			offset= 0;
+			break;
+
+		default:
+			return(FAILURE);
+	}
+
+	if(type != ETHERTYPE_IPV4)
+		return(FAILURE);
+
+	return(decode_ipv4_udp(frame + offset, len - offset, iph, udph, data, ndata));
+}
+
+
+/*
+ * Function: open_capture()
+ *
+ * Opens a capture on the specified interface in immediate mode (non-blocking, and without
+ * promiscuous mode). On error, NULL is returned and the reason is stored in "errbuf"
+ */
+
+pcap_t *open_capture(char *iface, char *errbuf){
+	pcap_t	*pcap;
+
+	if( (pcap=pcap_create(iface, errbuf)) == NULL)
+		return(NULL);
+
+	if(pcap_set_snaplen(pcap, CAPTURE_SNAPLEN) != 0 || pcap_set_promisc(pcap, 0) != 0 || \
+		pcap_set_timeout(pcap, PCAP_TIMEOUT) != 0 || pcap_set_immediate_mode(pcap, 1) != 0 || \
+		pcap_set_buffer_size(pcap, CAPTURE_BUFFER_SIZE) != 0 || pcap_activate(pcap) < 0 || \
+		pcap_setnonblock(pcap, 1, errbuf) == -1){
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(pcap));
+		pcap_close(pcap);
+		return(NULL);
+	}
+
+	/* Frames sent by this host are of no interest (not supported everywhere, and hence not an error) */
+	pcap_setdirection(pcap, PCAP_D_IN);
+	return(pcap);
+}
+
+
+/*
+ * Function: open_capfile()
+ *
+ * Maps a capture file (in the classic pcap format) into memory, such that frames can be
+ * processed in place. Returns FAILURE if the file cannot be mapped or is in any other format,
+ * in which case it should be read with libpcap instead
+ */
+
+int open_capfile(struct capfile *cf, char *path){
+	struct stat		st;
+	uint32_t		magic, linktype;
+	int				fd;
+	void			*map;
+
+	memset(cf, 0, sizeof(struct capfile));
+
+	if( (fd=open(path, O_RDONLY)) == -1)
+		return(FAILURE);
+
+	if(fstat(fd, &st) == -1 || st.st_size < CAPFILE_HDRLEN || (uintmax_t) st.st_size > SIZE_MAX){
+		close(fd);
+		return(FAILURE);
+	}
+
+	/* Parsers may modify the frames (e.g., decrypt them in place): such changes are private */
+	map= mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED)
+		return(FAILURE);
+
+	cf->map= map;
+	cf->size= st.st_size;
+	memcpy(&magic, cf->map, sizeof(magic));
+
+	switch(magic){
+		case CAPFILE_MAGIC_USEC:
+			break;
+
+		case CAPFILE_MAGIC_NSEC:
+			cf->nsec_f= TRUE;
+			break;
+
+		default:
+			magic= swap32(magic);
+
+			if(magic != CAPFILE_MAGIC_USEC && magic != CAPFILE_MAGIC_NSEC){
+				close_capfile(cf);
+				return(FAILURE);
+			}
+
+			cf->swap_f= TRUE;
+			cf->nsec_f= (magic == CAPFILE_MAGIC_NSEC);
+			break;
+	}
+
+	memcpy(&linktype, cf->map + CAPFILE_HDRLEN - sizeof(linktype), sizeof(linktype));
+	cf->dlt= (cf->swap_f?swap32(linktype):linktype) & CAPFILE_LINKTYPE_MASK;
+	cf->offset= CAPFILE_HDRLEN;
+
+	/* Frames are read once, front to back */
+	madvise(cf->map, cf->size, MADV_SEQUENTIAL);
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: next_capfile_frame()
+ *
+ * Obtains the next frame of a capture file mapped with open_capfile(). Returns 1 if a frame was
+ * obtained, 0 at the end of the file, and -1 if the file is truncated
+ */
+
+int next_capfile_frame(struct capfile *cf, struct pcap_pkthdr *pkthdr, unsigned char **frame){
+	uint32_t		rec[4];		/* Seconds, micro/nanoseconds, captured length, original length */
+	unsigned int	i;
+
+	if(cf->offset == cf->size)
+		return(0);
+
+	if((cf->size - cf->offset) < sizeof(rec))
+		return(-1);
+
+	memcpy(rec, cf->map + cf->offset, sizeof(rec));
+
+	if(cf->swap_f){
+		for(i=0; i < 4; i++)
+			rec[i]= swap32(rec[i]);
+	}
+
+	if((cf->size - cf->offset - sizeof(rec)) < rec[2])
+		return(-1);
+
+	pkthdr->ts.tv_sec= rec[0];
+	pkthdr->ts.tv_usec= cf->nsec_f?(rec[1] / 1000):rec[1];
+	pkthdr->caplen= rec[2];
+	pkthdr->len= rec[3];
+	*frame= cf->map + cf->offset + sizeof(rec);
+	cf->offset+= sizeof(rec) + rec[2];
+	return(1);
+}
+
+
+/*
+ * Function: close_capfile()
+ *
+ * Unmaps a capture file mapped with open_capfile()
+ */
+
+void close_capfile(struct capfile *cf){
+	if(cf->map != NULL)
+		munmap(cf->map, cf->size);
+
+	memset(cf, 0, sizeof(struct capfile));
+}
+
+
+/*
+ * Function: swap32()
+ *
+ * Reverses the byte order of a 32-bit value
+ */
+
+uint32_t swap32(uint32_t v){
+	return( ((v & 0x000000ff) << 24) | ((v & 0x0000ff00) << 8) | ((v & 0x00ff0000) >> 8) | ((v & 0xff000000) >> 24));
+}
+
+
+/*
+ * Function: init_fpdb()
+ *
+ * Initializes an empty fingerprint database
+ */
+
+void init_fpdb(struct fpdb *db){
+	memset(db, 0, sizeof(struct fpdb));
+}
+
+
+/*
+ * Function: add_fingerprint()
+ *
+ * Adds a fingerprint to a database. The pattern, mask and description are not copied. The
+ * database must be compiled with compile_fpdb() once all the fingerprints have been added
+ */
+
+int add_fingerprint(struct fpdb *db, struct fingerprint *fp){
+	struct fingerprint	*fps, *new;
+	size_t				i, run, runoff;
+
+	if(fp->minlen > fp->maxlen)
+		return(FAILURE);
+
+	if(db->nfps == db->maxfps){
+		if( (fps=realloc(db->fps, (db->maxfps?(db->maxfps * 2):16) * sizeof(struct fingerprint))) == NULL)
+			return(FAILURE);
+
+		db->fps= fps;
+		db->maxfps= db->maxfps?(db->maxfps * 2):16;
+	}
+
+	new= &(db->fps[db->nfps]);
+	*new= *fp;
+	new->keyoff= 0;
+	new->nkey= 0;
+	new->next= NULL;
+
+	/* The longest run of significant bytes is fed to the automaton */
+	for(i=0, run=0, runoff=0; i < new->npattern; i++){
+		if(new->mask != NULL && new->mask[i] != 0xff){
+			run= 0;
+			continue;
+		}
+
+		if(run == 0)
+			runoff= i;
+
+		if(++run > new->nkey){
+			new->keyoff= runoff;
+			new->nkey= run;
+		}
+	}
+
+	if(new->nkey > FP_MAX_KEY)
+		new->nkey= FP_MAX_KEY;
+
+	/* Patterns without a key can only be checked at a known offset */
+	if(new->nkey == 0 && new->npattern && new->offset == FP_ANY_OFFSET)
+		return(FAILURE);
+
+	db->nfps++;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: load_fingerprints()
+ *
+ * Adds the fingerprints of a fingerprint file to a database. Records for families other than
+ * 0 to nfamilies-1 are rejected. If the file cannot be loaded, the database is left as it was
+ */
+
+int load_fingerprints(struct fpdb *db, char *path, unsigned int nfamilies){
+	struct stat			st;
+	unsigned char		*buff, **files;
+	unsigned int		nfps;
+	int					fd;
+
+	if( (fd=open(path, O_RDONLY)) == -1)
+		return(FAILURE);
+
+	if(fstat(fd, &st) == -1 || st.st_size < FP_FILE_HDRLEN || st.st_size > (1024 * 1024 * 1024)){
+		close(fd);
+		return(FAILURE);
+	}
+
+	/* Descriptions are copied (NUL-terminated) after the contents of the file */
+	if( (buff=malloc(st.st_size * 2)) == NULL){
+		close(fd);
+		return(FAILURE);
+	}
+
+	if(read(fd, buff, st.st_size) != st.st_size){
+		close(fd);
+		free(buff);
+		return(FAILURE);
+	}
+
+	close(fd);
+
+	/* The fingerprints added from a file that turns out to be malformed are removed */
+	nfps= db->nfps;
+
+	if(parse_fingerprints(db, buff, st.st_size, nfamilies) == FAILURE || \
+		(files=realloc(db->files, (db->nfiles + 1) * sizeof(unsigned char *))) == NULL){
+		db->nfps= nfps;
+		free(buff);
+		return(FAILURE);
+	}
+
+	db->files= files;
+	db->files[db->nfiles++]= buff;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: parse_fingerprints()
+ *
+ * Adds the fingerprints of the contents of a fingerprint file (see load_fingerprints()) to a database.
+ * The buffer must have room for "size" more bytes, where the descriptions are copied
+ */
+
+int parse_fingerprints(struct fpdb *db, unsigned char *buff, size_t size, unsigned int nfamilies){
+	struct fingerprint	fp;
+	unsigned char		*rec, *desc;
+	unsigned int		nrecs, i;
+	size_t				offset, ndesc;
+	uint16_t			v;
+
+	if(size < FP_FILE_HDRLEN || memcmp(buff, FP_FILE_MAGIC, strlen(FP_FILE_MAGIC)) != 0 || buff[4] != FP_FILE_VERSION)
+		return(FAILURE);
+
+	memcpy(&v, buff + 6, sizeof(v));
+	nrecs= ntohs(v);
+	offset= FP_FILE_HDRLEN;
+	desc= buff + size;
+
+	for(i=0; i < nrecs; i++){
+		if((size - offset) < FP_FILE_RECLEN)
+			return(FAILURE);
+
+		rec= buff + offset;
+		memset(&fp, 0, sizeof(fp));
+
+		if( (fp.family= rec[0]) >= nfamilies)
+			return(FAILURE);
+
+		memcpy(&v, rec + 2, sizeof(v));
+		fp.offset= (rec[1] & FP_FILE_ANY_OFFSET)?FP_ANY_OFFSET:ntohs(v);
+		memcpy(&v, rec + 4, sizeof(v));
+		fp.minlen= ntohs(v);
+		memcpy(&v, rec + 6, sizeof(v));
+		fp.maxlen= (ntohs(v) == FP_FILE_ANY_LENGTH)?FP_ANY_LENGTH:ntohs(v);
+		memcpy(&v, rec + 8, sizeof(v));
+		fp.npattern= ntohs(v);
+		ndesc= rec[10];
+
+		if((size - offset - FP_FILE_RECLEN) < (fp.npattern * 2 + ndesc))
+			return(FAILURE);
+
+		fp.pattern= rec + FP_FILE_RECLEN;
+		fp.mask= fp.pattern + fp.npattern;
+		memcpy(desc, fp.mask + fp.npattern, ndesc);
+		desc[ndesc]= 0;
+		fp.desc= (char *) desc;
+		desc+= ndesc + 1;
+		offset+= FP_FILE_RECLEN + fp.npattern * 2 + ndesc;
+
+		if(add_fingerprint(db, &fp) == FAILURE)
+			return(FAILURE);
+	}
+
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: compile_fpdb()
+ *
+ * Builds the Aho-Corasick automaton for the keys of the fingerprints of a database
+ */
+
+int compile_fpdb(struct fpdb *db){
+	struct fingerprint	**tail, **nokey, *fp;
+	uint16_t			*fail, *queue;
+	unsigned int		maxstates, i, head, ntail, r, u, c;
+	size_t				j;
+
+	free(db->delta);
+	free(db->link);
+	free(db->keys);
+	db->delta= db->link= NULL;
+	db->keys= NULL;
+	db->nokey= NULL;
+
+	for(i=0, maxstates=1; i < db->nfps; i++)
+		maxstates+= db->fps[i].nkey;
+
+	if(maxstates > FP_MAX_STATES)
+		return(FAILURE);
+
+	db->delta= calloc((size_t) maxstates * 256, sizeof(uint16_t));
+	db->link= calloc(maxstates, sizeof(uint16_t));
+	db->keys= calloc(maxstates, sizeof(struct fingerprint *));
+	fail= calloc(maxstates, sizeof(uint16_t));
+	queue= malloc(maxstates * sizeof(uint16_t));
+
+	if(db->delta == NULL || db->link == NULL || db->keys == NULL || fail == NULL || queue == NULL){
+		free(fail);
+		free(queue);
+		return(FAILURE);
+	}
+
+	/* Trie of the keys (fingerprints are kept in order, such that earlier ones take precedence) */
+	db->nstates= 1;
+	nokey= &(db->nokey);
+
+	for(i=0; i < db->nfps; i++){
+		fp= &(db->fps[i]);
+		fp->next= NULL;
+
+		if(fp->nkey == 0){
+			*nokey= fp;
+			nokey= &(fp->next);
+			continue;
+		}
+
+		for(j=0, r=0; j < fp->nkey; j++){
+			c= fp->pattern[fp->keyoff + j];
+
+			if(db->delta[r * 256 + c] == 0)
+				db->delta[r * 256 + c]= db->nstates++;
+
+			r= db->delta[r * 256 + c];
+		}
+
+		for(tail= &(db->keys[r]); *tail != NULL; tail= &((*tail)->next));
+
+		*tail= fp;
+	}
+
+	/* Failure links are resolved breadth-first and folded into the transitions */
+	for(c=0, head=0, ntail=0; c < 256; c++){
+		if( (u=db->delta[c]) != 0)
+			queue[ntail++]= u;
+	}
+
+	while(head < ntail){
+		r= queue[head++];
+
+		for(c=0; c < 256; c++){
+			if( (u=db->delta[r * 256 + c]) == 0){
+				db->delta[r * 256 + c]= db->delta[fail[r] * 256 + c];
+				continue;
+			}
+
+			fail[u]= db->delta[fail[r] * 256 + c];
+			db->link[u]= (db->keys[fail[u]] != NULL)?fail[u]:db->link[fail[u]];
+			queue[ntail++]= u;
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: check_fingerprint()
+ *
+ * Checks whether a payload matches a fingerprint whose pattern starts at a specific offset
+ */
+
+unsigned int check_fingerprint(struct fingerprint *fp, unsigned char *data, size_t len, size_t start){
+	size_t	i;
+
+	if(len < fp->minlen || len > fp->maxlen || (fp->offset != FP_ANY_OFFSET && start != fp->offset) || \
+		fp->npattern > len || start > (len - fp->npattern))
+		return(FALSE);
+
+	for(i=0; i < fp->npattern; i++){
+		if(fp->mask == NULL){
+			if(data[start + i] != fp->pattern[i])
+				return(FALSE);
+		}
+		else if((data[start + i] ^ fp->pattern[i]) & fp->mask[i])
+			return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Function: match_fingerprint()
+ *
+ * Classifies a payload in a single pass over it. Returns the first fingerprint of the family
+ * (FP_ANY_FAMILY for any family) that the payload matches, or NULL if there is none
+ */
+
+struct fingerprint *match_fingerprint(struct fpdb *db, unsigned char *data, size_t len, unsigned int family){
+	struct fingerprint	*fp;
+	unsigned int		s, t;
+	size_t				i;
+
+	for(fp= db->nokey; fp != NULL; fp= fp->next){
+		if((family == FP_ANY_FAMILY || fp->family == family) && \
+			check_fingerprint(fp, data, len, (fp->offset == FP_ANY_OFFSET)?0:fp->offset))
+			return(fp);
+	}
+
+	if(db->delta == NULL)
+		return(NULL);
+
+	for(i=0, s=0; i < len; i++){
+		s= db->delta[s * 256 + data[i]];
+
+		for(t= (db->keys[s] != NULL)?s:db->link[s]; t != 0; t= db->link[t]){
+			for(fp= db->keys[t]; fp != NULL; fp= fp->next){
+				if((family == FP_ANY_FAMILY || fp->family == family) && (i + 1) >= (fp->keyoff + fp->nkey) && \
+					check_fingerprint(fp, data, len, i + 1 - fp->nkey - fp->keyoff))
+					return(fp);
+			}
+		}
+	}
+
+	return(NULL);
+}
+
+
+/*
+ * Function: destroy_fpdb()
+ *
+ * Releases the resources of a fingerprint database
+ */
+
+void destroy_fpdb(struct fpdb *db){
+	unsigned int	i;
+
+	for(i=0; i < db->nfiles; i++)
+		free(db->files[i]);
+
+	free(db->files);
+	free(db->fps);
+	free(db->delta);
+	free(db->link);
+	free(db->keys);
+	memset(db, 0, sizeof(struct fpdb));
+}
+
+
+/*
+ * Function: init_permutation()
+ *
+ * Initializes a keyed pseudorandom permutation of the integers [0, 2^nbits), with nbits <= 32.
+ * The round keys are derived from the seed with the splitmix64 generator
+ */
+
+void init_permutation(struct permutation *perm, unsigned int nbits, uint64_t seed){
+	uint64_t		z;
+	unsigned int	i;
+
+	perm->nbits= nbits;
+	perm->hbits= (nbits + 1) >> 1;
+	perm->mask= ((uint32_t) 1 << perm->hbits) - 1;
+
+	for(i=0; i < PERMUTATION_ROUNDS; i++){
+		seed+= 0x9e3779b97f4a7c15ULL;
+		z= seed;
+		z= (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z= (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		perm->keys[i]= (uint32_t) (z ^ (z >> 31));
+	}
+}
+
+
+/*
+ * Function: permutation_round()
+ *
+ * Round function of the Feistel network employed by permute_index()
+ */
+
+uint32_t permutation_round(uint32_t x, uint32_t key){
+	x^= key;
+	x*= 0x85ebca6b;
+	x^= x >> 13;
+	x*= 0xc2b2ae35;
+	x^= x >> 16;
+	return(x);
+}
+
+
+/*
+ * Function: permute_index()
+ *
+ * Maps an index in [0, 2^nbits) to its position in the permutation. A balanced Feistel network
+ * is employed over 2*ceil(nbits/2) bits; when nbits is odd, the network is re-applied ("cycle
+ * walking") until the result falls within the domain, which takes less than two iterations on
+ * average
+ */
+
+uint32_t permute_index(struct permutation *perm, uint32_t index){
+	uint32_t		l, r, t;
+	unsigned int	i;
+
+	if(perm->nbits == 0)
+		return(0);
+
+	do{
+		l= index >> perm->hbits;
+		r= index & perm->mask;
+
+		for(i=0; i < PERMUTATION_ROUNDS; i++){
+			t= r;
+			r= l ^ (permutation_round(r, perm->keys[i]) & perm->mask);
+			l= t;
+		}
+
+		index= (l << perm->hbits) | r;
+	}while(perm->nbits < (perm->hbits << 1) && (index >> perm->nbits) != 0);
+
+	return(index);
+}
+
+
+/*
+ * Function: create_batch()
+ *
+ * Allocates a batch of (up to) "size" datagrams of up to "bufflen" bytes each, to be sent
+ * with send_batch()
+ */
+
+int create_batch(struct batch *batch, unsigned int size, size_t bufflen){
+	memset(batch, 0, sizeof(struct batch));
+	batch->size= size;
+	batch->bufflen= bufflen;
+
+	if( (batch->buff= malloc(size * bufflen)) == NULL || (batch->len= malloc(size * sizeof(size_t))) == NULL || \
+		(batch->addr= malloc(size * sizeof(struct sockaddr_in))) == NULL){
+		destroy_batch(batch);
+		return(FAILURE);
+	}
+
+#ifdef __linux__
+	if( (batch->msgs= malloc(size * sizeof(struct mmsghdr))) == NULL || (batch->iov= malloc(size * sizeof(struct iovec))) == NULL){
+		destroy_batch(batch);
+		return(FAILURE);
+	}
+#endif
+
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: destroy_batch()
+ *
+ * Releases the memory employed by a batch of datagrams
+ */
+
+void destroy_batch(struct batch *batch){
+	free(batch->buff);
+	free(batch->len);
+	free(batch->addr);
+#ifdef __linux__
+	free(batch->msgs);
+	free(batch->iov);
+#endif
+	memset(batch, 0, sizeof(struct batch));
+}
+
+
+/*
+ * Function: batch_add()
+ *
+ * Appends a datagram to a batch. The data may have been built in place at BATCH_SLOT(batch, batch->n)
+ */
+
+int batch_add(struct batch *batch, void *data, size_t len, struct sockaddr_in *to){
+	char	*slot;
+
+	if(batch->n >= batch->size || len > batch->bufflen)
+		return(FAILURE);
+
+	slot= BATCH_SLOT(batch, batch->n);
+
+	if(data != slot)
+		memcpy(slot, data, len);
+
+	batch->len[batch->n]= len;
+	batch->addr[batch->n]= *to;
+	batch->n++;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: batch_drop()
+ *
+ * Removes the first "count" datagrams of a batch
+ */
+
+void batch_drop(struct batch *batch, unsigned int count){
+	if(count >= batch->n){
+		batch->n= 0;
+		return;
+	}
+
+	memmove(batch->buff, BATCH_SLOT(batch, count), (batch->n - count) * batch->bufflen);
+	memmove(batch->len, batch->len + count, (batch->n - count) * sizeof(size_t));
+	memmove(batch->addr, batch->addr + count, (batch->n - count) * sizeof(struct sockaddr_in));
+	batch->n-= count;
+}
+
+
+/*
+ * Function: send_batch()
+ *
+ * Sends the datagrams of a batch with as few system calls as possible. Sent datagrams are removed
+ * from the batch, such that the remaining ones can be sent later. Returns the number of datagrams
+ * sent, or -1 (with errno set) if not even the first one could be sent
+ */
+
+int send_batch(int fd, struct batch *batch){
+	unsigned int	nsent=0;
+#ifdef __linux__
+	struct msghdr	*msg;
+	unsigned int	i;
+	int				r;
+#endif
+
+	if(batch->n == 0)
+		return(0);
+
+#ifdef __linux__
+	for(i=0; i < batch->n; i++){
+		batch->iov[i].iov_base= BATCH_SLOT(batch, i);
+		batch->iov[i].iov_len= batch->len[i];
+		msg= &(batch->msgs[i].msg_hdr);
+		memset(msg, 0, sizeof(struct msghdr));
+		msg->msg_name= &(batch->addr[i]);
+		msg->msg_namelen= sizeof(struct sockaddr_in);
+		msg->msg_iov= &(batch->iov[i]);
+		msg->msg_iovlen= 1;
+	}
+
+	if( (r=sendmmsg(fd, batch->msgs, batch->n, 0)) == -1)
+		return(-1);
+
+	nsent= r;
+#else
+	while(nsent < batch->n){
+		if(sendto(fd, BATCH_SLOT(batch, nsent), batch->len[nsent], 0, (struct sockaddr *) &(batch->addr[nsent]), sizeof(struct sockaddr_in)) == -1){
+			if(nsent == 0)
+				return(-1);
+
+			break;
+		}
+
+		nsent++;
+	}
+#endif
+
+	batch_drop(batch, nsent);
+	return(nsent);
+}
+
+
+/*
+ * Function: create_pktpool()
+ *
+ * Allocates a pool of "nbufs" packet buffers, each of which can hold a datagram of up to
+ * "bufsize" bytes
+ */
+
+int create_pktpool(struct pktpool *pool, unsigned int nbufs, size_t bufsize){
+	struct pktbuf	*pkt;
+	unsigned int	i;
+	void			*slabs;
+
+	memset(pool, 0, sizeof(struct pktpool));
+
+	pool->bufsize= bufsize;
+	pool->slablen= (PKTBUF_HDRLEN + bufsize + 1 + PKTPOOL_ALIGN - 1) & ~((size_t) PKTPOOL_ALIGN - 1);
+	pool->nbufs= nbufs;
+
+	if(posix_memalign(&slabs, PKTPOOL_ALIGN, nbufs * pool->slablen) != 0)
+		return(FAILURE);
+
+	pool->slabs= slabs;
+
+	if(pthread_mutex_init(&(pool->mutex), NULL) != 0){
+		free(pool->slabs);
+		return(FAILURE);
+	}
+
+	for(i=nbufs; i > 0; i--){
+		pkt= (struct pktbuf *) (pool->slabs + (size_t) (i - 1) * pool->slablen);
+		pkt->pool= pool;
+		pkt->refs= 0;
+		pkt->next= pool->free;
+		pool->free= pkt;
+	}
+
+	pool->nfree= nbufs;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: destroy_pktpool()
+ *
+ * Releases the memory employed by a pool of packet buffers
+ */
+
+void destroy_pktpool(struct pktpool *pool){
+	pthread_mutex_destroy(&(pool->mutex));
+	free(pool->slabs);
+	memset(pool, 0, sizeof(struct pktpool));
+}
+
+
+/*
+ * Function: pktbuf_alloc()
+ *
+ * Takes a buffer from a pool, with a reference count of one. Returns NULL if all buffers are in use
+ */
+
+struct pktbuf *pktbuf_alloc(struct pktpool *pool){
+	struct pktbuf	*pkt;
+
+	pthread_mutex_lock(&(pool->mutex));
+
+	if( (pkt= pool->free) != NULL){
+		pool->free= pkt->next;
+		pool->nfree--;
+	}
+	else{
+		pool->nexhausted++;
+	}
+
+	pthread_mutex_unlock(&(pool->mutex));
+
+	if(pkt != NULL){
+		pkt->next= NULL;
+		pkt->refs= 1;
+		pkt->len= 0;
+	}
+
+	return(pkt);
+}
+
+
+/*
+ * Function: pktbuf_ref()
+ *
+ * Takes an additional reference to a packet buffer
+ */
+
+void pktbuf_ref(struct pktbuf *pkt){
+	__atomic_add_fetch(&(pkt->refs), 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Function: pktbuf_unref()
+ *
+ * Drops a reference to a packet buffer, which goes back to its pool when no references remain
+ */
+
+void pktbuf_unref(struct pktbuf *pkt){
+	struct pktpool	*pool= pkt->pool;
+
+	if(__atomic_sub_fetch(&(pkt->refs), 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	pthread_mutex_lock(&(pool->mutex));
+	pkt->next= pool->free;
+	pool->free= pkt;
+	pool->nfree++;
+	pthread_mutex_unlock(&(pool->mutex));
+}
+
+
+/*
+ * Function: recv_pktbufs()
+ *
+ * Receives up to "max" pending datagrams (without blocking) directly into buffers taken from a
+ * pool. Returns the number of buffers stored in "pkts" (each of which holds one reference), or
+ * -1 on error
+ */
+
+int recv_pktbufs(int fd, struct pktpool *pool, struct pktbuf **pkts, unsigned int max){
+#ifdef __linux__
+	struct mmsghdr	msgs[PKTBUF_MAX_BATCH];
+	struct iovec	iov[PKTBUF_MAX_BATCH];
+	int				r;
+	unsigned int	ntrunc=0;
+#else
+	socklen_t		addrlen;
+	ssize_t			nread;
+	unsigned int	error_f=FALSE;
+#endif
+	unsigned int	i, n, nrecv;
+
+	if(max > PKTBUF_MAX_BATCH)
+		max= PKTBUF_MAX_BATCH;
+
+	for(n=0; n < max && (pkts[n]=pktbuf_alloc(pool)) != NULL; n++);
+
+	nrecv= 0;
+
+#ifdef __linux__
+	memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+	for(i=0; i < n; i++){
+		iov[i].iov_base= PKTBUF_DATA(pkts[i]);
+		iov[i].iov_len= pool->bufsize;
+		msgs[i].msg_hdr.msg_name= &(pkts[i]->addr);
+		msgs[i].msg_hdr.msg_namelen= sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov= &(iov[i]);
+		msgs[i].msg_hdr.msg_iovlen= 1;
+	}
+
+	if(n == 0 || (r=recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL)) == -1){
+		for(i=0; i < n; i++)
+			pktbuf_unref(pkts[i]);
+
+		return((n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)?0:-1);
+	}
+
+	for(i=0; i < n; i++){
+		if(i >= (unsigned int) r){
+			pktbuf_unref(pkts[i]);
+		}
+		else if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+			ntrunc++;
+			pktbuf_unref(pkts[i]);
+		}
+		else{
+			pkts[i]->len= msgs[i].msg_len;
+			pkts[nrecv++]= pkts[i];
+		}
+	}
+
+	/* Pools may be shared by several threads, and the statistics are protected by the pool mutex */
+	if(ntrunc){
+		pthread_mutex_lock(&(pool->mutex));
+		pool->ntrunc+= ntrunc;
+		pthread_mutex_unlock(&(pool->mutex));
+	}
+#else
+	for(i=0; i < n; i++){
+		/* Once the socket has been drained, the remaining buffers go back to the pool */
+		if(nrecv == i){
+			addrlen= sizeof(struct sockaddr_in);
+
+			if( (nread=recvfrom(fd, PKTBUF_DATA(pkts[i]), pool->bufsize, MSG_DONTWAIT, \
+					(struct sockaddr *) &(pkts[i]->addr), &addrlen)) != -1){
+				pkts[i]->len= nread;
+				nrecv++;
+				continue;
+			}
+
+			if(errno != EAGAIN && errno != EWOULDBLOCK && nrecv == 0)
+				error_f= TRUE;
+		}
+
+		pktbuf_unref(pkts[i]);
+	}
+
+	if(error_f)
+		return(-1);
+#endif
+
+	return(nrecv);
+}
+
+
+/*
+ * Function: monotonic_nsec()
+ *
+ * Obtains the current time of the monotonic clock, in nanoseconds. Unlike gettimeofday(), it is
+ * not affected by changes to the system clock
+ */
+
+uint64_t monotonic_nsec(void){
+	struct timespec	ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return(0);
+
+	return((uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec);
+}
+
+
+/*
+ * Function: reactor_init()
+ *
+ * Initializes an event loop. On Linux, it is built on top of epoll and timerfd; elsewhere, it
+ * employs poll()
+ */
+
+int reactor_init(struct reactor *reactor){
+#ifdef __linux__
+	struct epoll_event	ev;
+#endif
+
+	memset(reactor, 0, sizeof(struct reactor));
+	reactor->now= monotonic_nsec();
+
+#ifdef __linux__
+	reactor->tfd= -1;
+
+	if( (reactor->epfd= epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return(FAILURE);
+
+	if( (reactor->tfd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1){
+		reactor_destroy(reactor);
+		return(FAILURE);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events= EPOLLIN;
+	ev.data.fd= reactor->tfd;
+
+	if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->tfd, &ev) == -1){
+		reactor_destroy(reactor);
+		return(FAILURE);
+	}
+#endif
+
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: reactor_destroy()
+ *
+ * Releases the resources employed by an event loop (registered sockets are not closed)
+ */
+
+void reactor_destroy(struct reactor *reactor){
+#ifdef __linux__
+	if(reactor->tfd != -1)
+		close(reactor->tfd);
+
+	if(reactor->epfd != -1)
+		close(reactor->epfd);
+#else
+	free(reactor->pfds);
+#endif
+
+	free(reactor->fds);
+	free(reactor->timers);
+	memset(reactor, 0, sizeof(struct reactor));
+}
+
+
+/*
+ * Function: reactor_add()
+ *
+ * Registers a descriptor with an event loop. The callback function is invoked when the descriptor
+ * becomes readable or writable (as selected by "events")
+ */
+
+int reactor_add(struct reactor *reactor, int fd, unsigned int events, void (*callback)(struct reactor *, int, unsigned int, void *), void *arg){
+	struct reactor_fd	*fds;
+	unsigned int		nfds;
+#ifdef __linux__
+	struct epoll_event	ev;
+#endif
+
+	if(fd < 0)
+		return(FAILURE);
+
+	if((unsigned int) fd >= reactor->nfds){
+		nfds= (reactor->nfds)?(reactor->nfds * 2):REACTOR_MIN_FDS;
+
+		while(nfds <= (unsigned int) fd)
+			nfds= nfds * 2;
+
+		if( (fds= realloc(reactor->fds, nfds * sizeof(struct reactor_fd))) == NULL)
+			return(FAILURE);
+
+		memset(fds + reactor->nfds, 0, (nfds - reactor->nfds) * sizeof(struct reactor_fd));
+		reactor->fds= fds;
+		reactor->nfds= nfds;
+	}
+
+	if(reactor->fds[fd].callback != NULL)
+		return(FAILURE);
+
+#ifdef __linux__
+	memset(&ev, 0, sizeof(ev));
+	ev.events= ((events & REACTOR_READ)?EPOLLIN:0) | ((events & REACTOR_WRITE)?EPOLLOUT:0);
+	ev.data.fd= fd;
+
+	if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return(FAILURE);
+#endif
+
+	reactor->fds[fd].callback= callback;
+	reactor->fds[fd].arg= arg;
+	reactor->fds[fd].events= events;
+	reactor->nregistered++;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: reactor_set_events()
+ *
+ * Changes the events (REACTOR_READ and/or REACTOR_WRITE) of interest for a registered descriptor
+ */
+
+int reactor_set_events(struct reactor *reactor, int fd, unsigned int events){
+#ifdef __linux__
+	struct epoll_event	ev;
+#endif
+
+	if(fd < 0 || (unsigned int) fd >= reactor->nfds || reactor->fds[fd].callback == NULL)
+		return(FAILURE);
+
+	if(reactor->fds[fd].events == events)
+		return(SUCCESS);
+
+#ifdef __linux__
+	memset(&ev, 0, sizeof(ev));
+	ev.events= ((events & REACTOR_READ)?EPOLLIN:0) | ((events & REACTOR_WRITE)?EPOLLOUT:0);
+	ev.data.fd= fd;
+
+	if(epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+		return(FAILURE);
+#endif
+
+	reactor->fds[fd].events= events;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: reactor_del()
+ *
+ * Removes a descriptor from an event loop
+ */
+
+int reactor_del(struct reactor *reactor, int fd){
+	if(fd < 0 || (unsigned int) fd >= reactor->nfds || reactor->fds[fd].callback == NULL)
+		return(FAILURE);
+
+#ifdef __linux__
+	if(epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		return(FAILURE);
+#endif
+
+	memset(&(reactor->fds[fd]), 0, sizeof(struct reactor_fd));
+	reactor->nregistered--;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: reactor_timer_init()
+ *
+ * Initializes a timer, to be scheduled with reactor_timer_set()
+ */
+
+void reactor_timer_init(struct reactor_timer *timer, void (*callback)(struct reactor *, void *), void *arg){
+	memset(timer, 0, sizeof(struct reactor_timer));
+	timer->callback= callback;
+	timer->arg= arg;
+	timer->index= REACTOR_TIMER_INACTIVE;
+}
+
+
+/*
+ * Function: reactor_timer_swap()
+ *
+ * Swaps two entries of the timer heap
+ */
+
+void reactor_timer_swap(struct reactor *reactor, unsigned int a, unsigned int b){
+	struct reactor_timer	*timer;
+
+	timer= reactor->timers[a];
+	reactor->timers[a]= reactor->timers[b];
+	reactor->timers[b]= timer;
+	reactor->timers[a]->index= a;
+	reactor->timers[b]->index= b;
+}
+
+
+/*
+ * Function: reactor_timer_sift()
+ *
+ * Restores the heap property after the expiry of the timer at position "i" has changed
+ */
+
+void reactor_timer_sift(struct reactor *reactor, unsigned int i){
+	unsigned int	child;
+
+	while(i > 0 && reactor->timers[i]->expiry < reactor->timers[(i - 1) / 2]->expiry){
+		reactor_timer_swap(reactor, i, (i - 1) / 2);
+		i= (i - 1) / 2;
+	}
+
+	while( (child= 2 * i + 1) < reactor->ntimers){
+		if((child + 1) < reactor->ntimers && reactor->timers[child + 1]->expiry < reactor->timers[child]->expiry)
+			child++;
+
+		if(reactor->timers[i]->expiry <= reactor->timers[child]->expiry)
+			break;
+
+		reactor_timer_swap(reactor, i, child);
+		i= child;
+	}
+}
+
+
+/*
+ * Function: reactor_timer_set()
+ *
+ * (Re)schedules a timer to fire "nsecs" nanoseconds from now
+ */
+
+int reactor_timer_set(struct reactor *reactor, struct reactor_timer *timer, uint64_t nsecs){
+	struct reactor_timer	**timers;
+	unsigned int			maxtimers;
+
+	timer->expiry= monotonic_nsec() + nsecs;
+
+	if(timer->index == REACTOR_TIMER_INACTIVE){
+		if(reactor->ntimers >= reactor->maxtimers){
+			maxtimers= (reactor->maxtimers)?(reactor->maxtimers * 2):REACTOR_MIN_TIMERS;
+
+			if( (timers= realloc(reactor->timers, maxtimers * sizeof(struct reactor_timer *))) == NULL)
+				return(FAILURE);
+
+			reactor->timers= timers;
+			reactor->maxtimers= maxtimers;
+		}
+
+		timer->index= reactor->ntimers;
+		reactor->timers[reactor->ntimers]= timer;
+		reactor->ntimers++;
+	}
+
+	reactor_timer_sift(reactor, timer->index);
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: reactor_timer_cancel()
+ *
+ * Cancels a scheduled timer (cancelling an inactive timer is a no-op)
+ */
+
+void reactor_timer_cancel(struct reactor *reactor, struct reactor_timer *timer){
+	unsigned int	i;
+
+	if( (i= timer->index) == REACTOR_TIMER_INACTIVE)
+		return;
+
+	reactor->ntimers--;
+	timer->index= REACTOR_TIMER_INACTIVE;
+
+	if(i < reactor->ntimers){
+		reactor->timers[i]= reactor->timers[reactor->ntimers];
+		reactor->timers[i]->index= i;
+		reactor_timer_sift(reactor, i);
+	}
+}
+
+
+/*
+ * Function: reactor_stop()
+ *
+ * Makes reactor_run() return (typically called from a callback function)
+ */
+
+void reactor_stop(struct reactor *reactor){
+	reactor->stop_f= TRUE;
+}
+
+
+/*
+ * Function: reactor_run()
+ *
+ * Runs an event loop until reactor_stop() is called, or there are no registered descriptors
+ * and scheduled timers
+ */
+
+int reactor_run(struct reactor *reactor){
+	struct reactor_timer	*timer;
+	unsigned int			i, events;
+	int						n, fd;
+#ifdef __linux__
+	struct epoll_event		ev[REACTOR_MAX_EVENTS];
+	struct itimerspec		its;
+	uint64_t				expirations;
+#else
+	struct pollfd			*pfds;
+	unsigned int			npfds;
+	int						timeout;
+#endif
+
+	reactor->stop_f= FALSE;
+
+	while(!reactor->stop_f && (reactor->nregistered || reactor->ntimers)){
+#ifdef __linux__
+		/* The timerfd is (re)armed only when the earliest timer changes */
+		if(reactor->ntimers && reactor->timers[0]->expiry != reactor->tfd_expiry){
+			reactor->tfd_expiry= reactor->timers[0]->expiry;
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec= reactor->tfd_expiry / NSEC_PER_SEC;
+			its.it_value.tv_nsec= reactor->tfd_expiry % NSEC_PER_SEC;
+
+			if(timerfd_settime(reactor->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+				return(FAILURE);
+		}
+
+		if( (n= epoll_wait(reactor->epfd, ev, REACTOR_MAX_EVENTS, -1)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			return(FAILURE);
+		}
+
+		reactor->now= monotonic_nsec();
+
+		for(i=0; i < (unsigned int) n && !reactor->stop_f; i++){
+			fd= ev[i].data.fd;
+
+			if(fd == reactor->tfd){
+				if(read(reactor->tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					reactor->tfd_expiry= 0;
+
+				continue;
+			}
+
+			/* The descriptor might have been removed by a previous callback */
+			if((unsigned int) fd >= reactor->nfds || reactor->fds[fd].callback == NULL)
+				continue;
+
+			events= ((ev[i].events & EPOLLIN)?REACTOR_READ:0) | ((ev[i].events & EPOLLOUT)?REACTOR_WRITE:0) | \
+					((ev[i].events & (EPOLLERR | EPOLLHUP))?REACTOR_ERROR:0);
+
+			reactor->fds[fd].callback(reactor, fd, events, reactor->fds[fd].arg);
+		}
+#else
+		if( (pfds= realloc(reactor->pfds, (reactor->nregistered + 1) * sizeof(struct pollfd))) == NULL)
+			return(FAILURE);
+
+		reactor->pfds= pfds;
+		npfds= 0;
+
+		for(i=0; i < reactor->nfds; i++){
+			if(reactor->fds[i].callback == NULL)
+				continue;
+
+			pfds[npfds].fd= i;
+			pfds[npfds].events= ((reactor->fds[i].events & REACTOR_READ)?POLLIN:0) | ((reactor->fds[i].events & REACTOR_WRITE)?POLLOUT:0);
+			pfds[npfds].revents= 0;
+			npfds++;
+		}
+
+		if(reactor->ntimers){
+			reactor->now= monotonic_nsec();
+
+			/* Round up, such that timers are not fired early */
+			timeout= (reactor->timers[0]->expiry <= reactor->now)?0:((reactor->timers[0]->expiry - reactor->now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+		}
+		else{
+			timeout= -1;
+		}
+
+		if( (n= poll(pfds, npfds, timeout)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			return(FAILURE);
+		}
+
+		reactor->now= monotonic_nsec();
+
+		for(i=0; i < npfds && n > 0 && !reactor->stop_f; i++){
+			if(pfds[i].revents == 0)
+				continue;
+
+			n--;
+			fd= pfds[i].fd;
+
+			if(reactor->fds[fd].callback == NULL)
+				continue;
+
+			events= ((pfds[i].revents & POLLIN)?REACTOR_READ:0) | ((pfds[i].revents & POLLOUT)?REACTOR_WRITE:0) | \
+					((pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))?REACTOR_ERROR:0);
+
+			reactor->fds[fd].callback(reactor, fd, events, reactor->fds[fd].arg);
+		}
+#endif
+
+		/* Fire expired timers */
+		while(!reactor->stop_f && reactor->ntimers && reactor->timers[0]->expiry <= reactor->now){
+			timer= reactor->timers[0];
+			reactor_timer_cancel(reactor, timer);
+			timer->callback(reactor, timer->arg);
+		}
+	}
+
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: twheel_init()
+ *
+ * Initializes a hierarchical timing wheel with a specific tick length (in nanoseconds). "now" is
+ * the current monotonic time, which becomes tick 0 of the wheel
+ */
+
+void twheel_init(struct twheel *wheel, uint64_t tick, uint64_t now){
+	memset(wheel, 0, sizeof(struct twheel));
+	wheel->tick= (tick > 0)?tick:1;
+	wheel->base= now;
+	wheel->current= 0;
+}
+
+
+/*
+ * Function: twheel_link()
+ *
+ * Inserts an entry at the head of a (doubly-linked) list of timing wheel entries
+ */
+
+void twheel_link(struct twheel_entry **head, struct twheel_entry *entry){
+	entry->next= *head;
+
+	if(entry->next != NULL)
+		entry->next->pprev= &(entry->next);
+
+	entry->pprev= head;
+	*head= entry;
+}
+
+
+/*
+ * Function: twheel_unlink()
+ *
+ * Removes an entry from the list it is linked to (if any)
+ */
+
+void twheel_unlink(struct twheel_entry *entry){
+	if(entry->pprev == NULL)
+		return;
+
+	*(entry->pprev)= entry->next;
+
+	if(entry->next != NULL)
+		entry->next->pprev= entry->pprev;
+
+	entry->next= NULL;
+	entry->pprev= NULL;
+}
+
+
+/*
+ * Function: twheel_place()
+ *
+ * Links an entry to the wheel and slot that correspond to its expiry tick: the lowest wheel whose
+ * revolution covers the time remaining until the entry expires
+ */
+
+void twheel_place(struct twheel *wheel, struct twheel_entry *entry){
+	uint64_t		delta;
+	unsigned int	level;
+
+	delta= (entry->expiry > wheel->current)?(entry->expiry - wheel->current):0;
+
+	for(level=0; level < (TWHEEL_LEVELS - 1) && delta >= ((uint64_t) 1 << (TWHEEL_BITS * (level + 1))); level++);
+
+	twheel_link(&(wheel->slots[level][(entry->expiry >> (TWHEEL_BITS * level)) & TWHEEL_MASK]), entry);
+}
+
+
+/*
+ * Function: twheel_add()
+ *
+ * Schedules an entry to expire at a specific monotonic time (in nanoseconds). The entry must not
+ * be linked to any list. Events are never fired early, but may be fired up to one tick late
+ */
+
+void twheel_add(struct twheel *wheel, struct twheel_entry *entry, uint64_t when){
+	uint64_t	expiry;
+
+	expiry= (when > wheel->base)?((when - wheel->base + wheel->tick - 1) / wheel->tick):0;
+
+	if(expiry <= wheel->current)
+		expiry= wheel->current + 1;
+	else if((expiry - wheel->current) > TWHEEL_MAX_TICKS)
+		expiry= wheel->current + TWHEEL_MAX_TICKS;
+
+	entry->expiry= expiry;
+	twheel_place(wheel, entry);
+	wheel->n++;
+}
+
+
+/*
+ * Function: twheel_cancel()
+ *
+ * Cancels a scheduled entry (cancelling an entry that is not scheduled is a no-op)
+ */
+
+void twheel_cancel(struct twheel *wheel, struct twheel_entry *entry){
+	if(!TWHEEL_ENTRY_LINKED(entry))
+		return;
+
+	twheel_unlink(entry);
+	wheel->n--;
+}
+
+
+/*
+ * Function: twheel_cascade()
+ *
+ * Moves the entries of the current slot of a wheel to the wheels below it
+ */
+
+void twheel_cascade(struct twheel *wheel, unsigned int level){
+	struct twheel_entry		*pending, *entry;
+	unsigned int			slot;
+
+	slot= (wheel->current >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+
+	if( (pending= wheel->slots[level][slot]) == NULL)
+		return;
+
+	wheel->slots[level][slot]= NULL;
+	pending->pprev= &pending;
+
+	while( (entry= pending) != NULL){
+		twheel_unlink(entry);
+		twheel_place(wheel, entry);
+	}
+}
+
+
+/*
+ * Function: twheel_advance()
+ *
+ * Advances a timing wheel up to a specific monotonic time (in nanoseconds), calling "expire" for
+ * every entry that expires. The callback function may add or cancel entries. Returns the number
+ * of expired entries
+ */
+
+unsigned long twheel_advance(struct twheel *wheel, uint64_t now, void (*expire)(struct twheel *, struct twheel_entry *, void *), \
+				void *arg){
+	struct twheel_entry		*pending, *entry;
+	uint64_t				target;
+	unsigned long			nexpired=0;
+	unsigned int			level, slot;
+
+	if(now < wheel->base)
+		return(0);
+
+	target= (now - wheel->base) / wheel->tick;
+
+	while(wheel->current < target){
+		/* Nothing is scheduled: there is no need to walk the slots one by one */
+		if(wheel->n == 0){
+			wheel->current= target;
+			break;
+		}
+
+		wheel->current++;
+
+		/* When a wheel completes a revolution, the next slot of the wheel above it is cascaded */
+		for(level=1; level < TWHEEL_LEVELS && (wheel->current & (((uint64_t) 1 << (TWHEEL_BITS * level)) - 1)) == 0; level++)
+			twheel_cascade(wheel, level);
+
+		slot= wheel->current & TWHEEL_MASK;
+
+		if( (pending= wheel->slots[0][slot]) == NULL)
+			continue;
+
+		wheel->slots[0][slot]= NULL;
+		pending->pprev= &pending;
+
+		while( (entry= pending) != NULL){
+			twheel_unlink(entry);
+			wheel->n--;
+			nexpired++;
+			expire(wheel, entry, arg);
+		}
+	}
+
+	return(nexpired);
+}
+
+
+/*
+ * Function: twheel_next_expiry()
+ *
+ * Returns the monotonic time (in nanoseconds) at which twheel_advance() should be called next,
+ * or UINT64_MAX if no entries are scheduled
+ */
+
+uint64_t twheel_next_expiry(struct twheel *wheel){
+	uint64_t	t;
+
+	if(wheel->n == 0)
+		return(UINT64_MAX);
+
+	/* The next non-empty slot of the lowest wheel, or the next cascade (whichever comes first) */
+	for(t= wheel->current + 1; (t & TWHEEL_MASK) != 0 && wheel->slots[0][t & TWHEEL_MASK] == NULL; t++);
+
+	return(wheel->base + t * wheel->tick);
+}
+
+
+/*
+ * Function: rtt_init()
+ *
+ * Initializes a round-trip time estimator, with the RTO employed until the first sample arrives
+ */
+
+void rtt_init(struct rtt_estimator *rtt, uint64_t initial){
+	rtt->srtt= 0;
+	rtt->rttvar= 0;
+	rtt->rto= initial;
+	rtt->nsamples= 0;
+}
+
+
+/*
+ * Function: rtt_sample()
+ *
+ * Updates a round-trip time estimator with a new measurement (in nanoseconds). As per Karn's
+ * algorithm, the caller must not feed measurements from requests that were retransmitted
+ */
+
+void rtt_sample(struct rtt_estimator *rtt, uint64_t r){
+	uint64_t	delta;
+
+	if(rtt->nsamples == 0){
+		rtt->srtt= r;
+		rtt->rttvar= r / 2;
+	}
+	else{
+		delta= (rtt->srtt > r)?(rtt->srtt - r):(r - rtt->srtt);
+
+		/* RTTVAR= 3/4 * RTTVAR + 1/4 * |SRTT - R|, and SRTT= 7/8 * SRTT + 1/8 * R */
+		rtt->rttvar= rtt->rttvar - (rtt->rttvar >> 2) + (delta >> 2);
+		rtt->srtt= rtt->srtt - (rtt->srtt >> 3) + (r >> 3);
+	}
+
+	rtt->nsamples++;
+	rtt->rto= rtt->srtt + (((rtt->rttvar << 2) > RTO_GRANULARITY)?(rtt->rttvar << 2):RTO_GRANULARITY);
+
+	if(rtt->rto < RTO_MIN)
+		rtt->rto= RTO_MIN;
+	else if(rtt->rto > RTO_MAX)
+		rtt->rto= RTO_MAX;
+}
+
+
+/*
+ * Function: rtt_rto()
+ *
+ * Obtains the retransmission timeout (in nanoseconds) after "nbackoff" consecutive timeouts,
+ * i.e., the current RTO with exponential backoff (capped at RTO_MAX)
+ */
+
+uint64_t rtt_rto(struct rtt_estimator *rtt, unsigned int nbackoff){
+	uint64_t	rto;
+
+	for(rto= rtt->rto; nbackoff > 0 && rto < RTO_MAX; nbackoff--)
+		rto<<= 1;
+
+	return( (rto < RTO_MAX)?rto:RTO_MAX);
+}
+
+
+/*
+ * Function: quiescence_init()
+ *
+ * Initializes the detector of the end of a round of responses. "threshold" is the probability of
+ * a further response below which the round is considered to be over, and "now" is the time at
+ * which the round started
+ */
+
+void quiescence_init(struct quiescence *quiet, double threshold, uint64_t now){
+	quiet->last= now;
+	quiet->gap= 0;
+	quiet->n= 0;
+	quiet->threshold= (threshold > 0 && threshold < 1)?threshold:QUIESCENCE_THRESHOLD;
+}
+
+
+/*
+ * Function: quiescence_event()
+ *
+ * Records the arrival of a response (at monotonic time "now", in nanoseconds)
+ */
+
+void quiescence_event(struct quiescence *quiet, uint64_t now){
+	double	gap;
+
+	gap= (now > quiet->last)?(double) (now - quiet->last):0;
+
+	/* Arrivals become sparser as a round winds down: recent gaps are given more weight */
+	if(quiet->n == 0)
+		quiet->gap= gap;
+	else
+		quiet->gap= quiet->gap + (gap - quiet->gap) / 4;
+
+	quiet->last= now;
+	quiet->n++;
+}
+
+
+/*
+ * Function: quiescence_deadline()
+ *
+ * Obtains the time at which a round of responses can be considered to be over: when, given the
+ * observed inter-arrival times, the probability of a further response drops below the threshold.
+ * The result is clamped to [floor, cap] (absolute monotonic times, in nanoseconds). Without any
+ * responses, there is nothing to estimate from, and "cap" is returned
+ */
+
+uint64_t quiescence_deadline(struct quiescence *quiet, uint64_t floor, uint64_t cap){
+	uint64_t	deadline;
+	double		idle;
+
+	if(quiet->n == 0)
+		return(cap);
+
+	/* P(gap > t)= exp(-t/mean) < threshold, i.e., t > mean * ln(1/threshold) */
+	idle= quiet->gap * log(1 / quiet->threshold);
+
+	if(idle >= (double) (cap - MIN(cap, quiet->last)))
+		return(cap);
+
+	deadline= quiet->last + (uint64_t) idle;
+
+	if(deadline < floor)
+		deadline= floor;
+
+	return( (deadline < cap)?deadline:cap);
+}
+
+
+/*
+ * Function: udp_session_init()
+ *
+ * Initializes a session that sends a request over socket "fd" (up to "ntrans" times, with an initial
+ * RTO of "rto"), and processes responses until "timeout" nanoseconds after the last transmission
+ * (or earlier, once further responses become unlikely according to "threshold")
+ */
+
+int udp_session_init(struct udp_session *session, int fd, unsigned int ntrans, uint64_t rto, uint64_t timeout, double threshold, \
+					 void (*send)(struct udp_session *, int), unsigned int (*receive)(struct udp_session *, int), void *arg){
+	memset(session, 0, sizeof(struct udp_session));
+	session->fd= fd;
+	session->ntrans= (ntrans > 0)?ntrans:1;
+	session->timeout= timeout;
+	session->send= send;
+	session->receive= receive;
+	session->arg= arg;
+	rtt_init(&(session->rtt), rto);
+
+	/* The first request is sent as soon as the socket is writable */
+	if(!reactor_init(&(session->reactor)))
+		return(FAILURE);
+
+	if(!reactor_add(&(session->reactor), fd, REACTOR_READ | REACTOR_WRITE, udp_session_io, session)){
+		reactor_destroy(&(session->reactor));
+		return(FAILURE);
+	}
+
+	reactor_timer_init(&(session->rtx_timer), udp_session_retransmit, session);
+	reactor_timer_init(&(session->end_timer), udp_session_end, session);
+	quiescence_init(&(session->quiet), threshold, monotonic_nsec());
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: udp_session_add()
+ *
+ * Adds a socket on which responses to the request of a session may (also) arrive
+ */
+
+int udp_session_add(struct udp_session *session, int fd){
+	return(reactor_add(&(session->reactor), fd, REACTOR_READ, udp_session_io, session));
+}
+
+
+/*
+ * Function: udp_session_run()
+ *
+ * Runs a session until the response timeout expires, and releases its event loop
+ */
+
+int udp_session_run(struct udp_session *session){
+	int		r;
+
+	r= reactor_run(&(session->reactor));
+	reactor_destroy(&(session->reactor));
+	return(r && !session->error_f);
+}
+
+
+/*
+ * Function: udp_session_io()
+ *
+ * Event loop callback for the sockets of a session
+ */
+
+void udp_session_io(struct reactor *reactor, int fd, unsigned int events, void *arg){
+	struct udp_session	*session= arg;
+	unsigned int		i, n;
+
+	if(events & REACTOR_ERROR){
+		session->error_f= TRUE;
+		reactor_stop(reactor);
+		return;
+	}
+
+	if(events & REACTOR_READ){
+		n= session->receive(session, fd);
+
+		for(i=0; i < n; i++)
+			quiescence_event(&(session->quiet), reactor->now);
+
+		/*
+		   Responses to retransmitted requests are ambiguous, and are not employed for measuring the RTT.
+		   Only the first response to the request is a sample: later ones (e.g. from other devices) do
+		   not measure the round-trip time
+		 */
+		if(n && session->retrans == 1 && !session->sampled_f){
+			rtt_sample(&(session->rtt), reactor->now - session->sent);
+			session->sampled_f= TRUE;
+		}
+
+		/* Responses to the last request may make the end of the session closer */
+		if(n && session->retrans >= session->ntrans)
+			udp_session_schedule_end(session);
+	}
+
+	if((events & REACTOR_WRITE) && fd == session->fd){
+		session->send(session, fd);
+		session->retrans++;
+		session->sent= monotonic_nsec();
+		session->sampled_f= FALSE;
+
+		/* Wait for the next retransmission or, after the last one, for any remaining responses */
+		reactor_set_events(reactor, fd, REACTOR_READ);
+
+		if(session->retrans >= session->ntrans)
+			udp_session_schedule_end(session);
+		else
+			reactor_timer_set(reactor, &(session->rtx_timer), rtt_rto(&(session->rtt), session->retrans - 1));
+	}
+}
+
+
+/*
+ * Function: udp_session_retransmit()
+ *
+ * Event loop timer callback that triggers a retransmission of the request
+ */
+
+void udp_session_retransmit(struct reactor *reactor, void *arg){
+	struct udp_session	*session= arg;
+
+	reactor_set_events(reactor, session->fd, REACTOR_READ | REACTOR_WRITE);
+}
+
+
+/*
+ * Function: udp_session_schedule_end()
+ *
+ * (Re)schedules the end of a session after the last request has been sent: once further
+ * responses become unlikely, but no earlier than one RTO and no later than the response timeout
+ */
+
+void udp_session_schedule_end(struct udp_session *session){
+	uint64_t	rto, deadline, now;
+
+	rto= rtt_rto(&(session->rtt), 0);
+	deadline= quiescence_deadline(&(session->quiet), session->sent + rto, session->sent + MAX(session->timeout, rto));
+	now= monotonic_nsec();
+	reactor_timer_set(&(session->reactor), &(session->end_timer), (deadline > now)?(deadline - now):0);
+}
+
+
+/*
+ * Function: udp_session_end()
+ *
+ * Event loop timer callback that ends a session once the response timeout has expired
+ */
+
+void udp_session_end(struct reactor *reactor, void *arg){
+	reactor_stop(reactor);
+}
+
+
+/*
+ * Function: create_ring()
+ *
+ * Allocates a ring of (at least) "size" records of "reclen" bytes each
+ */
+
+int create_ring(struct ring *ring, unsigned int size, size_t reclen){
+	memset(ring, 0, sizeof(struct ring));
+
+	for(ring->size=1; ring->size < size; ring->size <<= 1);
+
+	ring->mask= ring->size - 1;
+	ring->reclen= reclen;
+
+	if( (ring->buff= malloc(ring->size * reclen)) == NULL)
+		return(FAILURE);
+
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: destroy_ring()
+ *
+ * Releases the memory employed by a ring
+ */
+
+void destroy_ring(struct ring *ring){
+	free(ring->buff);
+	memset(ring, 0, sizeof(struct ring));
+}
+
+
+/*
+ * Function: ring_reserve()
+ *
+ * Obtains the next free record of a ring (producer side), which is made visible to the consumer
+ * with ring_commit(). When the ring is full, the record is dropped (NULL is returned) unless
+ * "wait_f" is set, in which case the producer waits for the consumer to make room
+ */
+
+void *ring_reserve(struct ring *ring, unsigned int wait_f){
+	struct timespec	ts;
+	uint64_t		start;
+
+	if( (ring->head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)) < ring->size)
+		return(RING_RECORD(ring, ring->head));
+
+	if(!wait_f){
+		ring->ndropped++;
+		return(NULL);
+	}
+
+	start= monotonic_nsec();
+	ts.tv_sec= 0;
+	ts.tv_nsec= RING_WAIT_INTERVAL;
+
+	while( (ring->head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)) >= ring->size)
+		nanosleep(&ts, NULL);
+
+	ring->blocked+= monotonic_nsec() - start;
+	return(RING_RECORD(ring, ring->head));
+}
+
+
+/*
+ * Function: ring_commit()
+ *
+ * Publishes the record obtained with ring_reserve()
+ */
+
+void ring_commit(struct ring *ring){
+	__atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Function: ring_peek()
+ *
+ * Obtains the oldest record of a ring (consumer side), or NULL if the ring is empty. The record
+ * is handed back to the producer with ring_release()
+ */
+
+void *ring_peek(struct ring *ring){
+	if(ring->tail == __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE))
+		return(NULL);
+
+	return(RING_RECORD(ring, ring->tail));
+}
+
+
+/*
+ * Function: ring_release()
+ *
+ * Hands the record obtained with ring_peek() back to the producer
+ */
+
+void ring_release(struct ring *ring){
+	__atomic_store_n(&(ring->tail), ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ * Function: json_classify()
+ *
+ * Obtains the bitmasks of quotes, backslashes, structural characters ({, }, [, ], : and ,) and
+ * whitespace of a block of JSON_BLOCK bytes (bit i corresponds to byte i)
+ */
+
+void json_classify(unsigned char *p, uint64_t *quote, uint64_t *bs, uint64_t *op, uint64_t *ws){
+	uint64_t		bit;
+	unsigned int	i;
+
+	*quote= *bs= *op= *ws= 0;
+
+	for(i=0; i < JSON_BLOCK; i++){
+		bit= (uint64_t) 1 << i;
+
+		switch(p[i]){
+			case '"':
+				*quote|= bit;
+				break;
+
+			case '\\':
+				*bs|= bit;
+				break;
+
+			case '{':
+			case '}':
+			case '[':
+			case ']':
+			case ':':
+			case ',':
+				*op|= bit;
+				break;
+
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				*ws|= bit;
+				break;
+		}
+	}
+}
+
+
+#ifdef X86_SIMD
+/*
+ * Function: json_classify_sse2()
+ *
+ * Obtains the bitmasks of a block (see json_classify()) 16 bytes at a time. Setting bit 0x20
+ * maps '[' and ']' to '{' and '}', respectively
+ */
+
+void json_classify_sse2(unsigned char *p, uint64_t *quote, uint64_t *bs, uint64_t *op, uint64_t *ws){
+	__m128i			v, lower;
+	unsigned int	i;
+
+	*quote= *bs= *op= *ws= 0;
+
+	for(i=0; i < JSON_BLOCK; i+= 16){
+		v= _mm_loadu_si128((__m128i *) (p + i));
+		lower= _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+		*quote|= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+		*bs|= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+		*op|= (uint64_t) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), \
+				_mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))), _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), \
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(','))))) << i;
+		*ws|= (uint64_t) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), \
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))), _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), \
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))))) << i;
+	}
+}
+
+
+/*
+ * Function: json_classify_avx2()
+ *
+ * Obtains the bitmasks of a block (see json_classify_sse2()) 32 bytes at a time
+ */
+
+__attribute__((target("avx2"))) void json_classify_avx2(unsigned char *p, uint64_t *quote, uint64_t *bs, uint64_t *op, uint64_t *ws){
+	__m256i			v, lower;
+	unsigned int	i;
+
+	*quote= *bs= *op= *ws= 0;
+
+	for(i=0; i < JSON_BLOCK; i+= 32){
+		v= _mm256_loadu_si256((__m256i *) (p + i));
+		lower= _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+		*quote|= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+		*bs|= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+		*op|= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), \
+				_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))), _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), \
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))))) << i;
+		*ws|= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), \
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))), _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), \
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))) << i;
+	}
+}
+#endif
+
+
+/*
+ * Function: prefix_xor()
+ *
+ * Computes the XOR of each bit with all the lower bits (i.e., marks the bytes between pairs of quotes)
+ */
+
+uint64_t prefix_xor(uint64_t x){
+	x^= x << 1;
+	x^= x << 2;
+	x^= x << 4;
+	x^= x << 8;
+	x^= x << 16;
+	x^= x << 32;
+	return(x);
+}
+
+
+/*
+ * Function: json_scanner_init()
+ *
+ * Prepares for locating the structural characters of a JSON document
+ */
+
+void json_scanner_init(struct json_scanner *sc, char *s, size_t len){
+	memset(sc, 0, sizeof(struct json_scanner));
+	sc->s= s;
+	sc->len= len;
+	sc->classify= json_classify;
+
+#ifdef X86_SIMD
+	switch(simd_level()){
+		case SIMD_AVX2:
+			sc->classify= json_classify_avx2;
+			break;
+
+		case SIMD_SSE2:
+			sc->classify= json_classify_sse2;
+			break;
+	}
+#endif
+}
+
+
+/*
+ * Function: json_index_block()
+ *
+ * Locates the structural characters of the next block of a document: the structural characters
+ * that are not within strings, the quotes that delimit strings, and the first byte of primitives
+ * (numbers, true, false and null). Escaped characters, and whether the block starts within a
+ * string, are computed with carry-free bit arithmetic rather than byte by byte
+ */
+
+void json_index_block(struct json_scanner *sc){
+	unsigned char	pad[JSON_BLOCK], *p;
+	uint64_t		quote, bs, op, ws, escaped, escape, code, instring, scalar;
+
+	p= (unsigned char *) sc->s + sc->next;
+
+	/* The last block is padded with whitespace */
+	if((sc->len - sc->next) < JSON_BLOCK){
+		memset(pad, ' ', sizeof(pad));
+		memcpy(pad, p, sc->len - sc->next);
+		p= pad;
+	}
+
+	sc->classify(p, &quote, &bs, &op, &ws);
+
+	/* A character is escaped if it follows an odd-length run of backslashes */
+	if(bs == 0){
+		escaped= sc->escaped;
+		sc->escaped= 0;
+	}
+	else{
+		code= ((((bs & ~sc->escaped) << 1) | JSON_ODD_BITS) - (bs & ~sc->escaped)) ^ JSON_ODD_BITS;
+		escaped= code ^ (bs | sc->escaped);
+		escape= code & bs;
+		sc->escaped= escape >> 63;
+	}
+
+	/* The bytes from an opening quote to the byte before the closing one are within a string */
+	quote&= ~escaped;
+	instring= prefix_xor(quote) ^ sc->instring;
+	sc->instring= (instring >> 63)?~((uint64_t) 0):0;
+
+	scalar= ~(op | ws | quote | instring);
+	sc->bits= (op & ~instring) | quote | (scalar & ~((scalar << 1) | sc->scalar));
+	sc->ends= ~scalar & ((scalar << 1) | sc->scalar);
+	sc->scalar= scalar >> 63;
+	sc->base= sc->next;
+	sc->next+= JSON_BLOCK;
+}
+
+
+/*
+ * Function: json_next_structural()
+ *
+ * Obtains the position of the next structural character of a document, or JSON_END if there are no more.
+ * The position of the opening quote of a string is followed by that of the closing one
+ */
+
+size_t json_next_structural(struct json_scanner *sc){
+	size_t	i;
+
+	while(sc->bits == 0){
+		if(sc->next >= sc->len)
+			return(JSON_END);
+
+		json_index_block(sc);
 	}
-*/
 
-	if(sizeof(struct json) < ( ( (2 + 2 * MAX_JSON_ITEMS) * sizeof(unsigned int)) + (2 * MAX_JSON_ITEMS * sizeof(char *)))){
-/*puts("Tamanio pequenio"); */
-		free(json);
-		return(NULL);
-	}
+	i= sc->base + __builtin_ctzll(sc->bits);
+	sc->bits&= sc->bits - 1;
+	return(i);
+}
+
+
+/*
+ * Function: json_primitive_end()
+ *
+ * Obtains the end (the position of the first byte past the end) of the primitive whose first byte
+ * was the last position returned by json_next_structural()
+ */
+
+size_t json_primitive_end(struct json_scanner *sc){
+	size_t	i;
+
+	/* The primitive spans the rest of the block, and hence no structural characters are left in it */
+	while(sc->ends == 0){
+		if(sc->next >= sc->len)
+			return(sc->len);
 
-/*puts("Voy a inicializar"); */
-	json->nitem=0;
-	json->maxitems= MAX_JSON_ITEMS;
-	
-	for(i=0; i<MAX_JSON_ITEMS; i++){
-		json->key[i]=NULL;
-		json->key_l[i]=0;
-		json->value[i]=NULL;
-		json->value_l[i]=0;
+		json_index_block(sc);
 	}
 
-/*puts("Ya vuelvo");*/
-	return(json);
+	i= sc->base + __builtin_ctzll(sc->ends);
+	sc->ends&= sc->ends - 1;
+	return((i < sc->len)?i:sc->len);
 }
 
 
+/*
+ * Function: json_check_structural()
+ *
+ * Checks a structural character (or the first byte of a string or primitive) against what is expected
+ * next within the enclosing object or array ("obj_f" tells which), and updates the expectation.
+ * The caller must check that closing braces and brackets match the enclosing object or array
+ */
+
+int json_check_structural(unsigned int *expect, char c, unsigned int obj_f){
+	switch(c){
+		case '{':
+		case '[':
+			if(*expect != JSON_EXPECT_VALUE && *expect != JSON_EXPECT_VALUE_OR_END)
+				return(FAILURE);
+
+			*expect= (c == '{')?JSON_EXPECT_KEY_OR_END:JSON_EXPECT_VALUE_OR_END;
+			break;
+
+		case '}':
+			if(*expect != JSON_EXPECT_KEY_OR_END && *expect != JSON_EXPECT_COMMA_OR_END)
+				return(FAILURE);
+
+			*expect= JSON_EXPECT_COMMA_OR_END;
+			break;
+
+		case ']':
+			if(*expect != JSON_EXPECT_VALUE_OR_END && *expect != JSON_EXPECT_COMMA_OR_END)
+				return(FAILURE);
+
+			*expect= JSON_EXPECT_COMMA_OR_END;
+			break;
+
+		case ':':
+			if(*expect != JSON_EXPECT_COLON)
+				return(FAILURE);
+
+			*expect= JSON_EXPECT_VALUE;
+			break;
+
+		case ',':
+			if(*expect != JSON_EXPECT_COMMA_OR_END)
+				return(FAILURE);
+
+			*expect= obj_f?JSON_EXPECT_KEY:JSON_EXPECT_VALUE;
+			break;
+
+		case '"':
+			if(*expect == JSON_EXPECT_KEY || *expect == JSON_EXPECT_KEY_OR_END)
+				*expect= JSON_EXPECT_COLON;
+			else if(*expect == JSON_EXPECT_VALUE || *expect == JSON_EXPECT_VALUE_OR_END)
+				*expect= JSON_EXPECT_COMMA_OR_END;
+			else
+				return(FAILURE);
+
+			break;
+
+		default:
+			if(*expect != JSON_EXPECT_VALUE && *expect != JSON_EXPECT_VALUE_OR_END)
+				return(FAILURE);
+
+			*expect= JSON_EXPECT_COMMA_OR_END;
+			break;
+	}
+
+	return(SUCCESS);
+}
+
 
 /*
- * Function: json_free_struct()
+ * Function: json_tokenize()
  *
- * Obtains the first-level JSON objects
+ * Tokenizes a JSON document in a single pass over its structural characters (see json_next_structural()),
+ * recording the span of each value in the array of tokens. Only the first value of the document is
+ * tokenized (i.e., trailing data is ignored).
+ * Returns the number of tokens, or -1 if the document is malformed or there are too many tokens
  */
 
-int json_free_struct(struct json *json){
-	unsigned int i;
+int json_tokenize(char *s, size_t len, struct json_token *tokens, unsigned int max){
+	struct json_scanner	sc;
+	unsigned int		stack[JSON_MAX_DEPTH];
+	unsigned int		depth=0, ntokens=0, t, expect=JSON_EXPECT_VALUE;
+	size_t				i, j;
 
-	/* XXX: Minimal check on the size of struct json
-		We have: 2 unsignet int, 2 arrays of MAX_ITEMS of unsigned in, 2 arrays of MAX_ITEMS of char *
-	*/
+	if(len > UINT_MAX)
+		return(-1);
 
-	if(sizeof(struct json) < (((2+ 2 * MAX_JSON_ITEMS) * sizeof(unsigned int)) + (2* MAX_JSON_ITEMS * sizeof(char *))))
-		return(FALSE);
+	json_scanner_init(&sc, s, len);
 
-	json->nitem=0;
-	json->maxitems= MAX_JSON_ITEMS;
-	
-	for(i=0; i<MAX_JSON_ITEMS; i++){
-		if(json->key[i]==NULL){
-			free(json->key[i]);
-		}
-		if(json->value[i]==NULL){
-			free(json->value[i]);
+	while( (i=json_next_structural(&sc)) != JSON_END){
+		/* Separators are validated, and key strings are told apart from values */
+		if(!json_check_structural(&expect, s[i], depth > 0 && tokens[stack[depth - 1]].type == JSON_OBJECT))
+			return(-1);
+
+		switch(s[i]){
+			case ':':
+			case ',':
+				continue;
+
+			case '{':
+			case '[':
+				if(ntokens >= max || depth >= JSON_MAX_DEPTH)
+					return(-1);
+
+				tokens[ntokens].type= (s[i] == '{')?JSON_OBJECT:JSON_ARRAY;
+				tokens[ntokens].start= i;
+				stack[depth++]= ntokens++;
+				continue;
+
+			case '}':
+			case ']':
+				if(depth == 0)
+					return(-1);
+
+				t= stack[--depth];
+
+				if(tokens[t].type != ((s[i] == '}')?JSON_OBJECT:JSON_ARRAY))
+					return(-1);
+
+				tokens[t].len= i + 1 - tokens[t].start;
+				tokens[t].next= ntokens;
+				break;
+
+			case '"':
+				/* Unterminated strings are detected here */
+				if( (j=json_next_structural(&sc)) == JSON_END || ntokens >= max)
+					return(-1);
+
+				tokens[ntokens].type= JSON_STRING;
+				tokens[ntokens].start= i + 1;
+				tokens[ntokens].len= j - i - 1;
+				tokens[ntokens].next= ntokens + 1;
+				ntokens++;
+				break;
+
+			default:
+				if(s[i] == 0x00 || ntokens >= max)
+					return(-1);
+
+				j= json_primitive_end(&sc);
+				tokens[ntokens].type= JSON_PRIMITIVE;
+				tokens[ntokens].start= i;
+				tokens[ntokens].len= j - i;
+				tokens[ntokens].next= ntokens + 1;
+				ntokens++;
+				break;
 		}
+
+		/* The first value of the document is complete */
+		if(depth == 0)
+			return(ntokens);
 	}
 
-	free(json);
+	return(-1);
+}
 
-	return(TRUE);
+
+/*
+ * Function: json_parse()
+ *
+ * Tokenizes a JSON document whose first value is an object, and sets up a view of such object
+ */
+
+int json_parse(struct json *json, char *s, size_t len, struct json_token *tokens, unsigned int max){
+	int		n;
+
+	if(s == NULL || (n=json_tokenize(s, len, tokens, max)) <= 0 || tokens[0].type != JSON_OBJECT)
+		return(FAILURE);
+
+	json->s= s;
+	json->tokens= tokens;
+	json->ntokens= n;
+	json->obj= 0;
+	return(SUCCESS);
 }
 
 
+/* Known keys (in the order of their JSON_KEY_* constants) */
+static const char *json_known_keys[JSON_NUM_KEYS]={
+	"system", "get_sysinfo", "emeter", "get_realtime", "err_code", "err_msg", "sw_ver", "hw_ver",
+	"type", "mic_type", "model", "mac", "mic_mac", "dev_name", "alias", "relay_state", "on_time",
+	"active_mode", "feature", "updating", "icon_hash", "rssi", "led_off", "longitude", "latitude",
+	"longitude_i", "latitude_i", "hwId", "fwId", "oemId", "deviceId", "current", "voltage",
+	"power", "total", "current_ma", "voltage_mv", "power_mw", "total_wh", "next_action",
+	"ntc_state", "status"
+};
+
+/* Known key for each value of the top JSON_KEY_BITS of json_key_hash(key, len, JSON_KEY_SEED) */
+static const unsigned char json_key_slots[1 << JSON_KEY_BITS]={
+	255,   9, 255,  15,   1, 255, 255,   0, 255, 255,  37, 255, 255,   6, 255, 255,
+	 27, 255, 255,  40,  33, 255, 255,  13, 255, 255, 255, 255,   8, 255, 255,  25,
+	255,  35, 255, 255, 255, 255, 255, 255, 255, 255, 255,  12, 255, 255,   3, 255,
+	255, 255, 255, 255,  38,   5, 255, 255, 255, 255, 255,  32, 255,  20, 255, 255,
+	  2, 255,  19, 255, 255, 255, 255, 255, 255,  21, 255,  28, 255,  18,  36, 255,
+	  4,  30, 255, 255,  34, 255, 255, 255,  29, 255,  41,  23, 255,   7, 255, 255,
+	255, 255,  39, 255, 255, 255, 255,  22,  31,  17, 255, 255,  10, 255,  16, 255,
+	255, 255, 255, 255,  26,  24,  14, 255, 255, 255, 255, 255, 255, 255,  11, 255
+};
 
 
 /*
- * Function: json_add_item()
+ * Function: json_key_hash()
  *
- * Add an item to a struct json
+ * Computes the FNV-1a hash of a key (with a given offset basis)
  */
 
-unsigned int json_add_item(struct json *json, char *kstart, unsigned int klen, char *vstart, unsigned int vlen){
-	if(json->nitem >= json->maxitems)
-		return(FALSE);
-
-	if(  (json->key[json->nitem]= malloc(klen+1)) == NULL){
-		return(FALSE);
-	}
+uint32_t json_key_hash(char *s, size_t len, uint32_t h){
+	size_t	i;
 
-	if(  (json->value[json->nitem]= malloc(vlen+1)) == NULL){
-		free(json->key[json->nitem]);
-		return(FALSE);
+	for(i=0; i < len; i++){
+		h^= (unsigned char) s[i];
+		h*= 16777619;
 	}
 
-	memcpy(json->key[json->nitem], kstart, klen);
-	*(json->key[json->nitem]+klen)= 0x00;	/* Null terminate the string if we mean to print it */
-	json->key_l[json->nitem]= klen;
-	memcpy(json->value[json->nitem], vstart, vlen);
-	json->value_l[json->nitem]= vlen;
-	*(json->value[json->nitem]+vlen)= 0x00;	/* Null terminate the string if we mean to print it */
-	json->nitem++;
-	
-	return(TRUE);
+	return(h);
 }
 
 
+/*
+ * Function: json_known_key()
+ *
+ * Looks up a key among the known keys with a perfect hash (a single comparison is needed to
+ * rule out other keys). Returns the JSON_KEY_* constant of the key, or -1 if it is not known
+ */
+
+int json_known_key(char *s, size_t len){
+	unsigned int	k;
+
+	k= json_key_slots[json_key_hash(s, len, JSON_KEY_SEED) >> (32 - JSON_KEY_BITS)];
+
+	if(k == JSON_KEY_NONE || strlen(json_known_keys[k]) != len || memcmp(json_known_keys[k], s, len) != 0)
+		return(-1);
+
+	return(k);
+}
 
 
 /*
- * Function: json_print_objects()
+ * Function: json_find_key()
  *
- * Add an item to a struct json
+ * Looks up a key among the members of an object. Returns the token of the value, or 0 if the
+ * key is not found (the first token is always the object of the whole document)
  */
 
-void json_print_objects(struct json *json){
-	unsigned int i;
+unsigned int json_find_key(struct json *json, char *key){
+	struct json_token	*tokens= json->tokens;
+	unsigned int		i, end;
+	size_t				klen;
 
-	for(i=0; i < json->nitem; i++){
-		printf("%s: %s\n", json->key[i], json->value[i]);
+	klen= strlen(key);
+	end= tokens[json->obj].next;
+
+	/* Members are key-value pairs, and values are skipped along with all their members */
+	for(i= json->obj + 1; (i + 1) < end; i= tokens[i + 1].next){
+		if(tokens[i].type == JSON_STRING && tokens[i].len == klen && memcmp(json->s + tokens[i].start, key, klen) == 0)
+			return(i + 1);
 	}
+
+	return(0);
 }
 
 
 /*
  * Function: json_get_value()
  *
- * Obtain the value for a given key
+ * Obtain the value for a given key (the span of the value, without the quotes of strings)
  */
 
 unsigned int json_get_value(struct json *json, struct json_value *json_value, char *key){
-	unsigned int i, klen;
+	unsigned int	t;
+
+	if( (t=json_find_key(json, key)) == 0)
+		return(FALSE);
+
+	json_value->value= json->s + json->tokens[t].start;
+	json_value->len= json->tokens[t].len;
+	return(TRUE);
+}
+
+
+/*
+ * Function: json_get_object()
+ *
+ * Sets up a view of the object that is the value of a given key
+ */
+
+unsigned int json_get_object(struct json *json, struct json *child, char *key){
+	unsigned int	t;
+
+	if( (t=json_find_key(json, key)) == 0 || json->tokens[t].type != JSON_OBJECT)
+		return(FALSE);
+
+	*child= *json;
+	child->obj= t;
+	return(TRUE);
+}
+
+
+
+/*
+ * Function: json_get_paths()
+ *
+ * Resolves a batch of dotted paths of object members (e.g. "system.get_sysinfo.alias") in a single
+ * scan of the structural characters of a JSON document, which ends as soon as all of them have been
+ * resolved. The value of each path found is stored (as a span, without the quotes of strings) in the
+ * corresponding entry of "values", while the entries of the remaining paths are left untouched. As with
+ * json_find_key(), the first of duplicate keys wins (and paths of more than JSON_MAX_DEPTH components are
+ * never found). Returns the number of paths found, or -1 if the document is malformed before they were resolved
+ */
+
+int json_get_paths(char *s, size_t len, char **paths, struct json_value *values, unsigned int npaths){
+	char			*comp[JSON_MAX_PATHS][JSON_MAX_DEPTH];
+	size_t			complen[JSON_MAX_PATHS][JSON_MAX_DEPTH];
+	int				compkey[JSON_MAX_PATHS][JSON_MAX_DEPTH];	/* Known key of each component (-1 if none) */
+	unsigned int	ncomp[JSON_MAX_PATHS];
+	unsigned int	matched[JSON_MAX_PATHS];	/* Leading components matched by the keys of the current value */
+	unsigned int	pending[JSON_MAX_PATHS];	/* Depth of an object or array whose end is pending (0 if none) */
+	unsigned char	done_f[JSON_MAX_PATHS];		/* The path has been located, or cannot be found */
+	unsigned char	obj_f[JSON_MAX_DEPTH + 1], key_f;
+	size_t			start[JSON_MAX_DEPTH + 1];
+	struct json_scanner	sc;
+	char			*key=NULL, *c;
+	size_t			klen=0, i, j, vstart, vlen;
+	unsigned int	depth=0, nfound=0, ndone=0, npending=0, p, expect=JSON_EXPECT_VALUE;
+	int				kkey=-1;
+
+	if(npaths > JSON_MAX_PATHS)
+		return(-1);
+
+	for(p=0; p < npaths; p++){
+		for(ncomp[p]=0, c= paths[p]; ncomp[p] < JSON_MAX_DEPTH; ncomp[p]++){
+			comp[p][ncomp[p]]= c;
+
+			if( (c=strchr(c, '.')) == NULL){
+				complen[p][ncomp[p]]= strlen(comp[p][ncomp[p]]);
+				compkey[p][ncomp[p]]= json_known_key(comp[p][ncomp[p]], complen[p][ncomp[p]]);
+				ncomp[p]++;
+				break;
+			}
+
+			complen[p][ncomp[p]]= c - comp[p][ncomp[p]];
+			compkey[p][ncomp[p]]= json_known_key(comp[p][ncomp[p]], complen[p][ncomp[p]]);
+			c++;
+		}
+
+		matched[p]= 0;
+		pending[p]= 0;
+		done_f[p]= FALSE;
+
+		/* Paths with more components than nesting levels are allowed cannot be found (rather than truncated) */
+		if(c != NULL){
+			done_f[p]= TRUE;
+			ndone++;
+		}
+	}
+
+	json_scanner_init(&sc, s, len);
+
+	while( (i=json_next_structural(&sc)) != JSON_END){
+		key_f= (expect == JSON_EXPECT_KEY || expect == JSON_EXPECT_KEY_OR_END);
+
+		if(!json_check_structural(&expect, s[i], depth > 0 && obj_f[depth]))
+			return(-1);
+
+		switch(s[i]){
+			case ':':
+			case ',':
+				continue;
+
+			case '}':
+			case ']':
+				if(depth == 0 || obj_f[depth] != (s[i] == '}'))
+					return(-1);
+
+				for(p=0; p < npaths && npending; p++){
+					if(pending[p] == depth){
+						values[p].len= i + 1 - start[depth];
+						pending[p]= 0;
+						npending--;
+						nfound++;
+					}
+				}
+
+				/* The document (i.e., its first value) is complete */
+				if(--depth == 0 || (ndone == npaths && npending == 0))
+					return(nfound);
+
+				continue;
 
-	klen= Strnlen(key, 50); /* 50 is an artificial length for the key */
+			case '"':
+				if( (j=json_next_structural(&sc)) == JSON_END)
+					return(-1);
 
-	for(i=0; i < json->nitem; i++){
-		if(strncmp(json->key[i], key, klen) == 0){
-			json_value->value= json->value[i];
-			json_value->len= json->value_l[i];
-			return(TRUE);
+				if(key_f){
+					key= s + i + 1;
+					klen= j - i - 1;
+					kkey= json_known_key(key, klen);
+					continue;
+				}
+
+				vstart= i + 1;
+				vlen= j - i - 1;
+				break;
+
+			default:
+				if(s[i] == 0x00)
+					return(-1);
+
+				if(s[i] == '{' || s[i] == '['){
+					vstart= i;
+					vlen= 0;
+					break;
+				}
+
+				vstart= i;
+				vlen= json_primitive_end(&sc) - i;
+				break;
+		}
+
+		/* s[vstart] is the beginning of a value: check whether it is the value of any path not done yet */
+		for(p=0; depth > 0 && p < npaths; p++){
+			if(done_f[p])
+				continue;
+
+			/* A previous member of this object matched the component: for duplicate keys, the first member wins */
+			if(matched[p] >= depth){
+				done_f[p]= TRUE;
+				ndone++;
+				continue;
+			}
+
+			if(matched[p] != (depth - 1) || !obj_f[depth] || ncomp[p] < depth || compkey[p][depth - 1] != kkey)
+				continue;
+
+			/* Known keys are compared by number, and only other keys are compared byte by byte */
+			if(kkey == -1 && (complen[p][depth - 1] != klen || memcmp(comp[p][depth - 1], key, klen) != 0))
+				continue;
+
+			matched[p]= depth;
+
+			if(ncomp[p] != depth){
+				/* The path cannot continue through anything but an object */
+				if(s[i] != '{'){
+					done_f[p]= TRUE;
+					ndone++;
+				}
+
+				continue;
+			}
+
+			values[p].value= s + vstart;
+			done_f[p]= TRUE;
+			ndone++;
+
+			if(s[i] == '{' || s[i] == '['){
+				pending[p]= depth + 1;
+				npending++;
+			}
+			else{
+				values[p].len= vlen;
+				nfound++;
+			}
+		}
+
+		if(ndone == npaths && npending == 0)
+			return(nfound);
+
+		if(s[i] == '{' || s[i] == '['){
+			if(depth >= JSON_MAX_DEPTH)
+				return(-1);
+
+			depth++;
+			obj_f[depth]= (s[i] == '{');
+			start[depth]= i;
+		}
+		else if(depth == 0){
+			/* The document is a single string or primitive */
+			return(nfound);
 		}
 	}
 
-	return(FALSE);
+	return(-1);
 }
 
 
 /*
- * Function: json_remove_quotes()
+ * Function: json_get_path()
  *
- * Remove quotes in keys and values
+ * Obtains the value of a dotted path of object members (see json_get_paths())
  */
 
-unsigned int json_remove_quotes(struct json *json){
-	char *buff;
-	unsigned int i;
+unsigned int json_get_path(char *s, size_t len, char *path, struct json_value *json_value){
+	return(json_get_paths(s, len, &path, json_value, 1) == 1);
+}
+
+
+/*
+ * Function: json_stream_init()
+ *
+ * Initializes the state for parsing a document incrementally. "field" is called for each scalar
+ * value (or fragment of it), with its dotted path (array elements are denoted as "[index]")
+ */
+
+void json_stream_init(struct json_stream *js, void (*field)(struct json_stream *, char *, char *, size_t, unsigned int), void *arg){
+	js->state= JSON_STREAM_VAL;
+	js->depth= 0;
+	js->plen= 0;
+	js->path[0]= 0x00;
+	js->nvalue= 0;
+	js->escaped_f= FALSE;
+	js->cont_f= FALSE;
+	js->field= field;
+	js->arg= arg;
+}
+
+
+/*
+ * Function: json_stream_path()
+ *
+ * Appends a component to the path of the current value
+ */
+
+int json_stream_path(struct json_stream *js, char *s, size_t len){
+	if(len >= (JSON_STREAM_PATH - js->plen))
+		return(FAILURE);
+
+	memcpy(js->path + js->plen, s, len);
+	js->plen+= len;
+	js->path[js->plen]= 0x00;
+	return(SUCCESS);
+}
+
+
+/*
+ * Function: json_stream_flush()
+ *
+ * Reports the buffered part of the current value. At the end of the input, it also completes a pending
+ * top-level primitive (which, unlike any other value, is only delimited by the end of the document)
+ */
+
+void json_stream_flush(struct json_stream *js, unsigned int flags){
+	js->field(js, js->path, js->value, js->nvalue, flags | (js->cont_f?JSON_FIELD_CONT:0));
+	js->nvalue= 0;
+	js->cont_f= (flags & JSON_FIELD_MORE)?TRUE:FALSE;
+
+	if(js->state == JSON_STREAM_PRIM && js->depth == 0 && !(flags & JSON_FIELD_MORE))
+		js->state= JSON_STREAM_DONE;
+}
+
 
-	for(i=0; i<json->nitem;i++){
+/*
+ * Function: json_stream_input()
+ *
+ * Parses the next chunk of a document. Keys must fit in JSON_STREAM_PATH, but values are not limited
+ * in length, and nothing but the current path and (part of a) value is kept across chunks. Returns
+ * FAILURE if the document is malformed. The document is complete once the state is JSON_STREAM_DONE
+ */
+
+int json_stream_input(struct json_stream *js, char *s, size_t len){
+	size_t			i=0, j, n;
+	unsigned int	flags, pop_f=FALSE;
+	char			idx[16];
+
+	while(i < len && js->state != JSON_STREAM_ERROR){
+		switch(js->state){
+			case JSON_STREAM_KEY:
+			case JSON_STREAM_STR:
+			case JSON_STREAM_PRIM:
+				/* Find the end of the span that belongs to the current key/value */
+				for(j=i; j < len; j++){
+					if(js->state == JSON_STREAM_PRIM){
+						if(s[j] == ',' || s[j] == '}' || s[j] == ']' || s[j] == ' ' || s[j] == '\t' || \
+							s[j] == '\n' || s[j] == '\r')
+							break;
+					}
+					else if(js->escaped_f)
+						js->escaped_f= FALSE;
+					else if(s[j] == '\\')
+						js->escaped_f= TRUE;
+					else if(s[j] == '"')
+						break;
+				}
+
+				flags= (js->state == JSON_STREAM_STR)?JSON_FIELD_STRING:0;
+
+				if(js->state == JSON_STREAM_KEY){
+					if(json_stream_path(js, s + i, j - i) == FAILURE){
+						js->state= JSON_STREAM_ERROR;
+						break;
+					}
 
-		/* We require opening and closing quotes in order to remove them */
-		if(json->key_l[i] >= 2){
-			if(*(json->key[i]) == '"' && *(json->key[i] + json->key_l[i] - 1) == '"'){
-				/* In the speial case of an empty string, we do not really need to "copy" data */
-				if(json->key_l[i] == 2){
-					*(json->key[i])= 0x00;
-					json->key_l[i]=0;
+					i= j;
 				}
 				else{
-					/* We are going to remove two characters, but need space for the NULL byte */
-					if( (buff=malloc(json->key_l[i] - 1)) == NULL){
-						return(FALSE);
+					while(i < j){
+						/* A full buffer is only reported once we know that the value continues */
+						if(js->nvalue == JSON_STREAM_VALUE)
+							json_stream_flush(js, flags | JSON_FIELD_MORE);
+
+						n= ((j - i) < (JSON_STREAM_VALUE - js->nvalue))?(j - i):(JSON_STREAM_VALUE - js->nvalue);
+						memcpy(js->value + js->nvalue, s + i, n);
+						js->nvalue+= n;
+						i+= n;
 					}
+				}
 
-					/* Copy the string plus the NULL byte */
-					memcpy(buff, (json->key[i]+1), json->key_l[i] - 2); /* 					memcpy(buff, (json->key[i]+1), json->key_l[i] - 1); */
-					*(buff + json->key_l[i] - 2)= 0x00;
-					/* Herewe copy the text string, minus the two quote signs, plus the null byte */
+				if(j == len)
+					break;
 
-					memcpy(json->key[i], buff, json->key_l[i] - 1);
-					json->key_l[i]= json->key_l[i]-2;
-					free(buff);
-				}
-			}
-		}  
-           
-		if(json->value_l[i] >= 2){
-			if(*(json->value[i]) == '"' && *(json->value[i] + json->value_l[i] -1 ) == '"'){
-				/* In the speial case of an empty string, we do not really need to "copy" data */
-				if(json->value_l[i] == 2){
-					*(json->value[i])= 0x00;
-					json->value_l[i]=0;
+				if(js->state == JSON_STREAM_KEY){
+					js->state= JSON_STREAM_COLON;
+					i++;
 				}
 				else{
-					if( (buff=malloc(json->value_l[i] - 1)) == NULL){
-						return(FALSE);
-					}
+					json_stream_flush(js, flags);
+					js->state= (js->depth > 0)?JSON_STREAM_NEXT:JSON_STREAM_DONE;
 
-					memcpy(buff, (json->value[i]+1), json->value_l[i] - 2);
-					*(buff + json->value_l[i] - 2)= 0x00;
-					memcpy(json->value[i], buff, json->value_l[i] - 1);
-					json->value_l[i]= json->value_l[i]-2;
-					free(buff);
+					/* The character that ends a primitive is processed in the next state */
+					if(flags)
+						i++;
 				}
-			}
+
+				break;
+
+			default:
+				if(s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r'){
+					i++;
+					break;
+				}
+
+				switch(js->state){
+					case JSON_STREAM_VAL:
+						if(s[i] == ']'){
+							/* Only an empty array may end where a value is expected */
+							if(js->depth == 0 || js->type[js->depth - 1] != JSON_ARRAY || js->index[js->depth - 1] > 0){
+								js->state= JSON_STREAM_ERROR;
+								break;
+							}
+
+							pop_f= TRUE;
+							break;
+						}
+						else if(s[i] == ',' || s[i] == ':' || s[i] == '}'){
+							js->state= JSON_STREAM_ERROR;
+							break;
+						}
+
+						if(js->depth > 0 && js->type[js->depth - 1] == JSON_ARRAY){
+							js->plen= js->npath[js->depth - 1];
+							snprintf(idx, sizeof(idx), "[%u]", js->index[js->depth - 1]++);
+
+							if(json_stream_path(js, idx, strlen(idx)) == FAILURE){
+								js->state= JSON_STREAM_ERROR;
+								break;
+							}
+						}
+
+						if(s[i] == '{' || s[i] == '['){
+							if(js->depth == JSON_MAX_DEPTH){
+								js->state= JSON_STREAM_ERROR;
+								break;
+							}
+
+							js->type[js->depth]= (s[i] == '{')?JSON_OBJECT:JSON_ARRAY;
+							js->index[js->depth]= 0;
+							js->npath[js->depth]= js->plen;
+							js->depth++;
+							js->state= (s[i] == '{')?JSON_STREAM_MEMBER:JSON_STREAM_VAL;
+							i++;
+						}
+						else{
+							js->nvalue= 0;
+							js->cont_f= FALSE;
+							js->escaped_f= FALSE;
+
+							if(s[i] == '"'){
+								js->state= JSON_STREAM_STR;
+								i++;
+							}
+							else
+								js->state= JSON_STREAM_PRIM;
+						}
+
+						break;
+
+					case JSON_STREAM_MEMBER:
+						if(s[i] == '}' && js->index[js->depth - 1] == 0){
+							pop_f= TRUE;
+							break;
+						}
+
+						if(s[i] != '"'){
+							js->state= JSON_STREAM_ERROR;
+							break;
+						}
+
+						js->index[js->depth - 1]++;
+						js->plen= js->npath[js->depth - 1];
+
+						if(js->plen > 0 && json_stream_path(js, ".", 1) == FAILURE){
+							js->state= JSON_STREAM_ERROR;
+							break;
+						}
+
+						js->escaped_f= FALSE;
+						js->state= JSON_STREAM_KEY;
+						i++;
+						break;
+
+					case JSON_STREAM_COLON:
+						js->state= (s[i] == ':')?JSON_STREAM_VAL:JSON_STREAM_ERROR;
+						i++;
+						break;
+
+					case JSON_STREAM_NEXT:
+						if(s[i] == ','){
+							js->state= (js->type[js->depth - 1] == JSON_OBJECT)?JSON_STREAM_MEMBER:JSON_STREAM_VAL;
+							i++;
+							break;
+						}
+						else if(js->depth > 0 && ((s[i] == '}' && js->type[js->depth - 1] == JSON_OBJECT) || \
+								(s[i] == ']' && js->type[js->depth - 1] == JSON_ARRAY))){
+							pop_f= TRUE;
+							break;
+						}
+
+						js->state= JSON_STREAM_ERROR;
+						break;
+
+					default:
+						/* Nothing but white space may follow the document */
+						js->state= JSON_STREAM_ERROR;
+						break;
+				}
+
+				/* The end of an object or array */
+				if(pop_f){
+					pop_f= FALSE;
+					js->depth--;
+					js->plen= js->npath[js->depth];
+					js->path[js->plen]= 0x00;
+					js->state= (js->depth > 0)?JSON_STREAM_NEXT:JSON_STREAM_DONE;
+					i++;
+				}
+
+				break;
 		}
 	}
 
-	return(TRUE);
+	return((js->state == JSON_STREAM_ERROR)?FAILURE:SUCCESS);
 }
 
 
@@ -1282,10 +4346,20 @@ unsigned int json_remove_quotes(struct json *json){
  * IP checksum
  */
 uint16_t in_chksum(uint16_t *addr, size_t len){
-	size_t nleft;
-	unsigned int sum = 0;
-	uint16_t *w;
-	uint16_t answer = 0;
+	return(in_chksum_fold(in_chksum_add(0, addr, len)));
+}
+
+
+/*
+ * Function: in_chksum_add()
+ *
+ * Adds the 16-bit words of a buffer to a partial Internet checksum. Partial sums of different
+ * parts of a packet can be added, as long as every part but the last one has an even length
+ */
+
+uint32_t in_chksum_add(uint32_t sum, void *addr, size_t len){
+	uint16_t	*w, answer=0;
+	size_t		nleft;
 
 	nleft=len;
 	w=addr;
@@ -1293,6 +4367,10 @@ uint16_t in_chksum(uint16_t *addr, size_t len){
 	while(nleft > 1) {
 		sum += *w++;
 		nleft -= 2;
+
+		/* Fold before the sum can overflow */
+		if(sum & 0x80000000)
+			sum = (sum >> 16) + (sum & 0xffff);
 	}
 
 	if(nleft == 1) {
@@ -1300,9 +4378,19 @@ uint16_t in_chksum(uint16_t *addr, size_t len){
 		sum += answer;
 	}
 
+	return(sum);
+}
+
+
+/*
+ * Function: in_chksum_fold()
+ *
+ * Obtains the Internet checksum corresponding to a partial sum computed with in_chksum_add()
+ */
+
+uint16_t in_chksum_fold(uint32_t sum){
+	sum = (sum >> 16) + (sum & 0xffff);
 	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
-	answer = ~sum;
-	return(answer);
+	return((uint16_t) ~sum);
 }
 
@@ -4,6 +4,7 @@
 
 #include <netdb.h>
 #include <net/if.h>  /* For  IFNAMSIZ */
+#include <pthread.h>
 
 /* General constants */
 #define SUCCESS		1
@@ -31,6 +32,10 @@
 #define ETH_HLEN	14		/* Total octets in header.	 */
 #define ETH_DATA_LEN	1500		/* Max. octets in payload	 */
 #define	ETHERTYPE_IPV6	0x86dd		/* IP protocol version 6 */
+#define	ETHERTYPE_IPV4	0x0800		/* IP protocol version 4 */
+#define	ETHERTYPE_8021Q	0x8100		/* IEEE 802.1Q VLAN tag */
+#define	VLAN_HLEN		4			/* Octets in an 802.1Q tag */
+#define	SLL_HLEN		16			/* Octets in a Linux "cooked" capture header */
 #define	ETHER_ADDR_LEN	ETH_ALEN	/* size of ethernet addr */
 #define	ETHER_HDR_LEN	ETH_HLEN	/* total octets in header */
 
@@ -775,15 +780,111 @@ struct next_hop{
 #endif
 
 
-#define MAX_JSON_ITEMS	150
+/*
+   JSON documents are tokenized in a single pass into an array of tokens provided by the caller,
+   which record the span of each value within the document (nothing is allocated or copied)
+ */
+#define JSON_MAX_TOKENS	512
+#define JSON_MAX_DEPTH	32
+#define JSON_MAX_PATHS	32		/* Paths resolved at once by json_get_paths() */
+
+#define JSON_OBJECT		1
+#define JSON_ARRAY		2
+#define JSON_STRING		3
+#define JSON_PRIMITIVE	4
+
+/* Stage one: structural characters are located 64 bytes at a time (see json_next_structural()) */
+#define JSON_BLOCK		64
+#define JSON_END		((size_t) -1)
+#define JSON_ODD_BITS	0xaaaaaaaaaaaaaaaaULL
+
+struct json_scanner{
+	char		*s;
+	size_t		len;
+	size_t		base;		/* Offset of the current block */
+	size_t		next;		/* Offset of the next block */
+	uint64_t	bits;		/* Structural positions of the current block that have not been returned */
+	uint64_t	escaped;	/* The first byte of the next block is escaped */
+	uint64_t	instring;	/* The next block starts within a string (all ones) */
+	uint64_t	scalar;		/* The last byte of the current block is part of a primitive */
+	uint64_t	ends;		/* Ends (first byte past the end) of the primitives of the current block */
+	void		(*classify)(unsigned char *, uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+};
+
+/* Expected next element of the enclosing object or array (see json_check_structural()) */
+#define JSON_EXPECT_VALUE			0
+#define JSON_EXPECT_VALUE_OR_END	1		/* Beginning of an array */
+#define JSON_EXPECT_KEY				2
+#define JSON_EXPECT_KEY_OR_END		3		/* Beginning of an object */
+#define JSON_EXPECT_COLON			4
+#define JSON_EXPECT_COMMA_OR_END	5
+
+struct json_token{
+	unsigned char	type;
+	unsigned int	start;	/* Span of the value (strings do not include the quotes) */
+	unsigned int	len;
+	unsigned int	next;	/* Token that follows the value and all its members */
+};
 
+/*
+   Keys of the TP-Link sysinfo and emeter objects. They are identified with a perfect hash (see json_known_key()),
+   such that json_get_paths() matches them against the components of paths by number
+ */
+#define JSON_KEY_SYSTEM			0
+#define JSON_KEY_GET_SYSINFO	1
+#define JSON_KEY_EMETER			2
+#define JSON_KEY_GET_REALTIME	3
+#define JSON_KEY_ERR_CODE		4
+#define JSON_KEY_ERR_MSG		5
+#define JSON_KEY_SW_VER			6
+#define JSON_KEY_HW_VER			7
+#define JSON_KEY_TYPE			8
+#define JSON_KEY_MIC_TYPE		9
+#define JSON_KEY_MODEL			10
+#define JSON_KEY_MAC			11
+#define JSON_KEY_MIC_MAC		12
+#define JSON_KEY_DEV_NAME		13
+#define JSON_KEY_ALIAS			14
+#define JSON_KEY_RELAY_STATE	15
+#define JSON_KEY_ON_TIME		16
+#define JSON_KEY_ACTIVE_MODE	17
+#define JSON_KEY_FEATURE		18
+#define JSON_KEY_UPDATING		19
+#define JSON_KEY_ICON_HASH		20
+#define JSON_KEY_RSSI			21
+#define JSON_KEY_LED_OFF		22
+#define JSON_KEY_LONGITUDE		23
+#define JSON_KEY_LATITUDE		24
+#define JSON_KEY_LONGITUDE_I	25
+#define JSON_KEY_LATITUDE_I		26
+#define JSON_KEY_HWID			27
+#define JSON_KEY_FWID			28
+#define JSON_KEY_OEMID			29
+#define JSON_KEY_DEVICEID		30
+#define JSON_KEY_CURRENT		31
+#define JSON_KEY_VOLTAGE		32
+#define JSON_KEY_POWER			33
+#define JSON_KEY_TOTAL			34
+#define JSON_KEY_CURRENT_MA		35
+#define JSON_KEY_VOLTAGE_MV		36
+#define JSON_KEY_POWER_MW		37
+#define JSON_KEY_TOTAL_WH		38
+#define JSON_KEY_NEXT_ACTION	39
+#define JSON_KEY_NTC_STATE		40
+#define JSON_KEY_STATUS			41
+
+#define JSON_NUM_KEYS			42
+
+#define JSON_KEY_SEED			6109	/* FNV-1a basis for which the top JSON_KEY_BITS of the hashes of known keys differ */
+#define JSON_KEY_BITS			7
+#define JSON_KEY_NONE			255
+
+/* View of an object of a tokenized document */
 struct json{
-	unsigned int	nitem;
-	unsigned int	maxitems; /* MAX_ITEMS */
-	char			*key[MAX_JSON_ITEMS];
-	unsigned int	key_l[MAX_JSON_ITEMS];
-	char			*value[MAX_JSON_ITEMS];
-	unsigned int	value_l[MAX_JSON_ITEMS];
+	char				*s;
+	struct json_token	*tokens;
+	unsigned int		ntokens;
+	unsigned int		obj;	/* Token of the object */
 };
 
 
@@ -792,6 +893,362 @@ struct json_value{
 	unsigned int	len;
 };
 
+/*
+   Responses that arrive in chunks (e.g. over TCP) are parsed incrementally: each scalar value is
+   reported (with its dotted path) as soon as it is complete, and long values are reported in fragments
+ */
+#define JSON_STREAM_PATH	256		/* Maximum length of the dotted path of a value */
+#define JSON_STREAM_VALUE	1024	/* Longer values are reported in fragments */
+
+/* Flags of reported values */
+#define JSON_FIELD_STRING	0x01
+#define JSON_FIELD_MORE		0x02	/* The value continues in the next fragment */
+#define JSON_FIELD_CONT		0x04	/* The fragment continues the previous one */
+
+#define JSON_STREAM_VAL		0		/* Expecting a value (or the end of an empty array) */
+#define JSON_STREAM_MEMBER	1		/* Expecting a key (or the end of an empty object) */
+#define JSON_STREAM_KEY		2
+#define JSON_STREAM_COLON	3
+#define JSON_STREAM_STR		4
+#define JSON_STREAM_PRIM	5
+#define JSON_STREAM_NEXT	6		/* Expecting a comma or the end of the enclosing object/array */
+#define JSON_STREAM_DONE	7
+#define JSON_STREAM_ERROR	8
+
+struct json_stream{
+	unsigned int	state;
+	unsigned int	depth;
+	unsigned char	type[JSON_MAX_DEPTH];		/* Open objects and arrays */
+	unsigned int	index[JSON_MAX_DEPTH];		/* Next element of each open array */
+	size_t			npath[JSON_MAX_DEPTH];		/* Length of the path of each open object/array */
+	char			path[JSON_STREAM_PATH];
+	size_t			plen;
+	char			value[JSON_STREAM_VALUE];
+	size_t			nvalue;
+	unsigned char	escaped_f;
+	unsigned char	cont_f;						/* Part of the current value has been reported */
+	void			(*field)(struct json_stream *, char *, char *, size_t, unsigned int);
+	void			*arg;
+};
+
+
+/* Resumable decryption of framed (TCP) TP-Link responses: a 4-byte length, followed by the body */
+#define TP_LINK_FRAME_HLEN	4
+
+struct tp_link_stream{
+	unsigned char	key;		/* Previous ciphertext byte (the autokey is carried across chunks) */
+	unsigned char	header[TP_LINK_FRAME_HLEN];
+	unsigned int	nheader;
+	uint32_t		length;		/* Length of the body */
+	uint32_t		nbody;		/* Bytes of the body decrypted so far */
+};
+
+
+/* Token bucket employed for pacing probe packets */
+struct token_bucket{
+	unsigned long		rate;		/* Tokens (packets) per second. Zero means "no limit" */
+	double				burst;		/* Maximum number of tokens that can be accumulated */
+	double				tokens;
+	uint64_t			last;		/* Monotonic time (in nanoseconds) of the last refill */
+	unsigned char		last_f;
+};
+
+
+#define				SIPHASH_KEY_LEN			16
+
+#define				PERMUTATION_ROUNDS		4
+
+/* Keyed pseudorandom permutation of [0, 2^nbits) */
+struct permutation{
+	unsigned int		nbits;
+	unsigned int		hbits;		/* Bits of each half of the Feistel network */
+	uint32_t			mask;		/* Mask for each half */
+	uint32_t			keys[PERMUTATION_ROUNDS];
+};
+
+/* Batches of datagrams, sent with sendmmsg() where available */
+#define				BATCH_SIZE				64
+#define				BATCH_BUFFER_SIZE		9216
+
+struct batch{
+	unsigned int		size;		/* Number of datagram slots */
+	unsigned int		n;			/* Slots in use */
+	size_t				bufflen;	/* Size of each slot */
+	char				*buff;
+	size_t				*len;
+	struct sockaddr_in	*addr;		/* Destination of each datagram */
+#ifdef __linux__
+	struct mmsghdr		*msgs;
+	struct iovec		*iov;
+#endif
+};
+
+#define				BATCH_SLOT(batch, i)	((batch)->buff + (size_t) (i) * (batch)->bufflen)
+
+
+/*
+   Pool of reference-counted packet buffers, carved out of one allocation of fixed-size,
+   cache-aligned slabs. Each slab holds the buffer header followed by the datagram, plus one
+   spare byte, such that text payloads can be NUL-terminated in place.
+ */
+#define				PKTPOOL_SIZE			256
+#define				PKTPOOL_ALIGN			64
+#define				PKTBUF_HDRLEN			64		/* Header space at the start of each slab */
+#define				PKTBUF_MAX_BATCH		64		/* Datagrams received with a single recv_pktbufs() */
+
+struct pktpool;
+
+struct pktbuf{
+	struct pktbuf		*next;		/* Next free buffer */
+	struct pktpool		*pool;
+	unsigned int		refs;
+	size_t				len;
+	struct sockaddr_in	addr;		/* Source of the datagram */
+};
+
+struct pktpool{
+	char				*slabs;
+	size_t				slablen;
+	size_t				bufsize;	/* Maximum datagram size */
+	unsigned int		nbufs;
+	unsigned int		nfree;
+	struct pktbuf		*free;
+	pthread_mutex_t		mutex;
+	unsigned long long	ntrunc;		/* Truncated datagrams discarded by recv_pktbufs() */
+	unsigned long long	nexhausted;	/* Times no buffer was available */
+};
+
+#define				PKTBUF_DATA(pkt)		((char *) (pkt) + PKTBUF_HDRLEN)
+
+
+/*
+   Capture of responses with libpcap in immediate mode (which, on Linux, employs a memory-mapped
+   TPACKET_V3 ring), such that frames are delivered as soon as they arrive
+ */
+#define				CAPTURE_SNAPLEN			65535
+#define				CAPTURE_BUFFER_SIZE		(4 * 1024 * 1024)
+#define				CAPTURE_FILTER_LEN		512
+
+/* Capture files in the classic pcap format, mapped into memory and processed in place */
+#define				CAPFILE_HDRLEN			24
+#define				CAPFILE_MAGIC_USEC		0xa1b2c3d4
+#define				CAPFILE_MAGIC_NSEC		0xa1b23c4d
+#define				CAPFILE_LINKTYPE_MASK	0x0fffffff	/* The upper bits may carry FCS information */
+
+struct capfile{
+	unsigned char		*map;
+	size_t				size;
+	size_t				offset;		/* Next frame record */
+	int					dlt;
+	unsigned char		swap_f;		/* Written with the opposite byte order */
+	unsigned char		nsec_f;		/* Timestamps have nanosecond resolution */
+};
+
+
+/*
+   Response fingerprints: byte patterns (with a mask, at a fixed offset or anywhere in the payload)
+   that valid responses of a given length range contain. A run of significant bytes of each pattern
+   is fed to an Aho-Corasick automaton, such that a payload is classified in a single pass.
+
+   Fingerprint files are a header (the "IOTF" magic, a version byte, a reserved byte and the number of
+   records) followed by the records: family (1 byte), flags (1), offset (2), minimum length (2),
+   maximum length (2), pattern length (2), description length (1), pattern, mask and description.
+   Multi-byte fields are in network byte order
+ */
+#define				FP_ANY_OFFSET			((size_t) -1)
+#define				FP_ANY_LENGTH			((size_t) -1)
+#define				FP_ANY_FAMILY			((unsigned int) -1)
+#define				FP_MAX_KEY				16			/* Longest run of a pattern fed to the automaton */
+#define				FP_MAX_STATES			65535
+#define				FP_FILE_MAGIC			"IOTF"
+#define				FP_FILE_VERSION			1
+#define				FP_FILE_HDRLEN			8
+#define				FP_FILE_RECLEN			11
+#define				FP_FILE_ANY_OFFSET		0x01		/* Record flag: the pattern may be anywhere */
+#define				FP_FILE_ANY_LENGTH		0xffff		/* Maximum length: no maximum length */
+
+struct fingerprint{
+	unsigned int		family;
+	char				*desc;
+	unsigned char		*pattern;
+	unsigned char		*mask;		/* NULL if all the bytes of the pattern are significant */
+	size_t				npattern;
+	size_t				offset;		/* FP_ANY_OFFSET if the pattern may be anywhere */
+	size_t				minlen;		/* Range of valid payload lengths */
+	size_t				maxlen;
+	size_t				keyoff;		/* Run of the pattern fed to the automaton */
+	size_t				nkey;
+	struct fingerprint	*next;		/* Next fingerprint with the same key (or without a key) */
+};
+
+struct fpdb{
+	struct fingerprint	*fps;
+	unsigned int		nfps;
+	unsigned int		maxfps;
+	uint16_t			*delta;		/* Transitions of the automaton (256 per state) */
+	uint16_t			*link;		/* Closest state along the failure links where a key ends (0 if none) */
+	struct fingerprint	**keys;		/* Fingerprints whose key ends at each state */
+	struct fingerprint	*nokey;		/* Fingerprints that only check the payload length */
+	unsigned int		nstates;
+	unsigned char		**files;	/* Fingerprint files (the records point into them) */
+	unsigned int		nfiles;
+};
+
+
+/* Event loop (epoll and timerfd on Linux, poll() elsewhere) */
+#define				REACTOR_READ			0x01
+#define				REACTOR_WRITE			0x02
+#define				REACTOR_ERROR			0x04
+#define				REACTOR_MAX_EVENTS		64
+#define				REACTOR_MIN_FDS			64
+#define				REACTOR_MIN_TIMERS		16
+#define				REACTOR_TIMER_INACTIVE	0xffffffff
+
+struct reactor;
+
+struct reactor_fd{
+	void				(*callback)(struct reactor *, int, unsigned int, void *);
+	void				*arg;
+	unsigned int		events;		/* REACTOR_READ and/or REACTOR_WRITE */
+};
+
+struct reactor_timer{
+	uint64_t			expiry;		/* Monotonic time (in nanoseconds) at which the timer fires */
+	void				(*callback)(struct reactor *, void *);
+	void				*arg;
+	unsigned int		index;		/* Position in the timer heap, or REACTOR_TIMER_INACTIVE */
+};
+
+struct reactor{
+	struct reactor_fd		*fds;		/* Indexed by descriptor */
+	unsigned int			nfds;
+	unsigned int			nregistered;
+	struct reactor_timer	**timers;	/* Binary heap, ordered by expiry time */
+	unsigned int			ntimers;
+	unsigned int			maxtimers;
+	uint64_t				now;		/* Monotonic time (in nanoseconds) of the last wake-up */
+	unsigned char			stop_f;
+#ifdef __linux__
+	int						epfd;
+	int						tfd;
+	uint64_t				tfd_expiry;	/* Expiry time the timerfd is currently armed for */
+#else
+	struct pollfd			*pfds;
+#endif
+};
+
+#define				REACTOR_TIMER_ACTIVE(timer)	((timer)->index != REACTOR_TIMER_INACTIVE)
+
+
+/* Time is measured in nanoseconds of the monotonic clock */
+#define				NSEC_PER_USEC			1000ULL
+#define				NSEC_PER_MSEC			1000000ULL
+#define				NSEC_PER_SEC			1000000000ULL
+
+
+/*
+   Hierarchical timing wheel: TWHEEL_LEVELS wheels of TWHEEL_SLOTS slots each, where every slot of
+   a wheel spans a full revolution of the wheel below it. Events that are too far in the future
+   for the lowest wheel are cascaded down as time advances.
+ */
+#define				TWHEEL_BITS				8
+#define				TWHEEL_SLOTS			(1 << TWHEEL_BITS)
+#define				TWHEEL_MASK				(TWHEEL_SLOTS - 1)
+#define				TWHEEL_LEVELS			4
+#define				TWHEEL_MAX_TICKS		(((uint64_t) 1 << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1)
+
+/* Meant to be embedded in the structure the event refers to */
+struct twheel_entry{
+	struct twheel_entry		*next;
+	struct twheel_entry		**pprev;	/* NULL if the entry is not linked to any list */
+	uint64_t				expiry;		/* Tick at which the event fires */
+};
+
+struct twheel{
+	struct twheel_entry		*slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+	uint64_t				base;		/* Monotonic time (in nanoseconds) of tick 0 */
+	uint64_t				tick;		/* Length of a tick (in nanoseconds) */
+	uint64_t				current;	/* Last tick that has been processed */
+	unsigned long			n;			/* Scheduled events */
+};
+
+#define				TWHEEL_ENTRY_LINKED(entry)	((entry)->pprev != NULL)
+
+
+/*
+   Retransmission timeout (RTO) estimation, as in RFC 6298. The lower bound is well below the
+   one second recommended for TCP, since the devices we talk to are typically on the local network.
+ */
+#define				RTO_MIN					(10 * NSEC_PER_MSEC)
+#define				RTO_MAX					(60 * NSEC_PER_SEC)
+#define				RTO_GRANULARITY			(1 * NSEC_PER_MSEC)
+
+/*
+   Detection of the end of a round of responses: response inter-arrival times are assumed to be
+   exponentially distributed, and the round ends once the probability of a further response
+   drops below a threshold.
+ */
+#define				QUIESCENCE_THRESHOLD	0.01
+
+struct quiescence{
+	uint64_t			last;		/* Time of the last response (or of the start of the round) */
+	double				gap;		/* Smoothed inter-arrival time of responses (in nanoseconds) */
+	unsigned long		n;			/* Responses so far */
+	double				threshold;
+};
+
+struct rtt_estimator{
+	uint64_t			srtt;		/* Smoothed round-trip time (in nanoseconds) */
+	uint64_t			rttvar;		/* Round-trip time variation (in nanoseconds) */
+	uint64_t			rto;		/* Current retransmission timeout (in nanoseconds) */
+	unsigned long		nsamples;
+};
+
+/*
+   Request/response session over UDP: the request is (re)transmitted with the estimated RTO, and
+   responses are processed until they are no longer expected. Tools only supply the callbacks that
+   send the request and process the responses pending on a socket.
+ */
+struct udp_session{
+	struct reactor			reactor;
+	struct reactor_timer	rtx_timer;
+	struct reactor_timer	end_timer;
+	int						fd;			/* Socket employed for sending the request */
+	unsigned int			ntrans;		/* Transmissions of the request */
+	uint64_t				timeout;	/* Response timeout after the last transmission (in nanoseconds) */
+	unsigned int			retrans;	/* Transmissions so far */
+	uint64_t				sent;		/* Time of the last transmission */
+	unsigned char			sampled_f;	/* The RTT of the last transmission has been sampled */
+	struct rtt_estimator	rtt;
+	struct quiescence		quiet;
+	unsigned char			error_f;
+	void					(*send)(struct udp_session *, int);
+	unsigned int			(*receive)(struct udp_session *, int);	/* Returns the number of responses processed */
+	void					*arg;
+};
+
+/*
+   Lock-free single-producer/single-consumer ring of fixed-size records. "head" is only written
+   by the producer and "tail" only by the consumer, and each of them lives in its own cache line.
+ */
+#define				RING_CACHELINE			64
+#define				RING_WAIT_INTERVAL		(100 * NSEC_PER_USEC)
+
+struct ring{
+	char				*buff;
+	size_t				reclen;		/* Size of each record */
+	unsigned int		size;		/* Number of records (a power of two) */
+	unsigned int		mask;
+	char				pad0[RING_CACHELINE];
+	unsigned int		head;		/* Next record to be written */
+	char				pad1[RING_CACHELINE];
+	unsigned int		tail;		/* Next record to be read */
+	char				pad2[RING_CACHELINE];
+	unsigned long long	ndropped;	/* Records discarded because the ring was full */
+	uint64_t			blocked;	/* Time (in nanoseconds) the producer waited for room in the ring */
+};
+
+#define				RING_RECORD(ring, i)	((ring)->buff + (size_t) ((i) & (ring)->mask) * (ring)->reclen)
 
 #define				IP_LIMITED_MULTICAST	"255.255.255.255"
 #define				NULL_STRING	""
@@ -799,6 +1256,19 @@ struct json_value{
 /* XXX Should use different constant */
 #define				MAX_TP_COMMAND_LENGTH	10000
 #define				TP_LINK_IP_CAMERA_TDDP_PORT	1068
+#define				TP_LINK_KEY			171
+
+/* The TP-Link autokey cipher and JSON scanning employ SSE2 and (if supported by the CPU) AVX2 on x86 */
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+	#define			X86_SIMD
+	#define			TP_LINK_SIMD_MIN	64		/* Shorter buffers are processed one byte at a time */
+#endif
+
+/* SIMD implementations (see simd_select()) */
+#define				SIMD_AUTO			0
+#define				SIMD_SCALAR			1
+#define				SIMD_SSE2			2
+#define				SIMD_AVX2			3
 
 
 int					init_iface_data(struct iface_data *);
@@ -810,30 +1280,136 @@ void				*find_iface_by_name(struct iface_list *, char *);
 void				*find_iface_by_addr(struct iface_list *, void *, sa_family_t);
 void				*find_v4addr(struct iface_list *);
 void				*find_v4addr_for_iface(struct iface_list *, char *);
+int					find_v4addr_for_dst(struct in_addr *, struct in_addr *);
 int					get_local_addrs(struct iface_data *);
 int					is_ip_in_prefix_list(struct in_addr *, struct prefixv4_list *);
 int					is_ip6_in_prefix_list(struct in6_addr *, struct prefix_list *);
 int					is_time_elapsed(struct timeval *, struct timeval *, unsigned long);
+int					is_time_elapsed_ns(uint64_t, uint64_t, uint64_t);
 void				release_privileges(void);
 size_t				Strnlen(const char *, size_t);
-struct timeval		timeval_sub(struct timeval *, struct timeval *);
-float				time_diff_ms(struct timeval *, struct timeval *);
+int					simd_select(int);
+int					simd_level(void);
 void				tp_link_crypt(unsigned char *, size_t);
 void				tp_link_decrypt(unsigned char *, size_t);
+unsigned char		tp_link_decrypt_chunk(unsigned char *, size_t, unsigned char);
+void				tp_link_stream_init(struct tp_link_stream *);
+int					tp_link_stream_input(struct tp_link_stream *, unsigned char *, size_t, unsigned char **, size_t *);
+#ifdef X86_SIMD
+size_t				tp_link_crypt_sse2(unsigned char *, size_t);
+size_t				tp_link_crypt_avx2(unsigned char *, size_t);
+size_t				tp_link_decrypt_sse2(unsigned char *, size_t);
+size_t				tp_link_decrypt_avx2(unsigned char *, size_t);
+#endif
+void				tb_init(struct token_bucket *, unsigned long, unsigned long);
+void				tb_refill(struct token_bucket *, uint64_t);
+unsigned int		tb_consume(struct token_bucket *, uint64_t);
+uint64_t			tb_wait_time(struct token_bucket *, uint64_t);
+uint64_t			siphash(const unsigned char *, const void *, size_t);
+void				random_key(unsigned char *, size_t);
+int					decode_ipv4_udp(unsigned char *, size_t, struct ip_hdr *, struct udp_hdr *, unsigned char **, size_t *);
+int					decode_frame(int, unsigned char *, size_t, struct ip_hdr *, struct udp_hdr *, unsigned char **, size_t *);
+pcap_t				*open_capture(char *, char *);
+int					open_capfile(struct capfile *, char *);
+int					next_capfile_frame(struct capfile *, struct pcap_pkthdr *, unsigned char **);
+void				close_capfile(struct capfile *);
+uint32_t			swap32(uint32_t);
+void				init_fpdb(struct fpdb *);
+int					add_fingerprint(struct fpdb *, struct fingerprint *);
+int					load_fingerprints(struct fpdb *, char *, unsigned int);
+int					parse_fingerprints(struct fpdb *, unsigned char *, size_t, unsigned int);
+int					compile_fpdb(struct fpdb *);
+unsigned int		check_fingerprint(struct fingerprint *, unsigned char *, size_t, size_t);
+struct fingerprint	*match_fingerprint(struct fpdb *, unsigned char *, size_t, unsigned int);
+void				destroy_fpdb(struct fpdb *);
+void				init_permutation(struct permutation *, unsigned int, uint64_t);
+uint32_t			permutation_round(uint32_t, uint32_t);
+uint32_t			permute_index(struct permutation *, uint32_t);
+int					create_batch(struct batch *, unsigned int, size_t);
+void				destroy_batch(struct batch *);
+int					batch_add(struct batch *, void *, size_t, struct sockaddr_in *);
+void				batch_drop(struct batch *, unsigned int);
+int					send_batch(int, struct batch *);
+int					create_pktpool(struct pktpool *, unsigned int, size_t);
+void				destroy_pktpool(struct pktpool *);
+struct pktbuf		*pktbuf_alloc(struct pktpool *);
+void				pktbuf_ref(struct pktbuf *);
+void				pktbuf_unref(struct pktbuf *);
+int					recv_pktbufs(int, struct pktpool *, struct pktbuf **, unsigned int);
+uint64_t			monotonic_nsec(void);
+int					reactor_init(struct reactor *);
+void				reactor_destroy(struct reactor *);
+int					reactor_add(struct reactor *, int, unsigned int, void (*)(struct reactor *, int, unsigned int, void *), void *);
+int					reactor_set_events(struct reactor *, int, unsigned int);
+int					reactor_del(struct reactor *, int);
+void				reactor_timer_init(struct reactor_timer *, void (*)(struct reactor *, void *), void *);
+void				reactor_timer_swap(struct reactor *, unsigned int, unsigned int);
+void				reactor_timer_sift(struct reactor *, unsigned int);
+int					reactor_timer_set(struct reactor *, struct reactor_timer *, uint64_t);
+void				reactor_timer_cancel(struct reactor *, struct reactor_timer *);
+void				reactor_stop(struct reactor *);
+int					reactor_run(struct reactor *);
+void				twheel_init(struct twheel *, uint64_t, uint64_t);
+void				twheel_link(struct twheel_entry **, struct twheel_entry *);
+void				twheel_unlink(struct twheel_entry *);
+void				twheel_place(struct twheel *, struct twheel_entry *);
+void				twheel_add(struct twheel *, struct twheel_entry *, uint64_t);
+void				twheel_cancel(struct twheel *, struct twheel_entry *);
+void				twheel_cascade(struct twheel *, unsigned int);
+unsigned long		twheel_advance(struct twheel *, uint64_t, void (*)(struct twheel *, struct twheel_entry *, void *), void *);
+uint64_t			twheel_next_expiry(struct twheel *);
+void				rtt_init(struct rtt_estimator *, uint64_t);
+void				rtt_sample(struct rtt_estimator *, uint64_t);
+uint64_t			rtt_rto(struct rtt_estimator *, unsigned int);
+void				quiescence_init(struct quiescence *, double, uint64_t);
+void				quiescence_event(struct quiescence *, uint64_t);
+uint64_t			quiescence_deadline(struct quiescence *, uint64_t, uint64_t);
+int					udp_session_init(struct udp_session *, int, unsigned int, uint64_t, uint64_t, double, \
+									 void (*)(struct udp_session *, int), unsigned int (*)(struct udp_session *, int), void *);
+int					udp_session_add(struct udp_session *, int);
+int					udp_session_run(struct udp_session *);
+void				udp_session_io(struct reactor *, int, unsigned int, void *);
+void				udp_session_retransmit(struct reactor *, void *);
+void				udp_session_schedule_end(struct udp_session *);
+void				udp_session_end(struct reactor *, void *);
+int					create_ring(struct ring *, unsigned int, size_t);
+void				destroy_ring(struct ring *);
+void				*ring_reserve(struct ring *, unsigned int);
+void				ring_commit(struct ring *);
+void				*ring_peek(struct ring *);
+void				ring_release(struct ring *);
 void				dump_hex(void *, size_t);
 void				dump_text(void* ptr, size_t s);
 
 
 
 
-int json_free_struct(struct json *);
-void json_print_objects(struct json *);
+void json_classify(unsigned char *, uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+#ifdef X86_SIMD
+void json_classify_sse2(unsigned char *, uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+void json_classify_avx2(unsigned char *, uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+#endif
+uint64_t prefix_xor(uint64_t);
+void json_scanner_init(struct json_scanner *, char *, size_t);
+void json_index_block(struct json_scanner *);
+size_t json_next_structural(struct json_scanner *);
+size_t json_primitive_end(struct json_scanner *);
+int json_check_structural(unsigned int *, char, unsigned int);
+int json_tokenize(char *, size_t, struct json_token *, unsigned int);
+int json_parse(struct json *, char *, size_t, struct json_token *, unsigned int);
+uint32_t json_key_hash(char *, size_t, uint32_t);
+int json_known_key(char *, size_t);
+unsigned int json_find_key(struct json *, char *);
 unsigned int json_get_value(struct json *, struct json_value *, char *);
-struct json * json_get_objects(char *, unsigned int);
-unsigned int json_add_item(struct json *, char *, unsigned int, char *, unsigned int);
-struct json * json_alloc_struct(void);
-int is_valid_json_string(char *, unsigned int);
-unsigned int json_remove_quotes(struct json *);
+unsigned int json_get_object(struct json *, struct json *, char *);
+int json_get_paths(char *, size_t, char **, struct json_value *, unsigned int);
+unsigned int json_get_path(char *, size_t, char *, struct json_value *);
+void json_stream_init(struct json_stream *, void (*)(struct json_stream *, char *, char *, size_t, unsigned int), void *);
+int json_stream_path(struct json_stream *, char *, size_t);
+void json_stream_flush(struct json_stream *, unsigned int);
+int json_stream_input(struct json_stream *, char *, size_t);
 uint16_t in_chksum(uint16_t *, size_t);
+uint32_t in_chksum_add(uint32_t, void *, size_t);
+uint16_t in_chksum_fold(uint32_t);
 
 